@@ -7,32 +7,131 @@
 #include "intersection.h"
 
 #include <vector>
+#include <cstdint>
+#include <limits>
 
 // This file defines the Bounding Volume Hierarchy (BVH) structure for efficient ray tracing
-// It includes the BVHNode class, functions for building the BVH, and intersection methods
+// It includes the flattened BVH, functions for building it, and intersection methods
+
+class TriangleMesh; 
+class ParticleSet; 
+
+// Deepest tree the builders produce, traversal uses a stack of this size
+constexpr int BVH_MAX_DEPTH = 64; 
+
+// A node of the flattened BVH, 32 bytes so two nodes share a cache line
+// The bounds are floats rounded outward, so they always contain the double precision bounds of the primitives.
+// Nodes are stored in depth-first order: the first child of an interior node directly follows it
+// and offset holds the index of the second child. For a leaf offset is the index of its first primitive
+// in BVH::primitives and count the number of primitives it holds.
 struct BVHNode
 {
-    AABB bbox; 
-    BVHNode* left = nullptr; 
-    BVHNode* right = nullptr; 
-    std::vector<Shape*> primitives;  
-    bool isLeaf = false; 
+    float bbox_min[3]; 
+    float bbox_max[3]; 
+    int offset = 0; 
+    uint16_t count = 0; // Zero for interior nodes
+    uint8_t axis = 0; // Axis the node was split along
+    uint8_t pad = 0; 
+
+    bool isLeaf() const {return count > 0;} 
+    AABB bounds() const; 
+}; 
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode should stay 32 bytes"); 
+
+// A node of the 4-wide BVH, collapsed from the binary tree so all four child boxes can be tested at once
+// The bounds are stored per axis (structure of arrays) as outward rounded floats, one lane per child.
+// A child with count > 0 is a leaf holding primitives [child,child + count), a child with count 0 is the
+// wide node at index child, and an unused slot has child -1 and empty bounds that no ray can hit.
+struct alignas(16) BVH4Node
+{
+    float bbox_min[3][4]; 
+    float bbox_max[3][4]; 
+    int child[4] = {-1,-1,-1,-1}; 
+    uint16_t count[4] = {0,0,0,0}; 
+    uint8_t child_count = 0; 
 
+    BVH4Node(); // Every lane starts unused, with empty bounds
 }; 
 
-// Function prototypes for BVH operations
-bool comp_xaxis(Shape* a, Shape* b);
+static_assert(sizeof(BVH4Node) == 128, "BVH4Node should stay two cache lines"); 
+
+// Available strategies for splitting the primitives of a BVH node
+// MEDIAN: sort along the longest centroid axis and split in half
+// SAH: bin the centroids and split where the surface area heuristic is cheapest
+// LBVH: sort the centroids along a Morton curve and split where the codes first differ, the fastest to build
+enum class BVH_BUILDER
+{
+    MEDIAN,
+    SAH,
+    LBVH
+}; 
+
+// Settings for building a BVH
+// Leaves never hold more than maxPrimsPerLeaf primitives. The MEDIAN builder splits every node above that size,
+// the SAH builder may also keep a smaller node as a leaf when that is cheaper than its best split.
+// The SAH costs are relative, only the ratio of traversal_cost to intersection_cost matters
+struct BVHBuildSettings
+{
+    BVH_BUILDER builder = BVH_BUILDER::SAH; 
+    int maxPrimsPerLeaf = 4; 
+    double traversal_cost = 1.0; // Cost of testing a ray against one interior node
+    double intersection_cost = 1.0; // Cost of testing a ray against one primitive
+    int bin_count = 16; // Number of centroid bins per axis for the SAH builder
+    int parallel_threshold = 4096; // Ranges with more primitives than this are split up front and their subtrees built on separate threads
+    bool lbvh_refine = false; // LBVH only, rebuilds the levels above clusters of primitives that share their top Morton bits with the SAH
+    int leaf_alignment = 1; // BVHs built over bounds only, every leaf starts at a multiple of this in indices so its primitives can be packed in blocks
+}; 
+
+// How the leaves test one primitive, worked out when the BVH is built
+// type is the primitive's shape_type if the leaves have a kernel for it and OTHER if they go through its virtual methods.
+// Triangles of either kind are TRIANGLE, with index locating their vertices in BVH::triangles
+struct BVHPrimitiveTag
+{
+    SHAPE_TYPE type = SHAPE_TYPE::OTHER; 
+    int index = -1; 
+}; 
 
-bool comp_yaxis(Shape* a, Shape* b); 
+// The vertices of a triangle primitive, copied out of its shape so the leaves read them from one compact array
+// The copy is 96 bytes on top of the shape, which stays in BVH::primitives for shading. It is taken when the BVH is
+// built, refitted or inserted into, so it goes stale if the triangle is edited in between
+struct BVHTriangle
+{
+    Point p1; 
+    Point p2; 
+    Point p3; 
+}; 
 
-bool comp_zaxis(Shape* a, Shape* b);
+// A flattened BVH: every node in one array and the leaves' primitives in another
+// The builders produce the binary nodes, which are then collapsed into wide_nodes for traversal.
+// The primitives are also compiled down to tags and triangles for the leaves, so shapes that move or change need
+// refit_bvh (or a rebuild) before the next trace.
+// An empty BVH has no nodes, and it is released with a single delete
+struct BVH
+{
+    std::vector<BVHNode> nodes; 
+    std::vector<BVH4Node> wide_nodes; 
+    std::vector<Shape*> primitives; 
+    std::vector<BVHPrimitiveTag> tags; // One per primitive
+    std::vector<BVHTriangle> triangles; 
+    std::vector<int> indices; // Leaves of a BVH built over bounds alone (a mesh's triangles) refer to their primitives here instead, gaps left by leaf_alignment hold -1
+    BVHBuildSettings settings; // Settings the BVH was built with, used again to measure and rebuild it
+    double build_cost = 0; // SAH cost of the tree right after it was built, see refit_bvh
+}; 
 
-// Function to sort primitives by their centroid along a specified axis
-void sortPrimitivesByCentroid(std::vector<Shape*>& primitives, AXIS ax);
+// A primitive as seen by the builders: its bounds in the space of the BVH and their centroid
+// BVHs built over bounds alone have no shape, their leaves record the primitive's index instead
+struct BVHPrimitive
+{
+    Shape* shape; 
+    AABB bounds; 
+    Point centroid; 
+    int index = -1; 
+}; 
 
-// Function to compute the bounding box of a list of shapes
-// Returns a pair of AABBs: the bounding box of the entire list and the bounding box of the centroids
-std::pair<AABB,AABB> computeBoundingBox(std::vector<Shape*>& primitives);
+// Function prototypes for BVH operations
+// Centroid of a shape's bounds in the space of its parent, this is what the builders split on
+Point shape_centroid(const Shape* s); 
 
 // Function to choose the axis for splitting the bounding box based on the longest dimension
 // Returns the axis that has the largest extent in the bounding box
@@ -43,24 +142,84 @@ AABB box_union(const AABB& box1, const AABB& box2);
 
 // Function to build the BVH from a list of shapes
 // Takes a vector of shapes and a maximum number of primitives per leaf node
-BVHNode* build_bvh(std::vector<Shape*>& primitives, int maxPrimsPerLeaf); 
-BVHNode* build_bvh_recursive(std::vector<Shape*>& primitives,int maxPrimsPerLeaf); 
+BVH* build_bvh(std::vector<Shape*>& primitives, int maxPrimsPerLeaf); 
+
+// Function to build the BVH with the builder and costs chosen in settings
+// build_bvh(primitives,maxPrimsPerLeaf) is the MEDIAN builder with the given leaf size
+BVH* build_bvh(std::vector<Shape*>& primitives, const BVHBuildSettings& settings); 
+
+// Function to build the BVH over primitives that are only given by their bounds, such as the triangles of a mesh
+// The leaves refer to bounds[i] by i through BVH::indices, the owner of the primitives intersects them
+BVH* build_bvh(const std::vector<AABB>& bounds, const BVHBuildSettings& settings); 
+
+// Builders for primitives[start,end), they append the subtree to bvh in depth-first order and return the index of its root
+int build_bvh_median(BVH& bvh, std::vector<BVHPrimitive>& primitives, int start, int end, int maxPrimsPerLeaf, int depth = 0); 
+int build_bvh_sah(BVH& bvh, std::vector<BVHPrimitive>& primitives, int start, int end, const BVHBuildSettings& settings, int depth = 0); 
+int build_bvh_lbvh(BVH& bvh, std::vector<BVHPrimitive>& primitives, int start, int end, const BVHBuildSettings& settings, int depth = 0); 
+
+// Function to insert one shape into a built BVH without rebuilding it
+// The shape gets its own leaf next to the node where it adds the least surface area to the tree, found with a
+// branch and bound search. The insertion shifts the nodes behind the new leaf and rebuilds the wide nodes, which is
+// linear but far cheaper than a build. The tree is kept within half of BVH_MAX_DEPTH (or its height if it is already
+// deeper), returns false and leaves the BVH alone if there is no room left for the shape
+bool bvh_insert(BVH* bvh, Shape* s); 
+
+// Function to refit the BVH to the current bounds of its primitives, keeping its topology
+// Leaves take the union of their primitives' bounds and every interior node the union of its children, then the wide
+// nodes are rebuilt and the primitives compiled again. Returns the SAH cost of the refitted tree divided by its cost when it was built, callers rebuild
+// once that ratio shows that moving primitives have spread the nodes too far. BVHs built over bounds alone are left as they are
+double refit_bvh(BVH* bvh); 
+
+// Function to compute the SAH cost of the BVH with the traversal and intersection costs of its settings
+// Every node costs its surface area relative to the root times the cost of testing it and, for leaves, its primitives
+double bvh_sah_cost(const BVH* bvh); 
+
+// Function to free what a BVH built over bounds alone only needs while it is built
+// Traversal reads the wide nodes alone, so the binary nodes go, and the indices too unless keep_indices is set (leave
+// it unset when the owner has put its primitives in leaf order or copied the indices out). Afterwards the BVH can still
+// be traversed but not refitted, inserted into, measured or counted, rebuild it instead
+void compact_bvh(BVH* bvh, bool keep_indices); 
+
+// Function to rebuild the wide nodes of the BVH from its binary nodes
+// Every interior node pulls up the children of its largest interior children until it has four
+void collapse_bvh(BVH& bvh); 
 
 // Function to intersect a ray with the BVH
-// Returns a vector of intersections found along the ray
-std::vector<Intersection> bvh_intersect(BVHNode* node,const Ray& r); 
-bool bvh_intersect_recursive(BVHNode* node, const Ray& r,std::vector<Intersection>& xs); 
+// Returns a vector of intersections found along the ray, including those behind its origin.
+// Nodes that the ray only enters beyond t_max are skipped, but hits beyond t_max from the leaves that are visited are still returned
+std::vector<Intersection> bvh_intersect(const BVH* bvh,const Ray& r, double t_max = std::numeric_limits<double>::infinity()); 
+// Same as above, appending the intersections to xs instead
+void bvh_intersect(const BVH* bvh, const Ray& r, std::vector<Intersection>& xs, double t_max = std::numeric_limits<double>::infinity()); 
+
+// Function to find the nearest intersection in the BVH with 0 < t < t_max
+// Returns false and leaves hit alone if there is none
+bool bvh_intersect_closest(const BVH* bvh, const Ray& r, Intersection& hit, double t_max = std::numeric_limits<double>::infinity()); 
+
+// Function to check whether anything in the BVH blocks the ray with 0 < t < max_distance
+// Returns as soon as the first occluder is found, which need not be the nearest one
+bool bvh_occluded(const BVH* bvh, const Ray& r, double max_distance); 
+
+// The same three queries for a BVH built over the triangles of a mesh, the leaves are tested with mesh.intersect_block
+void bvh_intersect(const BVH* bvh, const TriangleMesh& mesh, const Ray& r, std::vector<Intersection>& xs); 
+bool bvh_intersect_closest(const BVH* bvh, const TriangleMesh& mesh, const Ray& r, Intersection& hit, double t_max); 
+bool bvh_occluded(const BVH* bvh, const TriangleMesh& mesh, const Ray& r, double max_distance); 
+
+// The same three queries for a BVH built over a particle set, the leaves are tested with set.intersect_particle
+void bvh_intersect(const BVH* bvh, const ParticleSet& set, const Ray& r, std::vector<Intersection>& xs); 
+bool bvh_intersect_closest(const BVH* bvh, const ParticleSet& set, const Ray& r, Intersection& hit, double t_max); 
+bool bvh_occluded(const BVH* bvh, const ParticleSet& set, const Ray& r, double max_distance); 
 
 // Function to count the number of primitives in the BVH
-int count_bvh(BVHNode* bvh); 
+int count_bvh(const BVH* bvh); 
 
 // Function to delete the BVH and free memory
-void delete_bvh(BVHNode* node); 
+void delete_bvh(BVH* bvh); 
 
 // Function to print statistics about the BVH structure
-void print_bvh_stats(BVHNode* node, int depth = 0); 
+void print_bvh_stats(const BVH* bvh, int node = 0, int depth = 0); 
 
-// Function to flatten a BVH into a list of shapes
+// Function to flatten a hierarchy of shapes into a list of its leaf shapes
+// Every group transform is baked into the leaves first, so the leaves can be intersected without their groups
 void flatten(const std::vector<Shape*>& in_list,std::vector<Shape*>& out_list);
 
 #endif
\ No newline at end of file
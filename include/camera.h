@@ -18,7 +18,7 @@ class Camera
         int vsize; 
 
         double field_of_view; 
-        Matrix transform; 
+        Matrix4 transform; 
 
         double half_width; 
         double half_height; 
@@ -26,10 +26,8 @@ class Camera
         double pixel_size; 
 
         //constructors
-        Camera(int _hsize, int _vsize, double _fov):hsize(_hsize),vsize(_vsize),field_of_view(_fov),transform(Matrix(4,4)) 
+        Camera(int _hsize, int _vsize, double _fov):hsize(_hsize),vsize(_vsize),field_of_view(_fov),transform(Matrix4()) 
         {
-            this->transform.setIdentity();
-            
             double half_view = tan(this->field_of_view /2.f); 
             double aspect = (double)this->hsize / (double)this->vsize; 
 
@@ -10,6 +10,7 @@
 
 //Forward include to break circular dependencies
 class Shape;
+class Material;
 
 // This file defines the Intersection class and Computations class for ray tracing
 // The Intersection class represents an intersection between a ray and a shape
@@ -21,6 +22,8 @@ class Intersection
 
         double u = 0; 
         double v = 0; 
+        const Shape* primitive = nullptr; // For hits on an Instance, the shape inside its prototype that was hit
+        int index = -1; // For hits on a TriangleMesh, the triangle that was hit, and on a ParticleSet the particle
 
     //constructor 
     Intersection(double t, const Shape* s):t(t),s(s) {}
@@ -37,6 +40,7 @@ class Computations
     public: 
         double t; 
         const Shape* s; 
+        const Material* mat; // Material at the hit, see Shape::material_at
         Point point; 
         Point over_point; 
         Point under_point; 
@@ -44,8 +48,8 @@ class Computations
         Vector normalv; 
         Vector reflectv; 
         bool inside; 
-        double n1; 
-        double n2; 
+        double n1 = 1.0; // Refractive index on the side the ray comes from, stays 1 (air) if I is missing from xs
+        double n2 = 1.0; // Refractive index on the side the ray goes into
 
         Computations(const Intersection& I, const Ray& r); 
         Computations(const Intersection& I, const Ray& r, const std::vector<Intersection>& xs); 
@@ -2,11 +2,13 @@
 #define MATRIX_H
 
 #include <vector> 
+#include <array>
 
 #include "tuple.h"
 #include "vector.h"
 #include "point.h"
 #include "color.h"
+#include "tools.h"
 
 // This file defines the Matrix class for representing 4x4 matrices
 // It includes methods for matrix operations such as multiplication, inversion, and transformations
@@ -46,4 +48,146 @@ class Matrix
 
 bool operator==(Matrix const& obj1,Matrix const& obj2); 
 
+// Classes of 4x4 transforms, ordered from the cheapest to the most expensive to apply
+// UNIFORM_SCALE and AFFINE may also carry a translation
+enum class TRANSFORM_TYPE
+{
+    IDENTITY,
+    TRANSLATION,
+    UNIFORM_SCALE,
+    AFFINE,
+    GENERAL
+}; 
+
+// Fixed-size 4x4 matrix used for every transform in the renderer (shapes, patterns, camera, rays)
+// The 16 elements are stored row-major inside the object, so copies never touch the heap
+// A default constructed Matrix4 is the identity transform
+class Matrix4
+{
+    public: 
+
+    //fields
+    static constexpr int rows = 4; 
+    static constexpr int cols = 4; 
+    std::array<double,16> data; 
+
+    //Constructors
+    constexpr Matrix4():data{1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1} {}
+    constexpr explicit Matrix4(const std::array<double,16>& init_data):data(init_data) {}
+
+    //operators 
+    constexpr Matrix4 operator*(Matrix4 const& obj) const
+    {
+        Matrix4 result; 
+        for(int i = 0; i < 4; i++)
+        {
+            for(int j = 0; j < 4; j++)
+            {
+                result.data[i * 4 + j] = data[i * 4] * obj.data[j] + data[i * 4 + 1] * obj.data[4 + j] 
+                                       + data[i * 4 + 2] * obj.data[8 + j] + data[i * 4 + 3] * obj.data[12 + j]; 
+            }
+        }
+        return result; 
+    }
+    Vector operator*(Vector const& obj) const; 
+    Point operator*(Point const& obj) const; 
+
+    //methods
+    constexpr double getElement(int row, int col) const {return data[row * 4 + col];}
+    constexpr void setElement(int row, int col, double value) {data[row * 4 + col] = value;}
+    constexpr void setIdentity() {*this = Matrix4();}
+    constexpr void transpose()
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            for(int j = i + 1; j < 4; j++)
+            {
+                double temp = data[i * 4 + j]; 
+                data[i * 4 + j] = data[j * 4 + i]; 
+                data[j * 4 + i] = temp; 
+            }
+        }
+    }
+    double determinant() const; 
+    double cofactor(int rowToRemove,int colToRemove) const; 
+    bool is_affine() const; // True when the bottom row is 0,0,0,1
+    TRANSFORM_TYPE classify() const; // Finds the cheapest TRANSFORM_TYPE that represents the matrix exactly
+    bool invert(Matrix4& result, double tolerance = SINGULAR_EPSILON) const; // Writes the inverse into result, returns false if the matrix is (nearly) singular relative to the length of its rows
+    Matrix4 inverse() const; // Throws std::invalid_argument if the matrix is singular
+    void printMatrix() const; 
+}; 
+
+bool operator==(Matrix4 const& obj1,Matrix4 const& obj2); 
+
+// The tuple products are in the innermost loops of the renderer, so they are kept inline
+inline Vector Matrix4::operator*(Vector const& obj) const
+{
+    Vector result; 
+    result.x = data[0] * obj.x + data[1] * obj.y + data[2] * obj.z + data[3] * obj.w;
+    result.y = data[4] * obj.x + data[5] * obj.y + data[6] * obj.z + data[7] * obj.w;
+    result.z = data[8] * obj.x + data[9] * obj.y + data[10] * obj.z + data[11] * obj.w;
+    result.w = data[12] * obj.x + data[13] * obj.y + data[14] * obj.z + data[15] * obj.w;
+
+    return result; 
+}
+
+// Applies m, known to be of class type, to a point using only the arithmetic that class needs
+inline Point transform_point(const Matrix4& m, TRANSFORM_TYPE type, const Point& p)
+{
+    const std::array<double,16>& d = m.data; 
+    switch(type)
+    {
+    case TRANSFORM_TYPE::IDENTITY:
+        return p; 
+
+    case TRANSFORM_TYPE::TRANSLATION:
+        return Point(p.x + d[3],p.y + d[7],p.z + d[11]); 
+
+    case TRANSFORM_TYPE::UNIFORM_SCALE:
+        return Point(d[0] * p.x + d[3],d[0] * p.y + d[7],d[0] * p.z + d[11]); 
+
+    case TRANSFORM_TYPE::AFFINE:
+        return Point(d[0] * p.x + d[1] * p.y + d[2] * p.z + d[3],
+                     d[4] * p.x + d[5] * p.y + d[6] * p.z + d[7],
+                     d[8] * p.x + d[9] * p.y + d[10] * p.z + d[11]); 
+
+    default:
+        return m * p; 
+    }
+}
+
+// Applies m, known to be of class type, to a vector using only the arithmetic that class needs
+inline Vector transform_vector(const Matrix4& m, TRANSFORM_TYPE type, const Vector& v)
+{
+    const std::array<double,16>& d = m.data; 
+    switch(type)
+    {
+    case TRANSFORM_TYPE::IDENTITY:
+    case TRANSFORM_TYPE::TRANSLATION:
+        return v; 
+
+    case TRANSFORM_TYPE::UNIFORM_SCALE:
+        return Vector(d[0] * v.x,d[0] * v.y,d[0] * v.z); 
+
+    case TRANSFORM_TYPE::AFFINE:
+        return Vector(d[0] * v.x + d[1] * v.y + d[2] * v.z,
+                      d[4] * v.x + d[5] * v.y + d[6] * v.z,
+                      d[8] * v.x + d[9] * v.y + d[10] * v.z); 
+
+    default:
+        return m * v; 
+    }
+}
+
+inline Point Matrix4::operator*(Point const& obj) const
+{
+    Point result; 
+    result.x = data[0] * obj.x + data[1] * obj.y + data[2] * obj.z + data[3] * obj.w;
+    result.y = data[4] * obj.x + data[5] * obj.y + data[6] * obj.z + data[7] * obj.w;
+    result.z = data[8] * obj.x + data[9] * obj.y + data[10] * obj.z + data[11] * obj.w;
+    result.w = data[12] * obj.x + data[13] * obj.y + data[14] * obj.z + data[15] * obj.w;
+
+    return result; 
+}
+
 #endif
\ No newline at end of file
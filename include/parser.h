@@ -17,7 +17,8 @@ class Parser
     public: 
     Parser(const std::string& file_name);
     ~Parser(); 
-    void read_file(const char& delimiter = '/'); 
+    void read_file(const char& delimiter = '/'); // Reads the file into default_group, one Triangle or SmoothTriangle per face
+    TriangleMesh* read_mesh(const char& delimiter = '/'); // Reads the file into a new TriangleMesh with its BVH built, the caller owns it
 
     std::string file_name; 
     Group* default_group; 
@@ -28,6 +29,9 @@ class Parser
     //helper functions
     std::vector<Triangle*> Parser::fan_triangulation(const std::vector<Point>& vertices) const; 
     std::vector<SmoothTriangle*> Parser::fan_triangulation_smooth(const std::vector<Point>& vertices,const std::vector<Vector>& normals) const; 
+
+    private: 
+    void parse(const char& delimiter, TriangleMesh* mesh); // Reads the file into mesh, or into default_group if mesh is null
 }; 
 
 
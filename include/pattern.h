@@ -11,13 +11,15 @@ class Shape;
 class Pattern
 {
     public: 
-    Pattern(const Color& _ca,const Color& _cb):ca(_ca),cb(_cb),transform(Matrix(4,4)){this->transform.setIdentity();}
+    Pattern(const Color& _ca,const Color& _cb):ca(_ca),cb(_cb),transform(Matrix4()),inverse_transform(Matrix4()){}
     virtual ~Pattern() = default;
 
     Color ca;
     Color cb; 
-    Matrix transform; 
+    Matrix4 transform; // Assign through setTransform so the cached inverse stays in sync
+    Matrix4 inverse_transform; 
     
+    void setTransform(const Matrix4& m); 
     virtual Color color_at(const Point& p) const = 0; 
     Color color_at_object(const Shape* object, const Point& world_point) const; 
 }; 
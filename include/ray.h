@@ -9,19 +9,34 @@
 
 // This file defines the Ray class for representing rays in 3D space
 // It includes methods for ray operations such as position calculation and transformation
+// The reciprocal direction and its signs are computed once when the ray is made, so build a new Ray rather than changing direction
 class Ray
 {
     public: 
         Point origin; 
         Vector direction; 
+        Vector inv_direction; // 1/direction per component, infinite where direction is zero
+        int sign[3]; // 1 where direction is negative (including -0), picks the near side of a box on each axis
 
         //Constructors
         Ray(const Point& origin,const Vector& direction); 
 
         //methods
         Point position(double t) const; 
-        Ray ray_transform(const Matrix& m) const; 
+        Ray ray_transform(const Matrix4& m) const; 
+        Ray ray_transform(const Matrix4& m, TRANSFORM_TYPE type) const; // Same as above, using the fast path for a matrix of class type
 
 }; 
 
+// Branch-free slab test of one axis of the box [lo,hi], narrowing [tmin,tmax] to the part of the ray between the two planes
+// A zero direction gives an infinite reciprocal, so the slab keeps either all of the ray or none of it.
+// A ray lying exactly in one of the planes gives NaN, which the comparisons ignore.
+inline void clip_slab(double lo, double hi, double origin, double inv_direction, int sign, double& tmin, double& tmax)
+{
+    double t0 = ((sign ? hi : lo) - origin) * inv_direction; 
+    double t1 = ((sign ? lo : hi) - origin) * inv_direction; 
+    tmin = t0 > tmin ? t0 : tmin; 
+    tmax = t1 < tmax ? t1 : tmax; 
+}
+
 #endif
\ No newline at end of file
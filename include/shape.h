@@ -22,41 +22,69 @@ class AABB
         AABB(){} // Default constructor initializes to a small AABB around the origin
         ~AABB() = default; // Default destructor
 
-        AABB transform(const Matrix& mat); // Transforms the AABB using a transformation matrix
+        AABB transform(const Matrix4& mat) const; // Transforms the AABB using a transformation matrix
         bool check_intersect(const Ray& r) const; // Checks if a ray intersects the AABB
+        double surface_area() const; // Surface area of the box, used by the surface area heuristic
+        Point centroid() const; // Center of the box
+}; 
 
-        //helper functions
-        std::array<double,2> AABB::check_axis(double origin, double direction,AXIS ax) const; // Checks intersection along a specific axis
+// Concrete types of the shapes the BVH has leaf kernels for, see compile_primitives in bvh.cpp
+// Every other shape is OTHER and is tested through its virtual methods
+enum class SHAPE_TYPE
+{
+    OTHER,
+    SPHERE,
+    CUBE,
+    CYLINDER,
+    TRIANGLE,
+    SMOOTH_TRIANGLE
 }; 
 
 /*
  * Base class for all shapes
  * Provides common functionality for intersection and normal calculation
- * Derived classes must implement local_intersect, local_normal_at, and bounds methods
+ * Derived classes must implement local_intersect_into, local_normal_at, and bounds methods
  */
 class Shape
 {
     public: 
-        Shape():transform(Matrix(4,4)),mat(Material()) {this->transform.setIdentity();} // Default constructor initializes the shape with an identity transformation and default material
+        Shape():transform(Matrix4()),inverse_transform(Matrix4()),normal_transform(Matrix4()),world_inverse_transform(Matrix4()),world_normal_transform(Matrix4()),mat(Material()) {} // Default constructor initializes the shape with an identity transformation and default material
         virtual ~Shape() = default; // Default destructor
 
         std::vector<Intersection> intersect(const Ray& r) const; // Intersects a ray with the shape, returning a list of intersections
+        void intersect_into(const Ray& r, std::vector<Intersection>& xs) const; // Appends the intersections of the ray with the shape to xs, reusing xs keeps tracing free of allocations
+        bool intersect_closest(const Ray& r, Intersection& hit, double t_max = std::numeric_limits<double>::infinity()) const; // Finds the nearest intersection with 0 < t < t_max, returns false and leaves hit alone if there is none
+        bool intersect_any(const Ray& r, double t_max) const; // Checks whether the ray hits the shape anywhere with 0 < t < t_max
         Vector normal_at(const Point& world_point,const Intersection& hit) const; // Calculates the normal vector at a given point in world coordinates
 
-        virtual std::vector<Intersection> local_intersect(const Ray& r) const = 0; // Pure virtual method for local intersection, must be implemented by derived classes
+        std::vector<Intersection> local_intersect(const Ray& r) const; // Local intersections as a new list, convenient outside of the render loop
+        virtual void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const = 0; // Pure virtual method for local intersection, appends to xs, must be implemented by derived classes
+        virtual bool local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const; // Nearest local intersection below t_max, by default the nearest of local_intersect_into
+        virtual bool local_intersect_any(const Ray& r, double t_max) const; // Whether any local intersection lies in (0,t_max), by default searches local_intersect_into
         virtual Vector local_normal_at(const Point& object_point,const Intersection& hit) const = 0; // Pure virtual method for local normal calculation, must be implemented by derived classes
         virtual AABB bounds() const = 0; // Pure virtual method for bounding box calculation, must be implemented by derived classes
+        AABB parent_bounds() const; // Bounds in the space of the parent (or the world), skips the transform for identity shapes
+        virtual void bake_transform(const Matrix4& m); // Folds m * transform into the shape, shapes that can absorb it into their geometry are left with an identity transform
+        virtual const Material& material_at(const Intersection& hit) const; // Material at a hit on the shape, mat unless the shape holds parts with materials of their own (a ParticleSet)
 
-        void setTransform(const Matrix& m); // Sets the transformation matrix for the shape
-        Matrix getTransform() const; // Gets the transformation matrix of the shape
+        void setTransform(const Matrix4& m); // Sets the transformation matrix for the shape
+        void update_world_transform(); // Rebuilds the cached world space transforms of this shape and, for groups, all descendants
+        Matrix4 getTransform() const; // Gets the transformation matrix of the shape
 
         void setMaterial(const Material& m); // Sets the material for the shape
         Material getMaterial() const; // Gets the material of the shape
 
-        Matrix transform;  // Transformation matrix for the shape
+        Matrix4 transform;  // Transformation matrix for the shape, assign it through setTransform so the cached inverses stay in sync
+        Matrix4 inverse_transform; // Cached inverse of transform, maps world (or parent) space into object space
+        Matrix4 normal_transform; // Cached transpose of inverse_transform, maps object space normals back out
+        Matrix4 world_inverse_transform; // Cached product of the inverses of this shape and all its ancestors, maps world space into object space
+        Matrix4 world_normal_transform; // Cached transpose of world_inverse_transform, maps object space normals to world space
+        TRANSFORM_TYPE transform_type = TRANSFORM_TYPE::IDENTITY; // Class of inverse_transform, picks the ray transform fast path
+        TRANSFORM_TYPE world_transform_type = TRANSFORM_TYPE::IDENTITY; // Class of world_inverse_transform, picks the shading fast path
         Material mat; // Material properties of the shape, can be used for shading and rendering
         Shape* parent = nullptr; // Pointer to the parent shape, if any, used for hierarchical transformations
         bool isGroup = false; 
+        SHAPE_TYPE shape_type = SHAPE_TYPE::OTHER; // Set by the shapes that have a leaf kernel, lets BVH leaves and normal_at skip the virtual calls. Subclasses of those shapes that override their tests must set it back to OTHER
 }; 
 
 int scan_container(const std::vector<const Shape*>& container,const Shape* desired); // Scans a container of shapes to find the index of a desired shape, returns -1 if not found
@@ -12,8 +12,9 @@
 #include "bvh.h"
 
 #include <array>
+#include <memory>
 
-class BVHNode; 
+struct BVH; 
 
 // Sphere class represents a sphere shape in 3D space
 class Sphere : public Shape
@@ -21,8 +22,9 @@ class Sphere : public Shape
     public:
 
         //Constructors
-        Sphere():Shape(){}
-        std::vector<Intersection> local_intersect(const Ray& r) const override; 
+        Sphere():Shape(){this->shape_type = SHAPE_TYPE::SPHERE;}
+        void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
+        int local_hits(const Ray& r, double ts[2]) const; // Writes the distances of the local intersections to ts, nearest first, and returns how many there are
         
         //methods
         Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
@@ -40,21 +42,53 @@ class Group: public Shape
     //Need destructor
     ~Group(); 
 
-    std::vector<Intersection> local_intersect(const Ray& r) const override; 
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
+    bool local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const override; 
+    bool local_intersect_any(const Ray& r, double t_max) const override; 
     
     //methods
     Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
-    AABB bounds() const;
+    AABB bounds() const override; // Union of the children's bounds, cached until invalidate_bounds is called
     void add_child(Shape* s); 
+    void invalidate_bounds(); // Drops the cached bounds of this group and its ancestors, call it after changing children without add_child
     void percolate_material();
     void refresh_bvh(); 
+    void refit_bvh(double rebuild_ratio = 0); // Refits the BVHs of this group and its subgroups to moved children, rebuilding any whose SAH cost grew past rebuild_ratio times its built cost (0 never rebuilds)
+    void bake_transform(const Matrix4& m) override; 
 
     //fields
     std::vector<Shape*> children = {}; 
-    BVHNode* bvh = nullptr; 
+    BVH* bvh = nullptr; 
+    mutable AABB cached_bounds; 
+    mutable bool bounds_valid = false; 
 
 }; 
 
+// Instance class places a shared prototype group in the scene with its own transform and material
+// Any number of instances can share one prototype, its children and BVH are stored once and never modified
+// through an instance. Hits report the instance as their shape and the shape inside the prototype as their
+// primitive, so shading uses the instance's material and the primitive's normal. The prototype's BVH has to be
+// built (refresh_bvh) before it is shared, and it cannot contain instances itself. Instances are made on one thread,
+// they read the prototype's bounds when they are made
+class Instance: public Shape
+{
+    public:
+    //Constructors
+    Instance(std::shared_ptr<const Group> prototype):Shape(),prototype(std::move(prototype)),prototype_bounds(this->prototype->parent_bounds()){}
+
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
+    bool local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const override; 
+    bool local_intersect_any(const Ray& r, double t_max) const override; 
+
+    //methods
+    Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
+    AABB bounds() const override; 
+
+    //fields
+    std::shared_ptr<const Group> prototype; 
+    AABB prototype_bounds; // Taken when the instance is made, so BVH builds never touch the shared prototype's cached bounds from several threads
+}; 
+
 // Plane class represents an infinite plane in 3D space
 class Plane : public Shape
 {
@@ -62,7 +96,7 @@ class Plane : public Shape
         //Constructors
         Plane():Shape(){}
         Plane(double z_min,double z_max,double x_min,double x_max):Shape(),z_maximum(z_max),z_minimum(z_min),x_maximum(x_max),x_minimum(x_min){}
-        std::vector<Intersection> local_intersect(const Ray& r) const override; 
+        void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
         
         //methods
         Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
@@ -82,12 +116,12 @@ class Cube : public Shape
 {
     public: 
     //Constructors
-    Cube():Shape(){}
+    Cube():Shape(){this->shape_type = SHAPE_TYPE::CUBE;}
     Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
-    std::vector<Intersection> local_intersect(const Ray& r) const override;
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
+    int local_hits(const Ray& r, double ts[2]) const; // Writes the distances of the local intersections to ts, nearest first, and returns how many there are
     //methods
     
-    std::array<double,2> check_axis(double origin, double direction) const; 
     AABB bounds() const; 
 }; 
 
@@ -104,15 +138,17 @@ class Cylinder: public Shape
 {
     public: 
     //Constructors
-    Cylinder():Shape(){}
-    Cylinder(double _minimum,double _maximum):Shape(),minimum(_minimum),maximum(_maximum){}
-    Cylinder(double _minimum,double _maximum,CYL_TYPE _type):Shape(),minimum(_minimum),maximum(_maximum),type(_type){}
+    Cylinder():Shape(){this->shape_type = SHAPE_TYPE::CYLINDER;}
+    Cylinder(double _minimum,double _maximum):Shape(),minimum(_minimum),maximum(_maximum){this->shape_type = SHAPE_TYPE::CYLINDER;}
+    Cylinder(double _minimum,double _maximum,CYL_TYPE _type):Shape(),minimum(_minimum),maximum(_maximum),type(_type){this->shape_type = SHAPE_TYPE::CYLINDER;}
     
     //methods
     Vector local_normal_at(const Point& object_point,const Intersection& hit) const override;   
     bool check_cap(const Ray& r, double t) const; 
-    std::vector<Intersection> local_intersect(const Ray& r) const override; 
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
     void intersect_caps(const Ray& r, std::vector<Intersection>& xs) const; 
+    int cap_hits(const Ray& r, double ts[2]) const; // Writes the distances at which the ray crosses the caps to ts and returns how many there are
+    int local_hits(const Ray& r, double ts[4]) const; // Writes the distances of the local intersections to ts, in the order local_intersect_into reports them, and returns how many there are
     AABB bounds() const; 
 
     //fields 
@@ -122,13 +158,16 @@ class Cylinder: public Shape
 }; 
 
 // Triangle class represents a triangle shape in 3D space
+// A BVH tests an untransformed triangle against its own copy of the vertices, so after changing p1, p2, p3 or the
+// transform of a triangle that is already in a BVH, call refit_bvh (or rebuild) before tracing again
 class Triangle: public Shape
 {
     public: 
-    Triangle(const Point& _p1, const Point& _p2, const Point& _p3):Shape(),p1(_p1),p2(_p2),p3(_p3){e1 = p2 - p1; e2 = p3 - p1; normal = (e2^e1).normalize(); }
-    std::vector<Intersection> local_intersect(const Ray& r) const override; 
+    Triangle(const Point& _p1, const Point& _p2, const Point& _p3):Shape(),p1(_p1),p2(_p2),p3(_p3){e1 = p2 - p1; e2 = p3 - p1; normal = (e2^e1).normalize(); shape_type = SHAPE_TYPE::TRIANGLE; }
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
     Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
     AABB bounds() const; 
+    void bake_transform(const Matrix4& m) override; 
 
     //fields 
     Point p1; 
@@ -143,13 +182,15 @@ class Triangle: public Shape
 
 // SmoothTriangle class represents a triangle with smooth shading in 3D space
 // It includes vertex normals for each corner of the triangle, allowing for smooth shading across the surface
+// Like Triangle, its vertices are copied into the BVHs it is in, edits need refit_bvh before the next trace
 class SmoothTriangle: public Shape
 {
     public: 
-    SmoothTriangle(const Point& _p1, const Point& _p2, const Point& _p3, const Vector& _n1, const Vector&_n2, const Vector&_n3):Shape(),p1(_p1),p2(_p2),p3(_p3),n1(_n1),n2(_n2),n3(_n3){e1 = p2 - p1; e2 = p3 - p1;}
+    SmoothTriangle(const Point& _p1, const Point& _p2, const Point& _p3, const Vector& _n1, const Vector&_n2, const Vector&_n3):Shape(),p1(_p1),p2(_p2),p3(_p3),n1(_n1),n2(_n2),n3(_n3){e1 = p2 - p1; e2 = p3 - p1; shape_type = SHAPE_TYPE::SMOOTH_TRIANGLE;}
     Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
-    std::vector<Intersection> local_intersect(const Ray& r) const override; 
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
     AABB bounds() const; 
+    void bake_transform(const Matrix4& m) override; 
 
     //fields 
     Point p1; 
@@ -164,6 +205,113 @@ class SmoothTriangle: public Shape
     Vector n3;
 }; 
 
+// A ray set up once for the watertight triangle test of Woop, Benthin and Wald
+// The axis the direction is largest along becomes z and the direction is sheared onto it, so every triangle is tested
+// in the same 2D space and an edge shared by two triangles gives the same answer for both.
+struct TriangleRay
+{
+    TriangleRay(const Ray& r); 
+
+    double origin[3]; 
+    int kx, ky, kz; 
+    double sx, sy, sz; 
+}; 
+
+// Watertight test of one triangle, the hit is at t with barycentric u (towards p2) and v (towards p3)
+// Hits on an edge or a vertex count, only a ray in the triangle's plane misses it.
+bool intersect_triangle(const TriangleRay& r, const Point& p1, const Point& p2, const Point& p3, double& t, double& u, double& v); 
+
+// Four triangles of a mesh packed lane by lane for the block intersection test
+// Lanes left over at the end of a BVH leaf have tri -1 and all three vertices at the origin, which no ray can hit
+struct TriangleBlock
+{
+    alignas(16) double p1[3][4]; 
+    alignas(16) double p2[3][4]; 
+    alignas(16) double p3[3][4]; 
+    int tri[4]; 
+}; 
+
+// TriangleMesh class holds a whole mesh as one shape: shared vertex and normal arrays and three indices per triangle
+// Its own BVH refers to the triangles by index, so a triangle costs its indices and a share of the BVH instead of a
+// Shape of its own. Hits record the triangle in Intersection::index. Call refresh_bvh once the triangles are added.
+// By default the leaves' triangles are also packed into blocks of four for intersect_block, turn off pack_blocks
+// before refresh_bvh for meshes where memory matters more than speed
+class TriangleMesh: public Shape
+{
+    public: 
+    TriangleMesh():Shape(){}
+    ~TriangleMesh(); 
+    TriangleMesh(const TriangleMesh&) = delete; // Owns its BVH
+    TriangleMesh& operator=(const TriangleMesh&) = delete; 
+
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
+    bool local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const override; 
+    bool local_intersect_any(const Ray& r, double t_max) const override; 
+    Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
+    AABB bounds() const override; 
+    void bake_transform(const Matrix4& m) override; 
+
+    //methods
+    int add_vertex(const Point& p); // Adds a vertex and returns its index
+    int add_normal(const Vector& n); // Adds a vertex normal and returns its index
+    void add_triangle(int a, int b, int c); // Adds a flat triangle over vertices a, b and c
+    void add_triangle(int a, int b, int c, int na, int nb, int nc); // Adds a smooth triangle that interpolates normals na, nb and nc
+    int triangle_count() const; 
+    void refresh_bvh(); // Builds the BVH over the triangles
+    bool intersect_triangle(int tri, const TriangleRay& r, double& t, double& u, double& v) const; // Tests one triangle, the hit is at t with barycentric u and v
+    void intersect_triangle(int tri, const TriangleRay& r, std::vector<Intersection>& xs) const; // Same as above, appending the hit to xs
+    int intersect_block(int block, const TriangleRay& r, double t[4], double u[4], double v[4]) const; // Tests the four triangles of a block at once, returns a bit mask of the lanes hit
+
+    //fields
+    std::vector<Point> vertices; 
+    std::vector<Vector> normals; 
+    std::vector<int> indices; // Three vertex indices per triangle
+    std::vector<int> normal_indices; // Empty if every triangle is flat, otherwise three normal indices per triangle with -1 for flat ones
+    AABB mesh_bounds; // Bounds of the triangles' vertices
+    bool flip_normals = false; // Set once a mirroring transform has been baked in, which flips the winding of the flat normals
+    BVH* bvh = nullptr; 
+    std::vector<TriangleBlock> blocks; // The triangles in leaf order, block i holds leaf primitives 4i to 4i+3 (refresh_bvh frees bvh->indices once they are packed)
+    bool pack_blocks = true; // Whether refresh_bvh packs the blocks, they hold another copy of every vertex (about 76 bytes per triangle) in exchange for the faster block test
+}; 
+
+// ParticleSet class holds a large number of spheres as one shape: a center, a radius and a material index per particle
+// in flat arrays, 32 bytes each, instead of a Sphere with its own transforms and material. Its own BVH refers to
+// the particles by index and the leaves test them analytically in the space of the set. Hits record the particle
+// in Intersection::index. Call refresh_bvh once the particles are added
+class ParticleSet: public Shape
+{
+    public: 
+    ParticleSet():Shape(){}
+    ~ParticleSet(); 
+    ParticleSet(const ParticleSet&) = delete; // Owns its BVH
+    ParticleSet& operator=(const ParticleSet&) = delete; 
+
+    void local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const override; 
+    bool local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const override; 
+    bool local_intersect_any(const Ray& r, double t_max) const override; 
+    Vector local_normal_at(const Point& object_point,const Intersection& hit) const override; 
+    AABB bounds() const override; 
+    void bake_transform(const Matrix4& m) override; 
+    const Material& material_at(const Intersection& hit) const override; 
+
+    //methods
+    void reserve(int count); // Reserves room for count particles, saves the regrowth of the arrays when loading large sets
+    int add_material(const Material& m); // Adds a material particles can refer to and returns its index
+    int add_particle(const Point& center, double radius, int material = -1); // Adds a particle and returns its index, material -1 uses the set's own mat
+    int particle_count() const; 
+    AABB particle_bounds(int particle) const; 
+    void refresh_bvh(); // Builds the BVH over the particles and puts them in the order of its leaves, which renumbers them
+    int intersect_particle(int particle, const Ray& r, double ts[2]) const; // Tests one particle, returns the number of hits written to ts, nearest first
+
+    //fields
+    std::vector<double> centers; // Three coordinates per particle
+    std::vector<float> radii; 
+    std::vector<int> material_indices; // Index into materials per particle, -1 for the set's own mat
+    std::vector<Material> materials; 
+    AABB set_bounds; // Bounds of all the particles
+    BVH* bvh = nullptr; 
+}; 
+
 // Function declarations for creating specific shapes
 Sphere* glass_sphere(); 
 
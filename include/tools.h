@@ -8,8 +8,15 @@
 *
 */
 
+//The SIMD kernels use SSE2 where it is available, which covers every x64 target
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE
+#endif
+
 constexpr double EPSILON = 0.01; // A small value used for floating-point comparisons to avoid precision issues
 constexpr double BUMP_EPSILON = 1e-3; // A small value used for bumping normal vectors above or below the surface
+constexpr double BUMP_RELATIVE = 1e-9; // Fraction of the size of a hit's coordinates added to the bump, which keeps it above their round off far from the origin
+constexpr double SINGULAR_EPSILON = 1e-12; // Matrices whose |determinant| is at or below this fraction of the product of their row lengths are treated as singular when inverted
 
 bool equal_double(double a, double b);  // Compares two double values for equality within a small epsilon range
 
@@ -7,15 +7,15 @@
 
 // This file defines transformation functions for 3D graphics
 // It includes functions for translation, scaling, rotation, and skewing
-Matrix translation(double x, double y, double z); 
-Matrix scaling(double x, double y, double z); 
-Matrix rotation_x(double rad); 
-Matrix rotation_y(double rad); 
-Matrix rotation_z(double rad); 
-Matrix skew(double x_y,double x_z,double y_x,double y_z,double z_x,double z_y); 
+Matrix4 translation(double x, double y, double z); 
+Matrix4 scaling(double x, double y, double z); 
+Matrix4 rotation_x(double rad); 
+Matrix4 rotation_y(double rad); 
+Matrix4 rotation_z(double rad); 
+Matrix4 skew(double x_y,double x_z,double y_x,double y_z,double z_x,double z_y); 
 
 //view_transform function creates a view transformation matrix
 // It takes a point representing the camera's position, a point to look at, and a vector representing the up direction
-Matrix view_transform(const Point& from, const Point& to, const Vector& up); 
+Matrix4 view_transform(const Point& from, const Point& to, const Vector& up); 
 
 #endif
\ No newline at end of file
@@ -10,6 +10,7 @@
 
 #include <vector>
 #include <memory>
+#include <limits>
 
 constexpr int MAX_DEPTH = 5; 
 
@@ -22,7 +23,9 @@ class World
     //fields 
     pointLight world_light; 
     std::vector<Shape*> world_objects; 
-    BVHNode* bvh; 
+    BVH* bvh = nullptr; 
+    bool bvh_dirty = true; // Objects were added since the BVH was built, it is rebuilt before the next trace
+    int incremental_inserts = 0; // Objects inserted into the BVH since it was last built
 
     //constructor-destructor
     World(); 
@@ -31,10 +34,16 @@ class World
     //methods
     Color color_at(const Ray& ray,int remaining = MAX_DEPTH); // Calculates the color at a given ray, considering intersections and lighting 
     void empty_objects(); // Clears all shapes from the world
-    void add_object(Shape* s); // Adds a shape to the world
+    void add_object(Shape* s); // Adds a shape to the world, inserting it into the BVH if that is already built
+    void add_objects(const std::vector<Shape*>& shapes); // Adds a batch of shapes to the world, the BVH is rebuilt once before the next trace
+    void update_bvh(); // Rebuilds the BVH if it is out of date, call it before tracing from several threads
+    void refit_bvh(double rebuild_ratio = 0); // Refits the BVHs to moved shapes, see Group::refit_bvh
 
     //helper functions 
-    std::vector<Intersection> intersect(const Ray& ray); // Intersects a ray with the world, returning a list of intersections
+    std::vector<Intersection> intersect(const Ray& ray, double t_max = std::numeric_limits<double>::infinity()); // Intersects a ray with the world, returning a sorted list of intersections, see bvh_intersect for t_max
+    void intersect(const Ray& ray, std::vector<Intersection>& xs, double t_max = std::numeric_limits<double>::infinity()); // Same as above, appending the sorted intersections to xs
+    bool intersect_closest(const Ray& ray, Intersection& hit); // Finds the nearest intersection in front of the ray, returns false if there is none
+    Computations prepare_computations(const Intersection& hit, const Ray& ray); // Precomputes the shading of a hit from intersect_closest, collecting what the ray crossed for the refractive indices if the hit is transparent
     Color shade_hit(const Computations& comps,int remaining = MAX_DEPTH); // Shades the hit point based on the material properties and lighting
     bool World::is_shadowed(const Point& point); // Checks if a point is in shadow with respect to the light source
     Color reflected_color(const Computations& comps,int remaining = MAX_DEPTH); // Calculates the color of the reflected ray at the intersection point
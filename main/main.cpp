@@ -22,11 +22,11 @@ int main(int argc, char *argv[])
     
     Plane* floor = new Plane(); 
     floor->mat.pattern = new CheckerPattern(Color(1.f,1.f,1.f),Color(0.f,0.f,0.f));
-    floor->mat.pattern->transform = scaling(0.33,0.33,0.33); 
+    floor->mat.pattern->setTransform(scaling(0.33,0.33,0.33)); 
 
     Plane* wall = new Plane(); 
     wall->mat.pattern = new CheckerPattern(Color(1.f,1.f,1.f),Color(0.f,0.f,0.f));
-    wall->transform = (translation(0,0,10)*rotation_x(M_PI/2.f)) * scaling(10,10,10); 
+    wall->setTransform((translation(0,0,10)*rotation_x(M_PI/2.f)) * scaling(10,10,10)); 
     //wall->mat.reflective = 1.0; 
 
     Group* walls = new Group(); 
@@ -42,13 +42,16 @@ int main(int argc, char *argv[])
     
     std::cout<<"Vertices in file: "<<p.vertices.size()<<std::endl; 
 
-    p.default_group->transform = rotation_y(-M_PI) * rotation_x(-M_PI/2) * translation(0,1,0) * scaling(0.12,0.12,0.12); 
+    p.default_group->setTransform(rotation_y(-M_PI) * rotation_x(-M_PI/2) * translation(0,1,0) * scaling(0.12,0.12,0.12)); 
     p.default_group->mat.transparency = 1.0; 
     p.default_group->mat.reflective = 1.0; 
     p.default_group->mat.refractive_index = 1.5; 
     p.default_group->mat.mat_color = Color(0.6, 0.6, 0.6);  
     p.default_group->percolate_material(); 
 
+    //The mesh is static, so bake the group transform into the triangle vertices
+    p.default_group->bake_transform(Matrix4()); 
+
     std::cout<<"triangle count: "<<p.default_group->children.size()<<std::endl; 
 
     Group* scene_group = new Group(); 
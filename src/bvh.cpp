@@ -3,257 +3,1785 @@
 #include <utility>
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <cmath>
+#include <queue>
+
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
 
 // This file defines the Bounding Volume Hierarchy (BVH) for efficient ray tracing
 // It includes functions for building the BVH from a list of shapes and performing ray intersection tests
 
-// Helper functions for sorting shapes based on their centroids along different axes
-bool comp_xaxis(Shape* a, Shape* b) 
+// The centroid of a shape is the center of its bounds in the space of its parent
+// Using transform * Point(0,0,0) instead would put every triangle of a mesh at the origin
+Point shape_centroid(const Shape* s)
+{
+    return s->parent_bounds().centroid(); 
+}
+
+// This function chooses the axis for splitting the bounding box based on the largest extent
+// It compares the extents along the x, y, and z axes and returns the axis
+AXIS chooseSplitAxis(const AABB& cbox)
+{
+    Vector extent = cbox.maximum - cbox.minimum; 
+    if(extent.x >= extent.y && extent.x >= extent.z)
+        return AXIS::X_AXIS;
+        
+    if(extent.y >= extent.z)
+        return AXIS::Y_AXIS; 
+
+    return AXIS::Z_AXIS; 
+}
+
+// This function creates a union of two AABBs, returning a new AABB that encompasses both
+// It calculates the minimum and maximum points of the union based on the minimum and maximum points of both boxes
+AABB box_union(const AABB& box1, const AABB& box2)
+{
+    Point minUnion; 
+    Point maxUnion; 
+
+    minUnion.x = std::min(box1.minimum.x,box2.minimum.x); 
+    minUnion.y = std::min(box1.minimum.y,box2.minimum.y); 
+    minUnion.z = std::min(box1.minimum.z,box2.minimum.z); 
+
+    maxUnion.x = std::max(box1.maximum.x,box2.maximum.x); 
+    maxUnion.y = std::max(box1.maximum.y,box2.maximum.y); 
+    maxUnion.z = std::max(box1.maximum.z,box2.maximum.z); 
+
+    return AABB(minUnion,maxUnion); 
+}
+
+// Float bounds for a node, rounded outward so the node never shrinks below the primitives it holds
+static float round_down(double v)
+{
+    float f = (float)v; 
+    return (double)f > v ? std::nextafter(f,-std::numeric_limits<float>::infinity()) : f; 
+}
+
+static float round_up(double v)
+{
+    float f = (float)v; 
+    return (double)f < v ? std::nextafter(f,std::numeric_limits<float>::infinity()) : f; 
+}
+
+static void set_node_bounds(BVHNode& node, const AABB& box)
+{
+    node.bbox_min[0] = round_down(box.minimum.x); 
+    node.bbox_min[1] = round_down(box.minimum.y); 
+    node.bbox_min[2] = round_down(box.minimum.z); 
+    node.bbox_max[0] = round_up(box.maximum.x); 
+    node.bbox_max[1] = round_up(box.maximum.y); 
+    node.bbox_max[2] = round_up(box.maximum.z); 
+}
+
+AABB BVHNode::bounds() const
+{
+    return AABB(Point(this->bbox_min[0],this->bbox_min[1],this->bbox_min[2]),Point(this->bbox_max[0],this->bbox_max[1],this->bbox_max[2])); 
+}
+
+// Bounds and centroids are computed once up front instead of at every level
+static std::vector<BVHPrimitive> primitive_info(const std::vector<Shape*>& primitives, int parallel_threshold)
+{
+    int n = (int)primitives.size(); 
+    std::vector<BVHPrimitive> info(n); 
+
+    #pragma omp parallel for if(n > parallel_threshold)
+    for(int i = 0; i < n; i++)
+    {
+        AABB box = primitives[i]->parent_bounds(); 
+        info[i] = {primitives[i],box,box.centroid(),-1}; 
+    }
+
+    return info; 
+}
+
+// Appends a leaf holding primitives[start,end) and returns its index
+static int make_leaf(BVH& bvh, const std::vector<BVHPrimitive>& primitives, int start, int end, const AABB& bbox)
+{
+    BVHNode node; 
+    set_node_bounds(node,bbox); 
+    node.offset = (int)(bvh.primitives.size() + bvh.indices.size()); 
+    node.count = (uint16_t)(end - start); 
+    for(int i = start; i < end; i++)
+    {
+        if(primitives[i].shape != nullptr)
+            bvh.primitives.push_back(primitives[i].shape); 
+        else 
+            bvh.indices.push_back(primitives[i].index); 
+    }
+
+    bvh.nodes.push_back(node); 
+    return (int)bvh.nodes.size() - 1; 
+}
+
+// Appends an interior node and returns its index
+// Its first child is the next node to be appended, the caller sets offset once the second child is built
+static int push_interior(BVH& bvh, const AABB& bbox, int axis)
+{
+    BVHNode node; 
+    set_node_bounds(node,bbox); 
+    node.axis = (uint8_t)axis; 
+    bvh.nodes.push_back(node); 
+    return (int)bvh.nodes.size() - 1; 
+}
+
+// Appends a subtree that was built on its own and returns the index of its root
+static int append_subtree(BVH& bvh, const BVH& part)
+{
+    int node_base = (int)bvh.nodes.size(); 
+    int primitive_base = (int)(bvh.primitives.size() + bvh.indices.size()); 
+    for(BVHNode node: part.nodes)
+    {
+        node.offset += node.isLeaf() ? primitive_base : node_base; 
+        bvh.nodes.push_back(node); 
+    }
+    bvh.primitives.insert(bvh.primitives.end(),part.primitives.begin(),part.primitives.end()); 
+    bvh.indices.insert(bvh.indices.end(),part.indices.begin(),part.indices.end()); 
+
+    return node_base; 
+}
+
+static double axis_value(const Point& p, int axis)
+{
+    return axis == 0 ? p.x : (axis == 1 ? p.y : p.z); 
+}
+
+// Leaves are capped so their primitive count fits in a node
+static int leaf_limit(int maxPrimsPerLeaf)
+{
+    return std::min(std::max(maxPrimsPerLeaf,1),(int)std::numeric_limits<uint16_t>::max()); 
+}
+
+// Number of pieces a range is cut into when the top levels of a build are shared between threads
+constexpr int BUILD_CHUNKS = 64; 
+
+// First index of chunk c when [start,end) is cut into chunks pieces
+static int chunk_start(int start, int end, int c, int chunks)
+{
+    return start + (int)((long long)(end - start) * c / chunks); 
+}
+
+// Computes the bounds of primitives[start,end) and of their centroids
+static void range_bounds(const std::vector<BVHPrimitive>& primitives, int start, int end, bool parallel, AABB& bbox, AABB& cbox)
+{
+    bbox = AABB(); 
+    cbox = AABB(primitives[start].centroid,primitives[start].centroid); 
+    if(!parallel)
+    {
+        for(int i = start; i < end; i++)
+        {
+            bbox = box_union(bbox,primitives[i].bounds); 
+            cbox = box_union(cbox,AABB(primitives[i].centroid,primitives[i].centroid)); 
+        }
+        return; 
+    }
+
+    std::vector<AABB> boxes(BUILD_CHUNKS,bbox); 
+    std::vector<AABB> cboxes(BUILD_CHUNKS,cbox); 
+
+    #pragma omp parallel for
+    for(int c = 0; c < BUILD_CHUNKS; c++)
+    {
+        for(int i = chunk_start(start,end,c,BUILD_CHUNKS); i < chunk_start(start,end,c + 1,BUILD_CHUNKS); i++)
+        {
+            boxes[c] = box_union(boxes[c],primitives[i].bounds); 
+            cboxes[c] = box_union(cboxes[c],AABB(primitives[i].centroid,primitives[i].centroid)); 
+        }
+    }
+
+    for(int c = 0; c < BUILD_CHUNKS; c++)
+    {
+        bbox = box_union(bbox,boxes[c]); 
+        cbox = box_union(cbox,cboxes[c]); 
+    }
+}
+
+// A centroid bin of the SAH builder
+struct SAHBin
+{
+    AABB bounds; 
+    int count = 0; 
+}; 
+
+// The cheapest split found by the binned SAH, axis is -1 if the centroids cannot be split
+struct SAHSplit
+{
+    int axis = -1; 
+    int bin = 0; 
+    double cost = std::numeric_limits<double>::infinity(); // A_L * N_L + A_R * N_R
+}; 
+
+// Bin of a centroid along axis, for bin_count bins spread over the centroid box
+static int centroid_bin(const Point& centroid, int axis, const AABB& cbox, int bin_count)
+{
+    double cmin = axis_value(cbox.minimum,axis); 
+    double scale = bin_count / (axis_value(cbox.maximum,axis) - cmin); 
+    return std::min((int)((axis_value(centroid,axis) - cmin) * scale),bin_count - 1); 
+}
+
+// Sorts primitives[start,end) into bins along all three axes, bins holds bin_count bins per axis
+static void fill_bins(const std::vector<BVHPrimitive>& primitives, int start, int end, const AABB& cbox, int bin_count, SAHBin* bins)
+{
+    for(int axis = 0; axis < 3; axis++)
+    {
+        if(axis_value(cbox.maximum,axis) - axis_value(cbox.minimum,axis) <= 0)
+            continue; 
+
+        for(int i = start; i < end; i++)
+        {
+            SAHBin& bin = bins[axis * bin_count + centroid_bin(primitives[i].centroid,axis,cbox,bin_count)]; 
+            bin.count++; 
+            bin.bounds = box_union(bin.bounds,primitives[i].bounds); 
+        }
+    }
+}
+
+// Finds the bin boundary with the lowest surface area cost along any axis
+// The binning is shared between threads when parallel is set, each one filling its own bins for part of the range
+static SAHSplit find_sah_split(const std::vector<BVHPrimitive>& primitives, int start, int end, const AABB& cbox, int bin_count, bool parallel)
+{
+    std::vector<SAHBin> bins(3 * bin_count); 
+    if(!parallel)
+    {
+        fill_bins(primitives,start,end,cbox,bin_count,bins.data()); 
+    }
+    else 
+    {
+        std::vector<SAHBin> chunk_bins(BUILD_CHUNKS * 3 * bin_count); 
+
+        #pragma omp parallel for
+        for(int c = 0; c < BUILD_CHUNKS; c++)
+        {
+            fill_bins(primitives,chunk_start(start,end,c,BUILD_CHUNKS),chunk_start(start,end,c + 1,BUILD_CHUNKS),cbox,bin_count,&chunk_bins[c * 3 * bin_count]); 
+        }
+
+        for(int c = 0; c < BUILD_CHUNKS; c++)
+        {
+            for(int b = 0; b < 3 * bin_count; b++)
+            {
+                bins[b].count += chunk_bins[c * 3 * bin_count + b].count; 
+                bins[b].bounds = box_union(bins[b].bounds,chunk_bins[c * 3 * bin_count + b].bounds); 
+            }
+        }
+    }
+
+    SAHSplit best; 
+    std::vector<double> right_area(bin_count); 
+    std::vector<int> right_count(bin_count); 
+    for(int axis = 0; axis < 3; axis++)
+    {
+        if(axis_value(cbox.maximum,axis) - axis_value(cbox.minimum,axis) <= 0)
+            continue; 
+
+        const SAHBin* axis_bins = &bins[axis * bin_count]; 
+
+        //Sweep from the right to get the area and count of everything above each boundary
+        AABB right; 
+        int right_n = 0; 
+        for(int b = bin_count - 1; b > 0; b--)
+        {
+            right = box_union(right,axis_bins[b].bounds); 
+            right_n += axis_bins[b].count; 
+            right_area[b] = right.surface_area(); 
+            right_count[b] = right_n; 
+        }
+
+        //Then sweep from the left, evaluating the split below bin b
+        AABB left; 
+        int left_n = 0; 
+        for(int b = 1; b < bin_count; b++)
+        {
+            left = box_union(left,axis_bins[b - 1].bounds); 
+            left_n += axis_bins[b - 1].count; 
+            if(left_n == 0 || right_count[b] == 0)
+                continue; 
+
+            double cost = left.surface_area() * left_n + right_area[b] * right_count[b]; 
+            if(cost < best.cost)
+            {
+                best.cost = cost; 
+                best.axis = axis; 
+                best.bin = b; 
+            }
+        }
+    }
+
+    return best; 
+}
+
+// Moves the primitives below the split to the front of [start,end) and returns the index of the first one above it
+// In parallel every chunk counts its primitives below the split, then all of them are scattered to their place in
+// scratch and copied back, which keeps the order within each side
+static int partition_sah(std::vector<BVHPrimitive>& primitives, int start, int end, const AABB& cbox, int bin_count, const SAHSplit& split, bool parallel, std::vector<BVHPrimitive>& scratch)
+{
+    auto below = [&](const BVHPrimitive& p)
+    {
+        return centroid_bin(p.centroid,split.axis,cbox,bin_count) < split.bin; 
+    }; 
+
+    if(!parallel)
+        return (int)(std::partition(primitives.begin() + start,primitives.begin() + end,below) - primitives.begin()); 
+
+    int below_count[BUILD_CHUNKS]; 
+    #pragma omp parallel for
+    for(int c = 0; c < BUILD_CHUNKS; c++)
+    {
+        below_count[c] = 0; 
+        for(int i = chunk_start(start,end,c,BUILD_CHUNKS); i < chunk_start(start,end,c + 1,BUILD_CHUNKS); i++)
+        {
+            below_count[c] += below(primitives[i]) ? 1 : 0; 
+        }
+    }
+
+    //Where each chunk starts writing on either side of the split
+    int below_start[BUILD_CHUNKS]; 
+    int above_start[BUILD_CHUNKS]; 
+    int total_below = 0; 
+    for(int c = 0; c < BUILD_CHUNKS; c++)
+    {
+        total_below += below_count[c]; 
+    }
+    int next_below = 0; 
+    int next_above = total_below; 
+    for(int c = 0; c < BUILD_CHUNKS; c++)
+    {
+        below_start[c] = next_below; 
+        above_start[c] = next_above; 
+        next_below += below_count[c]; 
+        next_above += chunk_start(start,end,c + 1,BUILD_CHUNKS) - chunk_start(start,end,c,BUILD_CHUNKS) - below_count[c]; 
+    }
+
+    scratch.resize(end - start); 
+    #pragma omp parallel for
+    for(int c = 0; c < BUILD_CHUNKS; c++)
+    {
+        int b = below_start[c]; 
+        int a = above_start[c]; 
+        for(int i = chunk_start(start,end,c,BUILD_CHUNKS); i < chunk_start(start,end,c + 1,BUILD_CHUNKS); i++)
+        {
+            if(below(primitives[i]))
+                scratch[b++] = primitives[i]; 
+            else 
+                scratch[a++] = primitives[i]; 
+        }
+    }
+
+    #pragma omp parallel for
+    for(int i = 0; i < end - start; i++)
+    {
+        primitives[start + i] = scratch[i]; 
+    }
+
+    return start + total_below; 
+}
+
+// This function builds a BVH from a list of shapes, recursively dividing the shapes into left and right subtrees
+// It takes a maximum number of primitives per leaf node as a parameter
+BVH* build_bvh(std::vector<Shape*>& primitives,int maxPrimsPerLeaf)
+{
+    BVHBuildSettings settings; 
+    settings.builder = BVH_BUILDER::MEDIAN; 
+    settings.maxPrimsPerLeaf = maxPrimsPerLeaf; 
+
+    return build_bvh(primitives,settings); 
+}
+
+// This function builds a BVH over primitives[start,end) by splitting at the median centroid along the axis
+// where the centroids are furthest apart
+int build_bvh_median(BVH& bvh, std::vector<BVHPrimitive>& primitives, int start, int end, int maxPrimsPerLeaf, int depth)
+{
+    //Compute the bounding box of all the primitives and of their centroids
+    AABB bbox; 
+    AABB cbox; 
+    range_bounds(primitives,start,end,false,bbox,cbox); 
+
+    //base case
+    if(end - start <= leaf_limit(maxPrimsPerLeaf))
+        return make_leaf(bvh,primitives,start,end,bbox); 
+
+    //Choose the split axis based on how far apart the centroids are
+    int axis = (int)chooseSplitAxis(cbox); 
+
+    //Split the primitives into two halves around the median centroid
+    int mid = start + (end - start) / 2; 
+    std::nth_element(primitives.begin() + start,primitives.begin() + mid,primitives.begin() + end,[axis](const BVHPrimitive& a, const BVHPrimitive& b)
+    {
+        return axis_value(a.centroid,axis) < axis_value(b.centroid,axis); 
+    }); 
+
+    //Recursively build the left and right subtrees
+    int index = push_interior(bvh,bbox,axis); 
+    build_bvh_median(bvh,primitives,start,mid,maxPrimsPerLeaf,depth + 1); 
+    bvh.nodes[index].offset = build_bvh_median(bvh,primitives,mid,end,maxPrimsPerLeaf,depth + 1); 
+
+    return index; 
+}
+
+// This function builds a BVH over primitives[start,end) with the surface area heuristic
+// The centroids are sorted into bins along each axis and the node is split at the bin boundary
+// with the lowest expected cost, traversal_cost + intersection_cost * (A_L * N_L + A_R * N_R) / A
+// Past half of BVH_MAX_DEPTH the remaining levels are split at the median, which bounds the depth of the tree
+int build_bvh_sah(BVH& bvh, std::vector<BVHPrimitive>& primitives, int start, int end, const BVHBuildSettings& settings, int depth)
+{
+    int count = end - start; 
+    int max_leaf = leaf_limit(settings.maxPrimsPerLeaf); 
+
+    if(depth >= BVH_MAX_DEPTH / 2)
+        return build_bvh_median(bvh,primitives,start,end,max_leaf,depth); 
+
+    AABB bbox; 
+    AABB cbox; 
+    range_bounds(primitives,start,end,false,bbox,cbox); 
+
+    //base case
+    if(count == 1)
+        return make_leaf(bvh,primitives,start,end,bbox); 
+
+    int bin_count = std::max(settings.bin_count,2); 
+    SAHSplit split = find_sah_split(primitives,start,end,cbox,bin_count,false); 
+
+    //Small enough nodes become leaves when testing every primitive is cheaper than the best split
+    double leaf_cost = settings.intersection_cost * count; 
+    double area = bbox.surface_area(); 
+    double split_cost = settings.traversal_cost + settings.intersection_cost * count; 
+    if(split.axis != -1 && area > 0)
+        split_cost = settings.traversal_cost + settings.intersection_cost * split.cost / area; 
+
+    if(count <= max_leaf && leaf_cost <= split_cost)
+        return make_leaf(bvh,primitives,start,end,bbox); 
+
+    int mid; 
+    if(split.axis == -1)
+    {
+        //All centroids coincide, any split is as good as another
+        mid = start + count / 2; 
+    }
+    else 
+    {
+        std::vector<BVHPrimitive> unused; 
+        mid = partition_sah(primitives,start,end,cbox,bin_count,split,false,unused); 
+
+        //Floating point round off can still leave one side empty
+        if(mid == start || mid == end)
+            mid = start + count / 2; 
+    }
+
+    int index = push_interior(bvh,bbox,std::max(split.axis,0)); 
+    build_bvh_sah(bvh,primitives,start,mid,settings,depth + 1); 
+    bvh.nodes[index].offset = build_bvh_sah(bvh,primitives,mid,end,settings,depth + 1); 
+
+    return index; 
+}
+
+// Spreads the low 10 bits of v out so there are two zero bits between each of them
+static uint32_t expand_bits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu; 
+    v = (v * 0x00000101u) & 0x0F00F00Fu; 
+    v = (v * 0x00000011u) & 0xC30C30C3u; 
+    v = (v * 0x00000005u) & 0x49249249u; 
+    return v; 
+}
+
+// 30 bit Morton code of a centroid, 10 bits per axis of its position in the centroid box, interleaved x, y, z
+static uint32_t morton_code(const Point& centroid, const AABB& cbox)
+{
+    uint32_t bits[3]; 
+    for(int axis = 0; axis < 3; axis++)
+    {
+        double cmin = axis_value(cbox.minimum,axis); 
+        double extent = axis_value(cbox.maximum,axis) - cmin; 
+        double f = extent > 0 ? (axis_value(centroid,axis) - cmin) / extent : 0.0; 
+        bits[axis] = (uint32_t)std::min(std::max(f * 1024.0,0.0),1023.0); 
+    }
+
+    return (expand_bits(bits[0]) << 2) | (expand_bits(bits[1]) << 1) | expand_bits(bits[2]); 
+}
+
+// A primitive's Morton code and where it was before sorting
+struct MortonPrimitive
+{
+    uint32_t code; 
+    int index; 
+}; 
+
+// Sorts by Morton code with three stable passes of 10 bits each
+static void radix_sort(std::vector<MortonPrimitive>& items)
+{
+    constexpr int BITS = 10; 
+    constexpr int BUCKETS = 1 << BITS; 
+    std::vector<MortonPrimitive> temp(items.size()); 
+    std::vector<int> bucket_start(BUCKETS); 
+
+    for(int pass = 0; pass < 3; pass++)
+    {
+        int shift = pass * BITS; 
+        std::fill(bucket_start.begin(),bucket_start.end(),0); 
+        for(const MortonPrimitive& item: items)
+        {
+            bucket_start[(item.code >> shift) & (BUCKETS - 1)]++; 
+        }
+
+        int next = 0; 
+        for(int b = 0; b < BUCKETS; b++)
+        {
+            int count = bucket_start[b]; 
+            bucket_start[b] = next; 
+            next += count; 
+        }
+
+        for(const MortonPrimitive& item: items)
+        {
+            temp[bucket_start[(item.code >> shift) & (BUCKETS - 1)]++] = item; 
+        }
+        items.swap(temp); 
+    }
+}
+
+// Emits the subtree of the Morton sorted primitives[start,end), splitting where the codes first differ below bit
+// Every code in the range agrees on all bits above bit. The bounds are gathered on the way back up, which
+// keeps the whole build at one pass over the primitives per level. Returns the node index and the bounds in bbox
+static int emit_lbvh(BVH& bvh, const std::vector<BVHPrimitive>& primitives, const std::vector<uint32_t>& codes, int start, int end, int bit, int max_leaf, int depth, AABB& bbox)
+{
+    if(end - start <= max_leaf)
+    {
+        bbox = AABB(); 
+        for(int i = start; i < end; i++)
+        {
+            bbox = box_union(bbox,primitives[i].bounds); 
+        }
+        return make_leaf(bvh,primitives,start,end,bbox); 
+    }
+
+    //The codes are sorted, so the first and last one differ on a bit exactly when the range does
+    while(bit >= 0 && ((codes[start] >> bit) & 1) == ((codes[end - 1] >> bit) & 1))
+    {
+        bit--; 
+    }
+
+    //Identical codes, or a tree deep enough that its depth has to be bounded, are split in the middle
+    int mid = start + (end - start) / 2; 
+    int axis = 0; 
+    if(bit >= 0 && depth < BVH_MAX_DEPTH / 2)
+    {
+        uint32_t mask = 1u << bit; 
+        mid = (int)(std::partition_point(codes.begin() + start,codes.begin() + end,[mask](uint32_t code){return !(code & mask);}) - codes.begin()); 
+
+        //Bits are interleaved x, y, z from the top, bit 29 is x
+        axis = 2 - bit % 3; 
+    }
+
+    int index = push_interior(bvh,AABB(),axis); 
+    AABB left; 
+    AABB right; 
+    emit_lbvh(bvh,primitives,codes,start,mid,bit - 1,max_leaf,depth + 1,left); 
+    bvh.nodes[index].offset = emit_lbvh(bvh,primitives,codes,mid,end,bit - 1,max_leaf,depth + 1,right); 
+
+    bbox = box_union(left,right); 
+    set_node_bounds(bvh.nodes[index],bbox); 
+    return index; 
+}
+
+// An interior node from the top levels of a parallel build, or with part >= 0 a subtree that is built on its own
+struct TopNode
+{
+    AABB bbox; 
+    int axis = 0; 
+    int left = -1; 
+    int right = -1; 
+    int part = -1; 
+}; 
+
+// A range of primitives whose subtree is built by one thread
+struct BuildPart
+{
+    int start; 
+    int end; 
+    int depth; 
+    BVH bvh; 
+}; 
+
+// Splits ranges larger than settings.parallel_threshold with the bounds, binning and partitioning shared between threads,
+// and records the smaller ranges left over as parts. Returns the index of the top node for primitives[start,end)
+static int split_top_levels(std::vector<BVHPrimitive>& primitives, int start, int end, int depth, const BVHBuildSettings& settings, std::vector<TopNode>& top, std::vector<BuildPart>& parts, std::vector<BVHPrimitive>& scratch)
+{
+    int count = end - start; 
+    TopNode node; 
+    if(count <= std::max(settings.parallel_threshold,leaf_limit(settings.maxPrimsPerLeaf)) || depth >= BVH_MAX_DEPTH / 2)
+    {
+        node.part = (int)parts.size(); 
+        parts.push_back({start,end,depth,BVH()}); 
+        top.push_back(node); 
+        return (int)top.size() - 1; 
+    }
+
+    AABB cbox; 
+    range_bounds(primitives,start,end,true,node.bbox,cbox); 
+
+    int mid = start + count / 2; 
+    if(settings.builder == BVH_BUILDER::SAH)
+    {
+        int bin_count = std::max(settings.bin_count,2); 
+        SAHSplit split = find_sah_split(primitives,start,end,cbox,bin_count,true); 
+        if(split.axis != -1)
+        {
+            node.axis = split.axis; 
+            mid = partition_sah(primitives,start,end,cbox,bin_count,split,true,scratch); 
+            if(mid == start || mid == end)
+                mid = start + count / 2; 
+        }
+    }
+    else 
+    {
+        int axis = (int)chooseSplitAxis(cbox); 
+        node.axis = axis; 
+        std::nth_element(primitives.begin() + start,primitives.begin() + mid,primitives.begin() + end,[axis](const BVHPrimitive& a, const BVHPrimitive& b)
+        {
+            return axis_value(a.centroid,axis) < axis_value(b.centroid,axis); 
+        }); 
+    }
+
+    int index = (int)top.size(); 
+    top.push_back(node); 
+    int left = split_top_levels(primitives,start,mid,depth + 1,settings,top,parts,scratch); 
+    int right = split_top_levels(primitives,mid,end,depth + 1,settings,top,parts,scratch); 
+    top[index].left = left; 
+    top[index].right = right; 
+
+    return index; 
+}
+
+// Writes the top levels in depth-first order, splicing in the parts where they belong
+static int emit_top_levels(BVH& bvh, const std::vector<TopNode>& top, const std::vector<BuildPart>& parts, int index)
+{
+    const TopNode& node = top[index]; 
+    if(node.part >= 0)
+        return append_subtree(bvh,parts[node.part].bvh); 
+
+    int interior = push_interior(bvh,node.bbox,node.axis); 
+    emit_top_levels(bvh,top,parts,node.left); 
+    bvh.nodes[interior].offset = emit_top_levels(bvh,top,parts,node.right); 
+
+    return interior; 
+}
+
+// Top Morton bits shared by the primitives of one cluster when an LBVH is refined, 4 per axis
+constexpr int LBVH_CLUSTER_BITS = 12; 
+
+// Builds the levels above the clusters order[start,end) with the SAH, sweeping the clusters sorted along each axis
+// Past a quarter of BVH_MAX_DEPTH the clusters are split in half, so the clusters' own subtrees keep their depth budget
+static int split_clusters(std::vector<int>& order, int start, int end, const std::vector<AABB>& bounds, std::vector<BuildPart>& parts, int depth, std::vector<TopNode>& top)
+{
+    TopNode node; 
+    if(end - start == 1)
+    {
+        node.part = order[start]; 
+        parts[order[start]].depth = depth; 
+        top.push_back(node); 
+        return (int)top.size() - 1; 
+    }
+
+    AABB cbox(bounds[order[start]].centroid(),bounds[order[start]].centroid()); 
+    for(int i = start; i < end; i++)
+    {
+        node.bbox = box_union(node.bbox,bounds[order[i]]); 
+        cbox = box_union(cbox,AABB(bounds[order[i]].centroid(),bounds[order[i]].centroid())); 
+    }
+
+    auto sort_along = [&](int axis)
+    {
+        std::sort(order.begin() + start,order.begin() + end,[&](int a, int b)
+        {
+            return axis_value(bounds[a].centroid(),axis) < axis_value(bounds[b].centroid(),axis); 
+        }); 
+    }; 
+
+    int best_axis = (int)chooseSplitAxis(cbox); 
+    int mid = start + (end - start) / 2; 
+    if(depth < BVH_MAX_DEPTH / 4)
+    {
+        double best_cost = std::numeric_limits<double>::infinity(); 
+        std::vector<double> right_cost(end - start); 
+        for(int axis = 0; axis < 3; axis++)
+        {
+            sort_along(axis); 
+
+            //Cost of everything from i on, weighted by the number of primitives in each cluster
+            AABB right; 
+            int right_n = 0; 
+            for(int i = end - 1; i > start; i--)
+            {
+                right = box_union(right,bounds[order[i]]); 
+                right_n += parts[order[i]].end - parts[order[i]].start; 
+                right_cost[i - start] = right.surface_area() * right_n; 
+            }
+
+            AABB left; 
+            int left_n = 0; 
+            for(int i = start + 1; i < end; i++)
+            {
+                left = box_union(left,bounds[order[i - 1]]); 
+                left_n += parts[order[i - 1]].end - parts[order[i - 1]].start; 
+                double cost = left.surface_area() * left_n + right_cost[i - start]; 
+                if(cost < best_cost)
+                {
+                    best_cost = cost; 
+                    best_axis = axis; 
+                    mid = i; 
+                }
+            }
+        }
+    }
+    sort_along(best_axis); 
+    node.axis = best_axis; 
+
+    int index = (int)top.size(); 
+    top.push_back(node); 
+    int left = split_clusters(order,start,mid,bounds,parts,depth + 1,top); 
+    int right = split_clusters(order,mid,end,bounds,parts,depth + 1,top); 
+    top[index].left = left; 
+    top[index].right = right; 
+
+    return index; 
+}
+
+// This function builds a linear BVH over primitives[start,end)
+// The centroids get 30 bit Morton codes that are radix sorted, which puts primitives that are close in space next to
+// each other, and every node is split where the codes of its range first differ. With settings.lbvh_refine the primitives
+// are first grouped into clusters that share their top Morton bits, each cluster gets its own LBVH (in parallel) and
+// the levels above the clusters are built with the SAH, which repairs the worst splits of the Morton curve
+int build_bvh_lbvh(BVH& bvh, std::vector<BVHPrimitive>& primitives, int start, int end, const BVHBuildSettings& settings, int depth)
+{
+    int count = end - start; 
+    int max_leaf = leaf_limit(settings.maxPrimsPerLeaf); 
+    bool parallel = count > settings.parallel_threshold; 
+
+    AABB bbox; 
+    AABB cbox; 
+    range_bounds(primitives,start,end,parallel,bbox,cbox); 
+
+    std::vector<MortonPrimitive> morton(count); 
+    #pragma omp parallel for if(parallel)
+    for(int i = 0; i < count; i++)
+    {
+        morton[i] = {morton_code(primitives[start + i].centroid,cbox),start + i}; 
+    }
+    radix_sort(morton); 
+
+    //Move the primitives into Morton order, codes[i] belongs to primitives[i]
+    std::vector<BVHPrimitive> sorted(count); 
+    std::vector<uint32_t> codes(end); 
+    for(int i = 0; i < count; i++)
+    {
+        sorted[i] = primitives[morton[i].index]; 
+        codes[start + i] = morton[i].code; 
+    }
+    std::copy(sorted.begin(),sorted.end(),primitives.begin() + start); 
+
+    if(!settings.lbvh_refine)
+    {
+        AABB unused; 
+        return emit_lbvh(bvh,primitives,codes,start,end,29,max_leaf,depth,unused); 
+    }
+
+    //Each run of codes that agree on their top bits is a cluster
+    constexpr int shift = 30 - LBVH_CLUSTER_BITS; 
+    std::vector<BuildPart> parts; 
+    int cluster_start = start; 
+    for(int i = start + 1; i <= end; i++)
+    {
+        if(i == end || (codes[i] >> shift) != (codes[cluster_start] >> shift))
+        {
+            parts.push_back({cluster_start,i,depth,BVH()}); 
+            cluster_start = i; 
+        }
+    }
+
+    int part_count = (int)parts.size(); 
+    std::vector<AABB> part_bounds(part_count); 
+    std::vector<int> order(part_count); 
+    #pragma omp parallel for if(parallel)
+    for(int i = 0; i < part_count; i++)
+    {
+        order[i] = i; 
+        for(int j = parts[i].start; j < parts[i].end; j++)
+        {
+            part_bounds[i] = box_union(part_bounds[i],primitives[j].bounds); 
+        }
+    }
+
+    //The levels above the clusters decide the depth each cluster's subtree starts at
+    std::vector<TopNode> top; 
+    split_clusters(order,0,part_count,part_bounds,parts,depth,top); 
+
+    #pragma omp parallel for schedule(dynamic,1) if(parallel)
+    for(int i = 0; i < part_count; i++)
+    {
+        AABB unused; 
+        emit_lbvh(parts[i].bvh,primitives,codes,parts[i].start,parts[i].end,shift - 1,max_leaf,parts[i].depth,unused); 
+    }
+
+    return emit_top_levels(bvh,top,parts,0); 
+}
+
+// Moves the leaves apart in indices so each one starts at a multiple of alignment, the gaps are filled with -1
+// Nodes are in depth first order, so the leaves keep their order
+static void align_leaves(BVH& bvh, int alignment)
+{
+    std::vector<int> aligned; 
+    aligned.reserve(bvh.indices.size() + bvh.nodes.size() * (alignment - 1) / 2); 
+    for(BVHNode& node: bvh.nodes)
+    {
+        if(!node.isLeaf())
+            continue; 
+
+        int first = node.offset; 
+        node.offset = (int)aligned.size(); 
+        aligned.insert(aligned.end(),bvh.indices.begin() + first,bvh.indices.begin() + first + node.count); 
+        aligned.resize((aligned.size() + alignment - 1) / alignment * alignment,-1); 
+    }
+    bvh.indices.swap(aligned); 
+}
+
+// Compiles primitive i down for the leaves, see BVHPrimitiveTag
+// Triangles are only copied out while they have an identity transform, which is what baking them leaves them with
+static void compile_primitive(BVH& bvh, int i)
+{
+    const Shape* s = bvh.primitives[i]; 
+    BVHPrimitiveTag tag; 
+    tag.type = s->shape_type; 
+
+    if(s->shape_type == SHAPE_TYPE::TRIANGLE || s->shape_type == SHAPE_TYPE::SMOOTH_TRIANGLE)
+    {
+        if(s->transform_type != TRANSFORM_TYPE::IDENTITY)
+        {
+            tag.type = SHAPE_TYPE::OTHER; 
+        }
+        else 
+        {
+            tag.type = SHAPE_TYPE::TRIANGLE; 
+            tag.index = (int)bvh.triangles.size(); 
+            if(s->shape_type == SHAPE_TYPE::TRIANGLE)
+            {
+                const Triangle* tri = static_cast<const Triangle*>(s); 
+                bvh.triangles.push_back({tri->p1,tri->p2,tri->p3}); 
+            }
+            else 
+            {
+                const SmoothTriangle* tri = static_cast<const SmoothTriangle*>(s); 
+                bvh.triangles.push_back({tri->p1,tri->p2,tri->p3}); 
+            }
+        }
+    }
+
+    bvh.tags[i] = tag; 
+}
+
+static void compile_primitives(BVH& bvh)
+{
+    bvh.tags.assign(bvh.primitives.size(),BVHPrimitiveTag()); 
+    bvh.triangles.clear(); 
+    for(int i = 0; i < (int)bvh.primitives.size(); i++)
+    {
+        compile_primitive(bvh,i); 
+    }
+}
+
+// Builds the nodes of bvh over info with the builder selected in settings
+// Large builds first split their top levels, then build the subtrees below them on separate threads
+static void build_nodes(BVH* bvh, std::vector<BVHPrimitive>& info, const BVHBuildSettings& settings)
+{
+    bvh->settings = settings; 
+    int n = (int)info.size(); 
+    if(n == 0)
+        return; 
+
+    bvh->nodes.reserve(2 * n); 
+
+    auto build_range = [&](BVH& out, int start, int end, int depth)
+    {
+        if(settings.builder == BVH_BUILDER::MEDIAN)
+            build_bvh_median(out,info,start,end,settings.maxPrimsPerLeaf,depth); 
+        else 
+            build_bvh_sah(out,info,start,end,settings,depth); 
+    }; 
+
+    //The linear builder shares its own passes between threads
+    if(settings.builder == BVH_BUILDER::LBVH)
+    {
+        build_bvh_lbvh(*bvh,info,0,n,settings); 
+    }
+    else if(n <= settings.parallel_threshold)
+    {
+        build_range(*bvh,0,n,0); 
+    }
+    else 
+    {
+        std::vector<TopNode> top; 
+        std::vector<BuildPart> parts; 
+        std::vector<BVHPrimitive> scratch; 
+        split_top_levels(info,0,n,0,settings,top,parts,scratch); 
+
+        int part_count = (int)parts.size(); 
+        #pragma omp parallel for schedule(dynamic,1)
+        for(int i = 0; i < part_count; i++)
+        {
+            build_range(parts[i].bvh,parts[i].start,parts[i].end,parts[i].depth); 
+        }
+
+        emit_top_levels(*bvh,top,parts,0); 
+    }
+
+    if(settings.leaf_alignment > 1 && bvh->primitives.empty())
+        align_leaves(*bvh,settings.leaf_alignment); 
+
+    collapse_bvh(*bvh); 
+    compile_primitives(*bvh); 
+    bvh->build_cost = bvh_sah_cost(bvh); 
+}
+
+// This function builds a BVH over shapes with the builder selected in settings
+BVH* build_bvh(std::vector<Shape*>& primitives, const BVHBuildSettings& settings)
 {
-    Point c1 = a->transform * Point(0,0,0); 
-    Point c2 = b->transform * Point(0,0,0); 
-    return c1.x < c2.x;
+    BVH* bvh = new BVH(); 
+    std::vector<BVHPrimitive> info = primitive_info(primitives,settings.parallel_threshold); 
+    bvh->primitives.reserve(info.size()); 
+    build_nodes(bvh,info,settings); 
+
+    return bvh; 
 }
 
-bool comp_yaxis(Shape* a, Shape* b) 
+// This function builds a BVH over primitives known only by their bounds
+BVH* build_bvh(const std::vector<AABB>& bounds, const BVHBuildSettings& settings)
 {
-    Point c1 = a->transform * Point(0,0,0); 
-    Point c2 = b->transform * Point(0,0,0); 
-    return c1.y < c2.y;
+    BVH* bvh = new BVH(); 
+    int n = (int)bounds.size(); 
+    std::vector<BVHPrimitive> info(n); 
+
+    #pragma omp parallel for if(n > settings.parallel_threshold)
+    for(int i = 0; i < n; i++)
+    {
+        info[i] = {nullptr,bounds[i],bounds[i].centroid(),i}; 
+    }
+    bvh->indices.reserve(n); 
+    build_nodes(bvh,info,settings); 
+
+    return bvh; 
 }
 
-bool comp_zaxis(Shape* a, Shape* b) 
+// Height of the subtree below every node, a leaf has height 1
+// Children always come after their parent, so one pass from the back sees them first
+static std::vector<int> subtree_heights(const BVH& bvh)
 {
-    Point c1 = a->transform * Point(0,0,0); 
-    Point c2 = b->transform * Point(0,0,0); 
-    return c1.z < c2.z;
+    std::vector<int> height(bvh.nodes.size()); 
+    for(int i = (int)bvh.nodes.size() - 1; i >= 0; i--)
+    {
+        const BVHNode& node = bvh.nodes[i]; 
+        height[i] = node.isLeaf() ? 1 : 1 + std::max(height[i + 1],height[node.offset]); 
+    }
+
+    return height; 
 }
 
+// A node the new leaf could be paired with, bound is the least the pairing can cost
+struct InsertCandidate
+{
+    int node; 
+    int depth; 
+    double inherited; 
+    double bound; 
+
+    bool operator<(const InsertCandidate& other) const {return this->bound > other.bound;}
+}; 
 
-// This function sorts the primitives based on their centroids along the specified axis
-// It uses the helper functions defined above to compare the centroids of the shapes
-void sortPrimitivesByCentroid(std::vector<Shape*>& primitives, AXIS ax)
+bool bvh_insert(BVH* bvh, Shape* s)
 {
-    switch (ax)
+    AABB box = s->parent_bounds(); 
+    BVHNode leaf; 
+    set_node_bounds(leaf,box); 
+    leaf.offset = (int)bvh->primitives.size(); 
+    leaf.count = 1; 
+
+    if(bvh->nodes.empty())
+    {
+        bvh->primitives.push_back(s); 
+        bvh->tags.resize(bvh->primitives.size()); 
+        compile_primitive(*bvh,leaf.offset); 
+        bvh->nodes.push_back(leaf); 
+        collapse_bvh(*bvh); 
+        return true; 
+    }
+
+    //Pairing with a node pushes its whole subtree one level down. Shapes inserted along a line would keep pairing with the
+    //last one and grow a chain, so pairings that take the tree past the depth where the builders give up on the SAH are skipped
+    std::vector<int> height = subtree_heights(*bvh); 
+    int max_height = std::max(height[0],BVH_MAX_DEPTH / 2); 
+
+    //The cost of pairing with a node is the area of the new parent plus what it adds to every ancestor (the inherited cost)
+    //Below a node the cost is at least the leaf's own area plus the inherited cost, which bounds the search
+    AABB leaf_box = leaf.bounds(); 
+    double leaf_area = leaf_box.surface_area(); 
+    int best = -1; 
+    double best_cost = std::numeric_limits<double>::infinity(); 
+
+    std::priority_queue<InsertCandidate> queue; 
+    queue.push({0,0,0.0,leaf_area}); 
+    while(!queue.empty())
+    {
+        InsertCandidate candidate = queue.top(); 
+        queue.pop(); 
+        if(candidate.bound >= best_cost)
+            break; 
+
+        const BVHNode& node = bvh->nodes[candidate.node]; 
+        double node_area = node.bounds().surface_area(); 
+        double direct = box_union(node.bounds(),leaf_box).surface_area(); 
+        double cost = direct + candidate.inherited; 
+        if(cost < best_cost && candidate.depth + 1 + height[candidate.node] <= max_height)
+        {
+            best_cost = cost; 
+            best = candidate.node; 
+        }
+
+        if(!node.isLeaf())
+        {
+            double inherited = candidate.inherited + direct - node_area; 
+            double bound = leaf_area + inherited; 
+            if(bound < best_cost)
+            {
+                queue.push({candidate.node + 1,candidate.depth + 1,inherited,bound}); 
+                queue.push({node.offset,candidate.depth + 1,inherited,bound}); 
+            }
+        }
+    }
+
+    if(best < 0)
+        return false; 
+
+    //The subtree of best ends where its rightmost path reaches a leaf
+    int end = best; 
+    while(!bvh->nodes[end].isLeaf())
+    {
+        end = bvh->nodes[end].offset; 
+    }
+    end++; 
+
+    //The new parent takes the place of best, the subtree moves down one slot and the leaf follows it,
+    //so node references into the subtree move by one and references past it by two
+    for(BVHNode& node: bvh->nodes)
     {
-    case AXIS::X_AXIS:
-        std::sort(primitives.begin(),primitives.end(),comp_xaxis); 
-        return;
-    
-    case AXIS::Y_AXIS:
-        std::sort(primitives.begin(),primitives.end(),comp_yaxis); 
-        return;
+        if(node.isLeaf())
+            continue; 
+
+        if(node.offset > end - 1)
+            node.offset += 2; 
+        else if(node.offset > best)
+            node.offset += 1; 
+    }
+
+    BVHNode parent; 
+    AABB parent_box = box_union(bvh->nodes[best].bounds(),leaf_box); 
+    set_node_bounds(parent,parent_box); 
+    parent.offset = end + 1; 
+    parent.count = 0; 
+    parent.axis = (uint8_t)chooseSplitAxis(parent_box); 
 
-    case AXIS::Z_AXIS:
-        std::sort(primitives.begin(),primitives.end(),comp_zaxis); 
-        return;
+    bvh->nodes.insert(bvh->nodes.begin() + end,leaf); 
+    bvh->nodes.insert(bvh->nodes.begin() + best,parent); 
+    bvh->primitives.push_back(s); 
+    bvh->tags.resize(bvh->primitives.size()); 
+    compile_primitive(*bvh,leaf.offset); 
+
+    //Grow the ancestors of the new parent on the way down from the root
+    int index = 0; 
+    while(index != best)
+    {
+        BVHNode& node = bvh->nodes[index]; 
+        set_node_bounds(node,box_union(node.bounds(),leaf_box)); 
+        index = best < node.offset ? index + 1 : node.offset; 
     }
+
+    collapse_bvh(*bvh); 
+    return true; 
 }
 
-// This function computes the bounding box of a set of primitives and their centroids
-// It returns a pair containing the bounding box of the primitives and the bounding box of their centroids
-std::pair<AABB,AABB> computeBoundingBox(std::vector<Shape*>& primitives)
+double refit_bvh(BVH* bvh)
 {
-    AABB primBox = primitives[0]->bounds(); 
-    primBox = primBox.transform(primitives[0]->transform); 
+    //Without shapes there is nothing to ask for new bounds
+    int n = (int)bvh->nodes.size(); 
+    if(n == 0 || bvh->primitives.empty())
+        return 1.0; 
+
+    //The leaves first, each only looks at its own primitives
+    #pragma omp parallel for if(n > bvh->settings.parallel_threshold)
+    for(int i = 0; i < n; i++)
+    {
+        BVHNode& node = bvh->nodes[i]; 
+        if(!node.isLeaf())
+            continue; 
 
-    Point centroid = primitives[0]->transform * Point(0,0,0);; 
-    AABB cbox = AABB(centroid,centroid); 
+        AABB box; 
+        for(int j = node.offset; j < node.offset + node.count; j++)
+        {
+            box = box_union(box,bvh->primitives[j]->parent_bounds()); 
+        }
+        set_node_bounds(node,box); 
+    }
 
-    for(Shape* shape: primitives)
+    //Children come after their parent, so walking back up the array sees them first
+    for(int i = n - 1; i >= 0; i--)
     {
-       AABB box = shape->bounds(); 
-       box = box.transform(shape->transform); 
-       primBox = box_union(box,primBox); 
+        BVHNode& node = bvh->nodes[i]; 
+        if(!node.isLeaf())
+            set_node_bounds(node,box_union(bvh->nodes[i + 1].bounds(),bvh->nodes[node.offset].bounds())); 
+    }
+
+    collapse_bvh(*bvh); 
+    compile_primitives(*bvh); 
+    if(bvh->build_cost <= 0)
+        return 1.0; 
+
+    return bvh_sah_cost(bvh) / bvh->build_cost; 
+}
 
-       //centroid calcs 
-       Point centroid = shape->transform * Point(0,0,0); 
-       cbox.minimum.x = std::min(cbox.minimum.x,centroid.x); 
-       cbox.minimum.y = std::min(cbox.minimum.y,centroid.y); 
-       cbox.minimum.z = std::min(cbox.minimum.z,centroid.z); 
+double bvh_sah_cost(const BVH* bvh)
+{
+    if(bvh->nodes.empty())
+        return 0; 
+
+    //Unbounded shapes (planes) have no meaningful areas to compare
+    double root_area = bvh->nodes[0].bounds().surface_area(); 
+    if(!(root_area > 0) || !std::isfinite(root_area))
+        return 0; 
 
-       cbox.maximum.x = std::max(cbox.maximum.x,centroid.x); 
-       cbox.maximum.y = std::max(cbox.maximum.y,centroid.y); 
-       cbox.maximum.z = std::max(cbox.maximum.z,centroid.z); 
+    double cost = 0; 
+    for(const BVHNode& node: bvh->nodes)
+    {
+        double weight = node.isLeaf() ? node.count * bvh->settings.intersection_cost : bvh->settings.traversal_cost; 
+        cost += node.bounds().surface_area() / root_area * weight; 
     }
 
-    std::pair<AABB,AABB> paired = {primBox,cbox}; 
+    return cost; 
+}
+
+// This function counts the number of primitives in the BVH
+int count_bvh(const BVH* bvh)
+{
+    int count = 0; 
+    for(const BVHNode& node: bvh->nodes)
+    {
+        count += node.count; 
+    }
 
-    return paired; 
+    return count; 
 }
 
-// This function chooses the axis for splitting the bounding box based on the largest extent
-// It compares the extents along the x, y, and z axes and returns the axis
-AXIS chooseSplitAxis(const AABB& cbox)
+BVH4Node::BVH4Node()
 {
-    Vector extent = cbox.maximum - cbox.minimum; 
-    if(extent.x >= extent.y && extent.x >= extent.z)
-        return AXIS::X_AXIS;
-        
-    if(extent.y >= extent.z)
-        return AXIS::Y_AXIS; 
+    for(int axis = 0; axis < 3; axis++)
+    {
+        for(int lane = 0; lane < 4; lane++)
+        {
+            this->bbox_min[axis][lane] = std::numeric_limits<float>::infinity(); 
+            this->bbox_max[axis][lane] = -std::numeric_limits<float>::infinity(); 
+        }
+    }
+}
 
-    return AXIS::Z_AXIS; 
+// Fills one lane of a wide node from a binary node
+static void set_wide_lane(BVH4Node& wide, int lane, const BVHNode& node)
+{
+    for(int axis = 0; axis < 3; axis++)
+    {
+        wide.bbox_min[axis][lane] = node.bbox_min[axis]; 
+        wide.bbox_max[axis][lane] = node.bbox_max[axis]; 
+    }
 }
 
-// This function creates a union of two AABBs, returning a new AABB that encompasses both
-// It calculates the minimum and maximum points of the union based on the minimum and maximum points of both boxes
-AABB box_union(const AABB& box1, const AABB& box2)
+// Collapses the binary subtree below the interior node binary into a wide node and returns its index
+static int collapse_node(BVH& bvh, int binary)
 {
-    Point minUnion; 
-    Point maxUnion; 
+    //Start from the two children and keep opening the interior child with the largest box until there are four
+    int slots[4] = {binary + 1,bvh.nodes[binary].offset,-1,-1}; 
+    int n = 2; 
+    while(n < 4)
+    {
+        int best = -1; 
+        double best_area = -1; 
+        for(int i = 0; i < n; i++)
+        {
+            const BVHNode& node = bvh.nodes[slots[i]]; 
+            if(!node.isLeaf() && node.bounds().surface_area() > best_area)
+            {
+                best = i; 
+                best_area = node.bounds().surface_area(); 
+            }
+        }
 
-    minUnion.x = std::min(box1.minimum.x,box2.minimum.x); 
-    minUnion.y = std::min(box1.minimum.y,box2.minimum.y); 
-    minUnion.z = std::min(box1.minimum.z,box2.minimum.z); 
+        if(best == -1)
+            break; 
 
-    maxUnion.x = std::max(box1.maximum.x,box2.maximum.x); 
-    maxUnion.y = std::max(box1.maximum.y,box2.maximum.y); 
-    maxUnion.z = std::max(box1.maximum.z,box2.maximum.z); 
+        int opened = slots[best]; 
+        slots[best] = opened + 1; 
+        slots[n++] = bvh.nodes[opened].offset; 
+    }
 
-    return AABB(minUnion,maxUnion); 
+    int index = (int)bvh.wide_nodes.size(); 
+    bvh.wide_nodes.push_back(BVH4Node()); 
+    bvh.wide_nodes[index].child_count = (uint8_t)n; 
+
+    for(int i = 0; i < n; i++)
+    {
+        const BVHNode& node = bvh.nodes[slots[i]]; 
+        set_wide_lane(bvh.wide_nodes[index],i,node); 
+        if(node.isLeaf())
+        {
+            bvh.wide_nodes[index].child[i] = node.offset; 
+            bvh.wide_nodes[index].count[i] = node.count; 
+        }
+        else 
+        {
+            //The vector may grow while the child is collapsed, so the node is looked up again afterwards
+            int child = collapse_node(bvh,slots[i]); 
+            bvh.wide_nodes[index].child[i] = child; 
+        }
+    }
+
+    return index; 
 }
 
-// This function builds a BVH from a list of shapes, recursively dividing the shapes into left and right subtrees
-// It takes a maximum number of primitives per leaf node as a parameter
-BVHNode* build_bvh(std::vector<Shape*>& primitives,int maxPrimsPerLeaf)
+// This function rebuilds the wide nodes from the binary nodes
+// Unused lanes keep empty bounds (minimum above maximum), which every slab test rejects
+void collapse_bvh(BVH& bvh)
 {
-    if(primitives.size() == 0)
+    bvh.wide_nodes.clear(); 
+    if(bvh.nodes.empty())
+        return; 
+
+    bvh.wide_nodes.reserve(bvh.nodes.size() / 2 + 1); 
+    if(bvh.nodes[0].isLeaf())
     {
-        BVHNode* bvh = new BVHNode(); 
-        bvh->isLeaf = true; 
-        return bvh; 
+        BVH4Node root; 
+        set_wide_lane(root,0,bvh.nodes[0]); 
+        root.child[0] = bvh.nodes[0].offset; 
+        root.count[0] = bvh.nodes[0].count; 
+        root.child_count = 1; 
+        bvh.wide_nodes.push_back(root); 
+        return; 
     }
 
-    return build_bvh_recursive(primitives,maxPrimsPerLeaf); 
+    collapse_node(bvh,0); 
 }
 
+// A ray as seen by the wide node test, loaded once per traversal
+struct WideRay
+{
+#ifdef USE_SSE
+    __m128d origin[3]; 
+    __m128d inv_direction[3]; 
+#else
+    double origin[3]; 
+    double inv_direction[3]; 
+#endif
+    int sign[3]; 
+
+    WideRay(const Ray& r)
+    {
+        const double o[3] = {r.origin.x,r.origin.y,r.origin.z}; 
+        const double inv[3] = {r.inv_direction.x,r.inv_direction.y,r.inv_direction.z}; 
+        for(int axis = 0; axis < 3; axis++)
+        {
+#ifdef USE_SSE
+            this->origin[axis] = _mm_set1_pd(o[axis]); 
+            this->inv_direction[axis] = _mm_set1_pd(inv[axis]); 
+#else
+            this->origin[axis] = o[axis]; 
+            this->inv_direction[axis] = inv[axis]; 
+#endif
+            this->sign[axis] = r.sign[axis]; 
+        }
+    }
+}; 
 
-BVHNode* build_bvh_recursive(std::vector<Shape*>& primitives,int maxPrimsPerLeaf)
+// Slab test of the ray against the four child boxes of a wide node, limited to the interval [t_min,t_max]
+// Returns a bit mask of the children that are hit and writes the distance at which the ray enters each of them.
+// The float bounds are widened to double before the test, so it gives exactly the same answer as the scalar slab test.
+static int wide_node_intersect(const BVH4Node& node, const WideRay& r, double t_min, double t_max, double t_entry[4])
 {
-    //base case
-    if(primitives.size() <= maxPrimsPerLeaf)
+#ifdef USE_SSE
+    //Two lanes per register, children 0 and 1 in lo and children 2 and 3 in hi
+    __m128d tmin_lo = _mm_set1_pd(t_min); 
+    __m128d tmin_hi = tmin_lo; 
+    __m128d tmax_lo = _mm_set1_pd(t_max); 
+    __m128d tmax_hi = tmax_lo; 
+
+    for(int axis = 0; axis < 3; axis++)
     {
-        BVHNode* node = new BVHNode; 
-        auto [bbox, _] = computeBoundingBox(primitives); 
-        node->bbox = bbox; 
-        node->primitives = primitives; 
-        node->isLeaf = true; 
+        __m128 near_box = _mm_load_ps(r.sign[axis] ? node.bbox_max[axis] : node.bbox_min[axis]); 
+        __m128 far_box = _mm_load_ps(r.sign[axis] ? node.bbox_min[axis] : node.bbox_max[axis]); 
 
-        return node; 
+        __m128d t0_lo = _mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(near_box),r.origin[axis]),r.inv_direction[axis]); 
+        __m128d t0_hi = _mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(near_box,near_box)),r.origin[axis]),r.inv_direction[axis]); 
+        __m128d t1_lo = _mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(far_box),r.origin[axis]),r.inv_direction[axis]); 
+        __m128d t1_hi = _mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(far_box,far_box)),r.origin[axis]),r.inv_direction[axis]); 
+
+        //max and min return their second operand when the first is NaN, so a ray lying in a slab plane is ignored
+        tmin_lo = _mm_max_pd(t0_lo,tmin_lo); 
+        tmin_hi = _mm_max_pd(t0_hi,tmin_hi); 
+        tmax_lo = _mm_min_pd(t1_lo,tmax_lo); 
+        tmax_hi = _mm_min_pd(t1_hi,tmax_hi); 
     }
 
-    //Compute the bounding box of all the primitives
-    auto [bbox,cbox] = computeBoundingBox(primitives); 
-    
-    //Choose the split axis based on how far apart the centroids are
-    AXIS ax = chooseSplitAxis(cbox); 
+    _mm_storeu_pd(t_entry,tmin_lo); 
+    _mm_storeu_pd(t_entry + 2,tmin_hi); 
+    return _mm_movemask_pd(_mm_cmple_pd(tmin_lo,tmax_lo)) | (_mm_movemask_pd(_mm_cmple_pd(tmin_hi,tmax_hi)) << 2); 
+#else
+    int mask = 0; 
+    for(int lane = 0; lane < 4; lane++)
+    {
+        double tmin = t_min; 
+        double tmax = t_max; 
+        for(int axis = 0; axis < 3; axis++)
+        {
+            clip_slab(node.bbox_min[axis][lane],node.bbox_max[axis][lane],r.origin[axis],r.inv_direction[axis],r.sign[axis],tmin,tmax); 
+        }
+        t_entry[lane] = tmin; 
+        if(tmin <= tmax)
+            mask |= 1 << lane; 
+    }
+    return mask; 
+#endif
+}
 
-    //Sort the primitives based on their centroids along the chosen axis
-    sortPrimitivesByCentroid(primitives,ax); 
+// A child of a wide node waiting to be visited, count > 0 marks a leaf
+struct WideEntry
+{
+    int child; 
+    int count; 
+    double t_entry; 
+}; 
 
-    //Split the primitives into two halves
-    //This is a simple split, could be improved with a more sophisticated method
-    int midpoint = primitives.size()/2; 
-    std::vector<Shape*> left_primitives = std::vector<Shape*>(primitives.begin(), primitives.begin() + midpoint);
-    std::vector<Shape*> right_primitives = std::vector<Shape*>(primitives.begin() + midpoint, primitives.end());
+// Every wide node replaces itself with at most four children, so the stack grows by at most three per level
+constexpr int WIDE_STACK_SIZE = 3 * BVH_MAX_DEPTH + 1; 
 
-    //Recursively build the left and right subtrees
-    BVHNode* node = new BVHNode; 
-    node->bbox = bbox; 
-    node->left = build_bvh(left_primitives,maxPrimsPerLeaf); 
-    node->right = build_bvh(right_primitives,maxPrimsPerLeaf); 
+// Walks every node the ray enters between t_min and t_max and hands the leaves to leaf(first,count)
+// The wide tree is walked iteratively, the children of every node that is entered wait on a fixed size stack.
+// leaf returns true to end the walk early, which is then returned
+template<typename Leaf>
+static bool traverse_all(const BVH* bvh, const Ray& r, double t_min, double t_max, Leaf leaf)
+{
+    if(bvh->wide_nodes.empty())
+        return false; 
+
+    WideRay ray(r); 
+    int stack[WIDE_STACK_SIZE]; 
+    int top = 0; 
+    stack[top++] = 0; 
+    double t_entry[4]; 
+
+    while(top > 0)
+    {
+        const BVH4Node& node = bvh->wide_nodes[stack[--top]]; 
+        int mask = wide_node_intersect(node,ray,t_min,t_max,t_entry); 
+        for(int lane = 0; lane < node.child_count; lane++)
+        {
+            if(!(mask & (1 << lane)))
+                continue; 
+
+            if(node.count[lane] == 0)
+            {
+                stack[top++] = node.child[lane]; 
+                continue; 
+            }
 
-    return node; 
+            if(leaf(node.child[lane],(int)node.count[lane]))
+                return true; 
+        }
+    }
+
+    return false; 
 }
 
-// This function counts the number of primitives in the BVH
-// It recursively traverses the BVH and sums the number of primitives in each leaf node
-int count_bvh(BVHNode* node)
+// Walks the nodes nearest first, handing the leaves to leaf(first,count,t_max)
+// leaf returns true when it found a hit and lowered t_max (its t_best) to it, children entered beyond t_max are then skipped.
+// The children of a node are pushed farthest first so the best hit is found early
+template<typename Leaf>
+static bool traverse_closest(const BVH* bvh, const Ray& r, double t_max, Leaf leaf)
 {
-    if(node->isLeaf)
-        return node->primitives.size(); 
+    if(bvh->wide_nodes.empty())
+        return false; 
+
+    WideRay ray(r); 
+    bool found = false; 
+    WideEntry stack[WIDE_STACK_SIZE]; 
+    int top = 0; 
+    stack[top++] = {0,0,0.0}; 
+    double t_entry[4]; 
+
+    while(top > 0)
+    {
+        WideEntry entry = stack[--top]; 
 
-    return count_bvh(node->left) + count_bvh(node->right); 
+        //A closer hit may have been found since this child was pushed
+        if(entry.t_entry > t_max)
+            continue; 
+
+        if(entry.count > 0)
+        {
+            found |= leaf(entry.child,entry.count,t_max); 
+            continue; 
+        }
+
+        const BVH4Node& node = bvh->wide_nodes[entry.child]; 
+        int mask = wide_node_intersect(node,ray,0.0,t_max,t_entry); 
+
+        //Push the children that were hit farthest first, so the nearest one is on top of the stack
+        int first = top; 
+        for(int lane = 0; lane < node.child_count; lane++)
+        {
+            if(!(mask & (1 << lane)))
+                continue; 
+
+            WideEntry child = {node.child[lane],node.count[lane],t_entry[lane]}; 
+            int i = top++; 
+            while(i > first && stack[i - 1].t_entry < child.t_entry)
+            {
+                stack[i] = stack[i - 1]; 
+                i--; 
+            }
+            stack[i] = child; 
+        }
+    }
+
+    return found; 
 }
 
 // This function intersects a ray with the BVH
-std::vector<Intersection> bvh_intersect(BVHNode* node,const Ray& r)
+// Local hits of a shape whose type has a local_hits kernel, with the ray moved into its space the way Shape::intersect_into does
+template <typename T>
+static int typed_hits(const Shape* s, const Ray& r, double* ts)
+{
+    const T* shape = static_cast<const T*>(s); 
+    if(shape->transform_type == TRANSFORM_TYPE::IDENTITY)
+        return shape->local_hits(r,ts); 
+
+    return shape->local_hits(r.ray_transform(shape->inverse_transform,shape->transform_type),ts); 
+}
+
+// Tests primitive i with the kernel its tag picks, writing the distances of its hits to ts and, for triangles, the barycentric u and v
+// Returns how many hits there are, or -1 for primitives without a kernel which have to be tested through their virtual methods
+static int primitive_hits(const BVH* bvh, int i, const Ray& r, const TriangleRay& tr, double ts[4], double& u, double& v)
+{
+    const BVHPrimitiveTag& tag = bvh->tags[i]; 
+    switch(tag.type)
+    {
+    case SHAPE_TYPE::TRIANGLE:
+    {
+        const BVHTriangle& tri = bvh->triangles[tag.index]; 
+        return intersect_triangle(tr,tri.p1,tri.p2,tri.p3,ts[0],u,v) ? 1 : 0; 
+    }
+
+    case SHAPE_TYPE::SPHERE:
+        return typed_hits<Sphere>(bvh->primitives[i],r,ts); 
+
+    case SHAPE_TYPE::CUBE:
+        return typed_hits<Cube>(bvh->primitives[i],r,ts); 
+
+    case SHAPE_TYPE::CYLINDER:
+        return typed_hits<Cylinder>(bvh->primitives[i],r,ts); 
+
+    default:
+        return -1; 
+    }
+}
+
+std::vector<Intersection> bvh_intersect(const BVH* bvh,const Ray& r, double t_max)
 {
     std::vector<Intersection> xs; 
-    bvh_intersect_recursive(node, r, xs); 
+    bvh_intersect(bvh,r,xs,t_max); 
     return xs; 
 }
 
-bool bvh_intersect_recursive(BVHNode* node, const Ray& r,std::vector<Intersection>& xs)
+// The three queries test the primitives with their leaf kernels, set up the ray for the triangle test once, and only
+// fall back on the virtual methods for the primitives tagged OTHER
+void bvh_intersect(const BVH* bvh, const Ray& r, std::vector<Intersection>& xs, double t_max)
 {
-    if(!node->bbox.check_intersect(r))
+    TriangleRay tr(r); 
+    traverse_all(bvh,r,-std::numeric_limits<double>::infinity(),t_max,[&](int first, int count)
+    {
+        for(int i = first; i < first + count; i++)
+        {
+            double ts[4], u = 0, v = 0; 
+            int hits = primitive_hits(bvh,i,r,tr,ts,u,v); 
+            if(hits < 0)
+                bvh->primitives[i]->intersect_into(r,xs); 
+
+            for(int k = 0; k < hits; k++)
+            {
+                xs.push_back(Intersection(ts[k],bvh->primitives[i],u,v)); 
+            }
+        }
         return false; 
+    }); 
+}
+
+// This function finds the nearest intersection in front of the ray
+// t_max shrinks to every hit that is found, so children entered beyond the best hit so far are skipped
+bool bvh_intersect_closest(const BVH* bvh, const Ray& r, Intersection& hit, double t_max)
+{
+    TriangleRay tr(r); 
+    return traverse_closest(bvh,r,t_max,[&](int first, int count, double& t_best)
+    {
+        bool found = false; 
+        for(int i = first; i < first + count; i++)
+        {
+            double ts[4], u = 0, v = 0; 
+            int hits = primitive_hits(bvh,i,r,tr,ts,u,v); 
+            if(hits < 0 && bvh->primitives[i]->intersect_closest(r,hit,t_best))
+            {
+                t_best = hit.t; 
+                found = true; 
+            }
 
-    if(node->isLeaf)
+            for(int k = 0; k < hits; k++)
+            {
+                if(ts[k] > 0.0 && ts[k] < t_best)
+                {
+                    hit = Intersection(ts[k],bvh->primitives[i],u,v); 
+                    t_best = ts[k]; 
+                    found = true; 
+                }
+            }
+        }
+        return found; 
+    }); 
+}
+
+// This function answers an occlusion query for a shadow ray
+// Any hit in front of max_distance will do, so there is no ordering of the children and no intersection is kept
+bool bvh_occluded(const BVH* bvh, const Ray& r, double max_distance)
+{
+    TriangleRay tr(r); 
+    return traverse_all(bvh,r,0.0,max_distance,[&](int first, int count)
     {
-        bool hitSomething = false; 
-        for(Shape* s: node->primitives)
+        for(int i = first; i < first + count; i++)
         {
-            std::vector<Intersection> temp = s->intersect(r); 
-            if(!temp.empty())
+            double ts[4], u = 0, v = 0; 
+            int hits = primitive_hits(bvh,i,r,tr,ts,u,v); 
+            if(hits < 0 && bvh->primitives[i]->intersect_any(r,max_distance))
+                return true; 
+
+            for(int k = 0; k < hits; k++)
             {
-                hitSomething = true; 
-                xs.insert(xs.end(),temp.begin(),temp.end()); 
+                if(ts[k] > 0.0 && ts[k] < max_distance)
+                    return true; 
             }
         }
-        return hitSomething; 
+        return false; 
+    }); 
+}
+
+// Calls hit(t,u,v,tri) for every triangle of the mesh leaf [first,first + count) the ray hits, stops as soon as hit returns true
+// Meshes with packed blocks are tested four triangles at a time, their leaves start on a block boundary (see
+// TriangleMesh::refresh_bvh). The others are tested one triangle at a time through BVH::indices
+template<typename Hit>
+static bool mesh_leaf_hits(const BVH* bvh, const TriangleMesh& mesh, const TriangleRay& tr, int first, int count, Hit hit)
+{
+    if(mesh.blocks.empty())
+    {
+        for(int i = first; i < first + count; i++)
+        {
+            double t, u, v; 
+            int tri = bvh->indices[i]; 
+            if(tri >= 0 && mesh.intersect_triangle(tri,tr,t,u,v) && hit(t,u,v,tri))
+                return true; 
+        }
+        return false; 
     }
 
-    bool leftHit = bvh_intersect_recursive(node->left,r,xs); 
-    bool rightHit = bvh_intersect_recursive(node->right,r,xs); 
+    for(int block = first / 4; block < (first + count + 3) / 4; block++)
+    {
+        double t[4], u[4], v[4]; 
+        int mask = mesh.intersect_block(block,tr,t,u,v); 
+        for(int lane = 0; mask != 0; lane++, mask >>= 1)
+        {
+            if((mask & 1) && hit(t[lane],u[lane],v[lane],mesh.blocks[block].tri[lane]))
+                return true; 
+        }
+    }
+    return false; 
+}
 
-    return leftHit || rightHit; 
+// The mesh versions test the triangles the leaves cover directly, without going through a Shape per triangle
+void bvh_intersect(const BVH* bvh, const TriangleMesh& mesh, const Ray& r, std::vector<Intersection>& xs)
+{
+    TriangleRay tr(r); 
+    traverse_all(bvh,r,-std::numeric_limits<double>::infinity(),std::numeric_limits<double>::infinity(),[&](int first, int count)
+    {
+        return mesh_leaf_hits(bvh,mesh,tr,first,count,[&](double t, double u, double v, int tri)
+        {
+            Intersection hit(t,&mesh,u,v); 
+            hit.index = tri; 
+            xs.push_back(hit); 
+            return false; 
+        }); 
+    }); 
 }
 
-void delete_bvh(BVHNode* node)
+bool bvh_intersect_closest(const BVH* bvh, const TriangleMesh& mesh, const Ray& r, Intersection& hit, double t_max)
 {
-    if(node == nullptr)
-        return; 
+    TriangleRay tr(r); 
+    return traverse_closest(bvh,r,t_max,[&](int first, int count, double& t_best)
+    {
+        bool found = false; 
+        mesh_leaf_hits(bvh,mesh,tr,first,count,[&](double t, double u, double v, int tri)
+        {
+            if(t > 0.0 && t < t_best)
+            {
+                hit = Intersection(t,&mesh,u,v); 
+                hit.index = tri; 
+                t_best = t; 
+                found = true; 
+            }
+            return false; 
+        }); 
+        return found; 
+    }); 
+}
+
+bool bvh_occluded(const BVH* bvh, const TriangleMesh& mesh, const Ray& r, double max_distance)
+{
+    TriangleRay tr(r); 
+    return traverse_all(bvh,r,0.0,max_distance,[&](int first, int count)
+    {
+        return mesh_leaf_hits(bvh,mesh,tr,first,count,[&](double t, double, double, int)
+        {
+            return t > 0.0 && t < max_distance; 
+        }); 
+    }); 
+}
 
-    delete_bvh(node->left); 
-    delete_bvh(node->right); 
+// The particle set versions test the particles of the leaves directly, the set keeps them in leaf order
+// so leaf primitive i is particle i, see ParticleSet::refresh_bvh
+void bvh_intersect(const BVH* bvh, const ParticleSet& set, const Ray& r, std::vector<Intersection>& xs)
+{
+    traverse_all(bvh,r,-std::numeric_limits<double>::infinity(),std::numeric_limits<double>::infinity(),[&](int first, int count)
+    {
+        for(int particle = first; particle < first + count; particle++)
+        {
+            double ts[2]; 
+            int hits = set.intersect_particle(particle,r,ts); 
+            for(int k = 0; k < hits; k++)
+            {
+                Intersection hit(ts[k],&set); 
+                hit.index = particle; 
+                xs.push_back(hit); 
+            }
+        }
+        return false; 
+    }); 
+}
 
-    //std::cout << "Deleting node: " << node << "\n";
-    delete node; 
-    node=nullptr; 
+bool bvh_intersect_closest(const BVH* bvh, const ParticleSet& set, const Ray& r, Intersection& hit, double t_max)
+{
+    return traverse_closest(bvh,r,t_max,[&](int first, int count, double& t_best)
+    {
+        bool found = false; 
+        for(int particle = first; particle < first + count; particle++)
+        {
+            double ts[2]; 
+            int hits = set.intersect_particle(particle,r,ts); 
+            for(int k = 0; k < hits; k++)
+            {
+                if(ts[k] > 0.0 && ts[k] < t_best)
+                {
+                    hit = Intersection(ts[k],&set); 
+                    hit.index = particle; 
+                    t_best = ts[k]; 
+                    found = true; 
+                    break; 
+                }
+            }
+        }
+        return found; 
+    }); 
 }
 
-void print_bvh_stats(BVHNode* node, int depth)
+bool bvh_occluded(const BVH* bvh, const ParticleSet& set, const Ray& r, double max_distance)
 {
+    return traverse_all(bvh,r,0.0,max_distance,[&](int first, int count)
     {
-    if (!node) return;
+        for(int particle = first; particle < first + count; particle++)
+        {
+            double ts[2]; 
+            int hits = set.intersect_particle(particle,r,ts); 
+            for(int k = 0; k < hits; k++)
+            {
+                if(ts[k] > 0.0 && ts[k] < max_distance)
+                    return true; 
+            }
+        }
+        return false; 
+    }); 
+}
+
+void compact_bvh(BVH* bvh, bool keep_indices)
+{
+    std::vector<BVHNode>().swap(bvh->nodes); 
+    if(!keep_indices)
+        std::vector<int>().swap(bvh->indices); 
+}
+
+void delete_bvh(BVH* bvh)
+{
+    delete bvh; 
+}
 
+void print_bvh_stats(const BVH* bvh, int node, int depth)
+{
+    if (bvh->nodes.empty()) return;
+
+    const BVHNode& n = bvh->nodes[node]; 
     std::string indent(depth * 2, ' ');
-    std::cout << indent << (node->isLeaf ? "Leaf" : "Internal")
-              << " | Address: "<< node
+    std::cout << indent << (n.isLeaf() ? "Leaf" : "Internal")
+              << " | Index: "<< node
               << " | Depth: " << depth
-              << " | Primitives: " << (node->isLeaf ? node->primitives.size() : 0)
+              << " | Primitives: " << n.count
               << std::endl;
 
-    if (!node->isLeaf) {
-        print_bvh_stats(node->left, depth + 1);
-        print_bvh_stats(node->right, depth + 1);
+    if (!n.isLeaf()) {
+        print_bvh_stats(bvh, node + 1, depth + 1);
+        print_bvh_stats(bvh, n.offset, depth + 1);
     }
 }
-}
 
-//Needs thought
-void flatten(const std::vector<Shape*>& in_list,std::vector<Shape*>& out_list)
+// Collects the leaf shapes below the shapes in in_list, groups themselves are not added
+static void collect_leaves(const std::vector<Shape*>& in_list,std::vector<Shape*>& out_list)
 {
     for(Shape* s: in_list)
     {
         if(s->isGroup)
         {
             Group* _s = static_cast<Group*>(s); 
-            flatten(_s->children,out_list); 
+            collect_leaves(_s->children,out_list); 
+            continue; 
         }
         out_list.push_back(s);   
     }
 }
 
+// This function flattens a hierarchy of shapes into a list of leaves
+// The group transforms are baked into the leaves first, which leaves every group with an identity transform.
+// The groups still own their children, so out_list must not be used to delete the shapes
+void flatten(const std::vector<Shape*>& in_list,std::vector<Shape*>& out_list)
+{
+    for(Shape* s: in_list)
+    {
+        s->bake_transform(Matrix4()); 
+    }
+
+    collect_leaves(in_list,out_list); 
+}
+
@@ -20,7 +20,7 @@ Ray Camera::ray_for_pixel(double px, double py) const
     double world_y = this->half_height - yoffset; 
 
     //Using the camera's transform to convert the pixel coordinates into a ray
-    Matrix inv_trans = this->transform.inverse(); 
+    Matrix4 inv_trans = this->transform.inverse(); 
     Point pixel = inv_trans * Point(world_x,world_y,-1); 
     Point origin = inv_trans * Point(0,0,0); 
     Vector direction = (pixel - origin); 
@@ -38,6 +38,9 @@ Canvas render(const Camera& c, World& w)
 
     int total_pixel_count = c.hsize * c.vsize; 
 
+    //Build the BVH here, every thread would otherwise find it out of date at once
+    w.update_bvh(); 
+
     // Parallelized the rendering process using OpenMP
     // This will speed up the rendering by processing multiple pixels simultaneously
     #pragma omp parallel for default(none)
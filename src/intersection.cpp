@@ -4,6 +4,7 @@
 #include "tools.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 
 void Intersection::printIntersection()
@@ -16,6 +17,15 @@ std::vector<Intersection> intersections(std::initializer_list<Intersection> item
     return std::vector<Intersection>(items);
 }
 
+// How far over_point and under_point are moved off the surface
+// BUMP_EPSILON for scenes at unit scale or larger, shrinking with the coordinates of scenes modeled smaller so it does not
+// jump over their details, plus a share of the coordinates that grows with them where round off grows.
+static double bump_distance(const Point& point, const Ray& r)
+{
+    double scale = std::max({std::abs(point.x),std::abs(point.y),std::abs(point.z),std::abs(r.origin.x),std::abs(r.origin.y),std::abs(r.origin.z)}); 
+    return BUMP_EPSILON * std::min(scale,1.0) + BUMP_RELATIVE * scale; 
+}
+
 bool operator==(Intersection const& obj1,Intersection const& obj2)
 {
     if((obj1.s == obj2.s) && (obj1.t == obj2.t))
@@ -50,28 +60,38 @@ const Intersection* find_hit(const std::vector<Intersection>& list)
 
 Computations::Computations(const Intersection& I, const Ray& r, const std::vector<Intersection>& xs)
 {
-    std::vector<const Shape*> container; 
-    for(Intersection x :xs)
+    //Reused by every computation on this thread so shading a hit does not allocate
+    static thread_local std::vector<const Shape*> container; 
+    static thread_local std::vector<const Material*> container_mats; // The material each shape in container was entered through
+    container.clear(); 
+    container_mats.clear(); 
+    for(const Intersection& x :xs)
     {
         if(x == I)
         {
             if(container.empty())
                 this->n1 = 1.0; 
             else 
-                this->n1 = container.back()->mat.refractive_index; 
+                this->n1 = container_mats.back()->refractive_index; 
         }
         int check = scan_container(container, x.s); 
         if(check == -1)
+        {
             container.push_back(x.s); 
+            container_mats.push_back(&x.s->material_at(x)); 
+        }
         else 
+        {
             container.erase(container.begin() + check); 
+            container_mats.erase(container_mats.begin() + check); 
+        }
 
         if(x == I)
         {
             if(container.empty())
                 this->n2 = 1.0; 
             else 
-                this->n2 = container.back()->mat.refractive_index; 
+                this->n2 = container_mats.back()->refractive_index; 
 
             break;
         }
@@ -79,6 +99,7 @@ Computations::Computations(const Intersection& I, const Ray& r, const std::vecto
 
     this->t = I.t; 
     this->s = I.s; 
+    this->mat = &I.s->material_at(I); 
 
     //precompute some useful values 
     this->point = r.position(this->t); 
@@ -96,8 +117,9 @@ Computations::Computations(const Intersection& I, const Ray& r, const std::vecto
     }
 
     //Make sure to do this after checking whether the normal vector needs to be negated. 
-    this->over_point = this->point + this->normalv * BUMP_EPSILON; 
-    this->under_point = this->point + (-1* this->normalv * BUMP_EPSILON); 
+    double bump = bump_distance(this->point,r); 
+    this->over_point = this->point + this->normalv * bump; 
+    this->under_point = this->point + (-1* this->normalv * bump); 
 
     this->reflectv = r.direction.reflect_vector(this->normalv); 
 }
@@ -106,6 +128,7 @@ Computations::Computations(const Intersection& I, const Ray& r)
 {
     std::vector<Intersection> xs = {I}; 
     std::vector<const Shape*> container; 
+    std::vector<const Material*> container_mats; 
     for(Intersection x :xs)
     {
         if(x == I)
@@ -113,20 +136,26 @@ Computations::Computations(const Intersection& I, const Ray& r)
             if(container.empty())
                 this->n1 = 1.0; 
             else 
-                this->n1 = container.back()->mat.refractive_index; 
+                this->n1 = container_mats.back()->refractive_index; 
         }
         int check = scan_container(container, x.s); 
         if(check == -1)
+        {
             container.push_back(x.s); 
+            container_mats.push_back(&x.s->material_at(x)); 
+        }
         else 
+        {
             container.erase(container.begin() + check); 
+            container_mats.erase(container_mats.begin() + check); 
+        }
 
         if(x == I)
         {
             if(container.empty())
                 this->n2 = 1.0; 
             else 
-                this->n2 = container.back()->mat.refractive_index; 
+                this->n2 = container_mats.back()->refractive_index; 
 
             break;
         }
@@ -134,6 +163,7 @@ Computations::Computations(const Intersection& I, const Ray& r)
 
     this->t = I.t; 
     this->s = I.s; 
+    this->mat = &I.s->material_at(I); 
 
     //precompute some useful values 
     this->point = r.position(this->t); 
@@ -151,8 +181,9 @@ Computations::Computations(const Intersection& I, const Ray& r)
     }
 
     //Make sure to do this after checking whether the normal vector needs to be negated. 
-    this->over_point = this->point + this->normalv * EPSILON; 
-    this->under_point = this->point + (-1* this->normalv * EPSILON); 
+    double bump = bump_distance(this->point,r); 
+    this->over_point = this->point + this->normalv * bump; 
+    this->under_point = this->point + (-1* this->normalv * bump); 
 
     this->reflectv = r.direction.reflect_vector(this->normalv); 
 }
@@ -3,6 +3,8 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 Matrix::Matrix(int rows, int cols)
 {
@@ -164,11 +166,23 @@ double Matrix::cofactor(int rowToRemove,int colToRemove) const
 
 Matrix Matrix::inverse() const
 {
-    if(this->determinant() == 0)
+    //4x4 matrices take the closed form path instead of cofactor expansion
+    if(this->rows == 4 && this->cols == 4)
+    {
+        Matrix4 m4; 
+        std::copy(this->data.begin(),this->data.end(),m4.data.begin()); 
+
+        Matrix4 inv4 = m4.inverse(); 
+        Matrix inv_m = Matrix(this->rows,this->cols); 
+        std::copy(inv4.data.begin(),inv4.data.end(),inv_m.data.begin()); 
+        return inv_m; 
+    }
+
+    double det = this->determinant(); 
+    if(det == 0)
         throw std::invalid_argument("Matrix has determinant 0, it is not invertible!"); 
 
     Matrix inv_m = Matrix(this->rows,this->cols); 
-    double det = this->determinant(); 
 
     for(int i = 0; i < this->rows;i++)
     {
@@ -260,5 +274,217 @@ bool operator==(Matrix const& obj1,Matrix const& obj2)
     return true; 
 }
 
+// Determinant of the 3x3 matrix left after removing one row and one column of a Matrix4
+// The remaining indices are gathered on the stack, no sub matrix is allocated
+static double minor3(const std::array<double,16>& m, int rowToRemove, int colToRemove)
+{
+    int r[3]; 
+    int c[3]; 
+    for(int i = 0, ri = 0, ci = 0; i < 4; i++)
+    {
+        if(i != rowToRemove)
+            r[ri++] = i; 
+        if(i != colToRemove)
+            c[ci++] = i; 
+    }
+
+    auto at = [&](int i, int j) {return m[r[i] * 4 + c[j]];}; 
+
+    return at(0,0) * (at(1,1) * at(2,2) - at(1,2) * at(2,1))
+         - at(0,1) * (at(1,0) * at(2,2) - at(1,2) * at(2,0))
+         + at(0,2) * (at(1,0) * at(2,1) - at(1,1) * at(2,0)); 
+}
+
+double Matrix4::cofactor(int rowToRemove,int colToRemove) const
+{
+    if((rowToRemove + colToRemove) % 2 != 0)
+        return -1 * minor3(this->data,rowToRemove,colToRemove); 
+
+    return minor3(this->data,rowToRemove,colToRemove);
+}
+
+// Closed form determinant built from the 2x2 sub determinants of the top and bottom row pairs
+double Matrix4::determinant() const
+{
+    const std::array<double,16>& m = this->data; 
+
+    double s0 = m[0] * m[5] - m[4] * m[1]; 
+    double s1 = m[0] * m[6] - m[4] * m[2]; 
+    double s2 = m[0] * m[7] - m[4] * m[3]; 
+    double s3 = m[1] * m[6] - m[5] * m[2]; 
+    double s4 = m[1] * m[7] - m[5] * m[3]; 
+    double s5 = m[2] * m[7] - m[6] * m[3]; 
+
+    double c5 = m[10] * m[15] - m[14] * m[11]; 
+    double c4 = m[9] * m[15] - m[13] * m[11]; 
+    double c3 = m[9] * m[14] - m[13] * m[10]; 
+    double c2 = m[8] * m[15] - m[12] * m[11]; 
+    double c1 = m[8] * m[14] - m[12] * m[10]; 
+    double c0 = m[8] * m[13] - m[12] * m[9]; 
+
+    return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0; 
+}
+
+bool Matrix4::is_affine() const
+{
+    return this->data[12] == 0 && this->data[13] == 0 && this->data[14] == 0 && this->data[15] == 1; 
+}
+
+TRANSFORM_TYPE Matrix4::classify() const
+{
+    const std::array<double,16>& m = this->data; 
+
+    if(!this->is_affine())
+        return TRANSFORM_TYPE::GENERAL; 
+
+    bool diagonal = m[1] == 0 && m[2] == 0 && m[4] == 0 && m[6] == 0 && m[8] == 0 && m[9] == 0; 
+    if(!diagonal || m[0] != m[5] || m[0] != m[10])
+        return TRANSFORM_TYPE::AFFINE; 
 
+    if(m[0] != 1)
+        return TRANSFORM_TYPE::UNIFORM_SCALE; 
 
+    if(m[3] != 0 || m[7] != 0 || m[11] != 0)
+        return TRANSFORM_TYPE::TRANSLATION; 
+
+    return TRANSFORM_TYPE::IDENTITY; 
+}
+
+// Product of the lengths of the first count rows' first count elements, the largest |determinant| rows of those lengths can have
+static double row_norm_product(const std::array<double,16>& m, int count)
+{
+    double product = 1.0; 
+    for(int i = 0; i < count; i++)
+    {
+        double sum = 0.0; 
+        for(int j = 0; j < count; j++)
+        {
+            sum += m[i * 4 + j] * m[i * 4 + j]; 
+        }
+        product *= sqrt(sum); 
+    }
+    return product; 
+}
+
+// Inverts the matrix into result using the adjugate built from 2x2 sub determinants
+// Affine matrices only need the inverse of their upper 3x3 block and a translation
+// Returns false and leaves result untouched if |determinant| <= tolerance times the product of the row lengths.
+// Measuring the determinant against the rows keeps the test independent of scale, so a scaling(1e-4,1e-4,1e-4)
+// inverts as well as the identity while rows that are nearly parallel are still rejected
+bool Matrix4::invert(Matrix4& result, double tolerance) const
+{
+    const std::array<double,16>& m = this->data; 
+
+    if(this->is_affine())
+    {
+        double c00 = m[5] * m[10] - m[6] * m[9]; 
+        double c01 = m[6] * m[8] - m[4] * m[10]; 
+        double c02 = m[4] * m[9] - m[5] * m[8]; 
+
+        double det = m[0] * c00 + m[1] * c01 + m[2] * c02; 
+        if(!(std::abs(det) > tolerance * row_norm_product(m,3)))
+            return false; 
+
+        double inv_det = 1.0 / det; 
+        std::array<double,16> r; 
+
+        r[0] = c00 * inv_det; 
+        r[1] = (m[2] * m[9] - m[1] * m[10]) * inv_det; 
+        r[2] = (m[1] * m[6] - m[2] * m[5]) * inv_det; 
+        r[4] = c01 * inv_det; 
+        r[5] = (m[0] * m[10] - m[2] * m[8]) * inv_det; 
+        r[6] = (m[2] * m[4] - m[0] * m[6]) * inv_det; 
+        r[8] = c02 * inv_det; 
+        r[9] = (m[1] * m[8] - m[0] * m[9]) * inv_det; 
+        r[10] = (m[0] * m[5] - m[1] * m[4]) * inv_det; 
+
+        //The inverse translation is the inverse linear part applied to the negated translation
+        r[3] = -(r[0] * m[3] + r[1] * m[7] + r[2] * m[11]); 
+        r[7] = -(r[4] * m[3] + r[5] * m[7] + r[6] * m[11]); 
+        r[11] = -(r[8] * m[3] + r[9] * m[7] + r[10] * m[11]); 
+
+        r[12] = 0; 
+        r[13] = 0; 
+        r[14] = 0; 
+        r[15] = 1; 
+
+        result.data = r; 
+        return true; 
+    }
+
+    double s0 = m[0] * m[5] - m[4] * m[1]; 
+    double s1 = m[0] * m[6] - m[4] * m[2]; 
+    double s2 = m[0] * m[7] - m[4] * m[3]; 
+    double s3 = m[1] * m[6] - m[5] * m[2]; 
+    double s4 = m[1] * m[7] - m[5] * m[3]; 
+    double s5 = m[2] * m[7] - m[6] * m[3]; 
+
+    double c5 = m[10] * m[15] - m[14] * m[11]; 
+    double c4 = m[9] * m[15] - m[13] * m[11]; 
+    double c3 = m[9] * m[14] - m[13] * m[10]; 
+    double c2 = m[8] * m[15] - m[12] * m[11]; 
+    double c1 = m[8] * m[14] - m[12] * m[10]; 
+    double c0 = m[8] * m[13] - m[12] * m[9]; 
+
+    double det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0; 
+    if(!(std::abs(det) > tolerance * row_norm_product(m,4)))
+        return false; 
+
+    double inv_det = 1.0 / det; 
+    std::array<double,16> r; 
+
+    r[0] = (m[5] * c5 - m[6] * c4 + m[7] * c3) * inv_det; 
+    r[1] = (-m[1] * c5 + m[2] * c4 - m[3] * c3) * inv_det; 
+    r[2] = (m[13] * s5 - m[14] * s4 + m[15] * s3) * inv_det; 
+    r[3] = (-m[9] * s5 + m[10] * s4 - m[11] * s3) * inv_det; 
+
+    r[4] = (-m[4] * c5 + m[6] * c2 - m[7] * c1) * inv_det; 
+    r[5] = (m[0] * c5 - m[2] * c2 + m[3] * c1) * inv_det; 
+    r[6] = (-m[12] * s5 + m[14] * s2 - m[15] * s1) * inv_det; 
+    r[7] = (m[8] * s5 - m[10] * s2 + m[11] * s1) * inv_det; 
+
+    r[8] = (m[4] * c4 - m[5] * c2 + m[7] * c0) * inv_det; 
+    r[9] = (-m[0] * c4 + m[1] * c2 - m[3] * c0) * inv_det; 
+    r[10] = (m[12] * s4 - m[13] * s2 + m[15] * s0) * inv_det; 
+    r[11] = (-m[8] * s4 + m[9] * s2 - m[11] * s0) * inv_det; 
+
+    r[12] = (-m[4] * c3 + m[5] * c1 - m[6] * c0) * inv_det; 
+    r[13] = (m[0] * c3 - m[1] * c1 + m[2] * c0) * inv_det; 
+    r[14] = (-m[12] * s3 + m[13] * s1 - m[14] * s0) * inv_det; 
+    r[15] = (m[8] * s3 - m[9] * s1 + m[10] * s0) * inv_det; 
+
+    result.data = r; 
+    return true; 
+}
+
+Matrix4 Matrix4::inverse() const
+{
+    Matrix4 inv_m; 
+    if(!this->invert(inv_m))
+        throw std::invalid_argument("Matrix is singular, it is not invertible!"); 
+
+    return inv_m; 
+}
+
+void Matrix4::printMatrix() const
+{
+    for(int i = 0; i < 4; i++)
+    {
+        for(int j = 0; j < 4; j++)
+        {
+            std::cout<<this->data[i * 4 + j] << " "; 
+        }
+        std::cout<<std::endl; 
+    }
+}
+
+bool operator==(Matrix4 const& obj1,Matrix4 const& obj2)
+{
+    for(int i = 0; i < 16; i++)
+    {
+        if(!equal_double(obj1.data[i],obj2.data[i]))
+            return false; 
+    }
+
+    return true; 
+}
@@ -21,6 +21,22 @@ Parser::~Parser()
 }
 
 void Parser::read_file(const char& delimiter)
+{
+    this->parse(delimiter,nullptr); 
+}
+
+// The vertices and normals go straight into the mesh and the faces become indices into them,
+// so no Triangle is ever created and the parser keeps no copy of the vertices
+TriangleMesh* Parser::read_mesh(const char& delimiter)
+{
+    TriangleMesh* mesh = new TriangleMesh(); 
+    this->parse(delimiter,mesh); 
+    mesh->refresh_bvh(); 
+
+    return mesh; 
+}
+
+void Parser::parse(const char& delimiter, TriangleMesh* mesh)
 {
     std::stringstream ss; 
     std::ifstream file(this->file_name); 
@@ -31,24 +47,30 @@ void Parser::read_file(const char& delimiter)
     Point vertex; 
     Vector normal; 
 
+    std::vector<int> vertex_ids; 
+    std::vector<int> normal_ids; 
+
     while(std::getline(file,line))
     {
-        //Get the prefix of the line
+        //Get the prefix of the line, blank lines have none
         ss.clear(); 
         ss.str(line); 
+        prefix = ""; 
         ss >> prefix; 
 
         if(prefix == "v")
         {
             ss >> vertex.x >> vertex.y >> vertex.z; 
-            vertices.push_back(vertex); 
+            if(mesh != nullptr)
+                mesh->add_vertex(vertex); 
+            else 
+                vertices.push_back(vertex); 
         }
 
         if(prefix == "f")
         {
-            int counter = 0;  
-            std::vector<Point> poly_vertices; 
-            std::vector<Vector> normal_vertices; 
+            vertex_ids.clear(); 
+            normal_ids.clear(); 
             std::string vertex_string = "";
 
             while(ss >> vertex_string)
@@ -60,18 +82,41 @@ void Parser::read_file(const char& delimiter)
                 std::getline(vss, vt_idx_str, delimiter);     // texture index (may be empty)
                 std::getline(vss, vn_idx_str, delimiter);     // normal index (may be empty)
 
-                int v_idx = std::stoi(v_idx_str);
-                poly_vertices.push_back(vertices[v_idx - 1]); // 1-based indexing
+                vertex_ids.push_back(std::stoi(v_idx_str) - 1); // 1-based indexing
 
                 if(vn_idx_str != "")
                 {
-                    int vn_idx = std::stoi(vn_idx_str); 
-                    normal_vertices.push_back(normals[vn_idx -1]); 
+                    normal_ids.push_back(std::stoi(vn_idx_str) - 1); 
+                }
+            }
+
+            bool smooth = (normal_ids.size() == vertex_ids.size()) && (vertex_ids.size() != 0); 
+            if(mesh != nullptr)
+            {
+                //Same fan as fan_triangulation, over indices
+                for(int i = 1; i + 1 < (int)vertex_ids.size(); i++)
+                {
+                    if(smooth)
+                        mesh->add_triangle(vertex_ids[0],vertex_ids[i],vertex_ids[i+1],normal_ids[0],normal_ids[i],normal_ids[i+1]); 
+                    else 
+                        mesh->add_triangle(vertex_ids[0],vertex_ids[i],vertex_ids[i+1]); 
                 }
+                continue; 
+            }
+
+            std::vector<Point> poly_vertices; 
+            for(int id: vertex_ids)
+            {
+                poly_vertices.push_back(vertices[id]); 
             }
             
-            if((normal_vertices.size() == poly_vertices.size()) && (poly_vertices.size() != 0))
+            if(smooth)
             {
+                std::vector<Vector> normal_vertices; 
+                for(int id: normal_ids)
+                {
+                    normal_vertices.push_back(normals[id]); 
+                }
 
                 std::vector<SmoothTriangle*> triangles = this->fan_triangulation_smooth(poly_vertices,normal_vertices); 
                 for(SmoothTriangle* tri: triangles)
@@ -91,7 +136,10 @@ void Parser::read_file(const char& delimiter)
         if(prefix == "vn")
         {
             ss >> normal.x >> normal.y >> normal.z; 
-            normals.push_back(normal); 
+            if(mesh != nullptr)
+                mesh->add_normal(normal); 
+            else 
+                normals.push_back(normal); 
         }
     }
 
@@ -4,10 +4,16 @@
 #include <algorithm> 
 #include <iostream> 
 
+void Pattern::setTransform(const Matrix4& m)
+{
+    this->transform = m; 
+    this->inverse_transform = m.inverse(); 
+}
+
 Color Pattern::color_at_object(const Shape* object, const Point& world_point) const
 {
     Point object_point = world_to_object(object,world_point); 
-    Point pattern_point = this->transform.inverse() * object_point; 
+    Point pattern_point = this->inverse_transform * object_point; 
 
     return this->color_at(pattern_point); 
 } 
@@ -2,12 +2,19 @@
 #include "point.h"
 
 #include <iostream> 
+#include <cmath>
 
 // This class represents a ray in 3D space with an origin and a direction.
+// The reciprocal of the direction is kept for the slab tests of boxes.
 Ray::Ray(const Point& origin, const Vector& direction)
 {
     this->origin = origin; 
     this->direction = direction; 
+    this->inv_direction = Vector(1.0 / direction.x,1.0 / direction.y,1.0 / direction.z); 
+
+    this->sign[0] = std::signbit(direction.x); 
+    this->sign[1] = std::signbit(direction.y); 
+    this->sign[2] = std::signbit(direction.z); 
 }
 
 // This function calculates the position of a point along the ray at a given parameter t.
@@ -20,13 +27,16 @@ Point Ray::position(double t) const
 // This function transforms the ray using a transformation matrix.
 // It applies the transformation to both the origin and the direction of the ray.
 // The transformed ray is returned as a new Ray object.
-Ray Ray::ray_transform(const Matrix& m) const
+Ray Ray::ray_transform(const Matrix4& m) const
 {
-    Ray r(this->origin,this->direction); 
-    r.origin = m * r.origin; 
-    r.direction = m * r.direction; 
+    return Ray(m * this->origin,m * this->direction); 
+}
 
-    return r; 
+// This function transforms the ray with a matrix whose TRANSFORM_TYPE is already known,
+// skipping the parts of the product that the class of the matrix makes redundant.
+Ray Ray::ray_transform(const Matrix4& m, TRANSFORM_TYPE type) const
+{
+    return Ray(transform_point(m,type,this->origin),transform_vector(m,type,this->direction)); 
 }
 
 
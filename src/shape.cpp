@@ -1,18 +1,55 @@
 #include "shape.h"
+#include "shapes.h"
 #include "materials.h"
 #include "ray.h"
 
 #include <algorithm> 
 
-Matrix Shape::getTransform() const
+Matrix4 Shape::getTransform() const
 {
 
     return this->transform; 
 }
 
-void Shape::setTransform(const Matrix& m)
+// Sets the transform and refreshes the cached inverse and inverse transpose
+// so intersection and shading never have to invert a matrix per ray
+void Shape::setTransform(const Matrix4& m)
 {
     this->transform = m; 
+    this->inverse_transform = m.inverse(); 
+    this->normal_transform = this->inverse_transform; 
+    this->normal_transform.transpose(); 
+    this->transform_type = this->inverse_transform.classify(); 
+
+    this->update_world_transform(); 
+
+    //Moving a child moves the bounds of the groups above it
+    if(this->parent != nullptr)
+        static_cast<Group*>(this->parent)->invalidate_bounds(); 
+}
+
+// Composes the parent's cached world inverse with this shape's inverse so shading
+// needs a single matrix product no matter how deeply the shape is nested.
+// Groups push the update down to their children, so changing any ancestor refreshes every leaf.
+void Shape::update_world_transform()
+{
+    if(this->parent != nullptr)
+        this->world_inverse_transform = this->inverse_transform * this->parent->world_inverse_transform; 
+    else 
+        this->world_inverse_transform = this->inverse_transform; 
+
+    this->world_normal_transform = this->world_inverse_transform; 
+    this->world_normal_transform.transpose(); 
+    this->world_transform_type = this->world_inverse_transform.classify(); 
+
+    if(this->isGroup)
+    {
+        Group* g = static_cast<Group*>(this); 
+        for(Shape* child: g->children)
+        {
+            child->update_world_transform(); 
+        }
+    }
 }
 
 void Shape::setMaterial(const Material& m)
@@ -25,22 +62,146 @@ Material Shape::getMaterial() const
     return this->mat; 
 }
 
+// By default the accumulated transform simply replaces the shape's own transform
+void Shape::bake_transform(const Matrix4& m)
+{
+    this->setTransform(m * this->transform); 
+}
+
+const Material& Shape::material_at(const Intersection&) const
+{
+    return this->mat; 
+}
+
 // This function transforms the ray into the local space of the shape
-// and then calls the local_intersect method to find intersections.
+// and then calls the local_intersect_into method to find intersections.
 // It returns a vector of intersections that occur in the local space.
 std::vector<Intersection> Shape::intersect(const Ray& r) const
 {
-    Ray local_ray = r.ray_transform(this->transform.inverse()); 
-    return this->local_intersect(local_ray); 
+    std::vector<Intersection> xs; 
+    this->intersect_into(r,xs); 
+    return xs; 
+}
+
+void Shape::intersect_into(const Ray& r, std::vector<Intersection>& xs) const
+{
+    if(this->transform_type == TRANSFORM_TYPE::IDENTITY)
+    {
+        this->local_intersect_into(r,xs); 
+        return; 
+    }
+
+    Ray local_ray = r.ray_transform(this->inverse_transform,this->transform_type); 
+    this->local_intersect_into(local_ray,xs); 
+}
+
+std::vector<Intersection> Shape::local_intersect(const Ray& r) const
+{
+    std::vector<Intersection> xs; 
+    this->local_intersect_into(r,xs); 
+    return xs; 
+}
+
+// Scratch space for the default closest and any hit queries, each thread keeps its own and reuses it for every ray
+// Queries append past whatever is already there and remove only their own part, so they may nest
+static std::vector<Intersection>& query_scratch()
+{
+    static thread_local std::vector<Intersection> scratch; 
+    return scratch; 
+}
+
+// This function finds the nearest intersection in front of the ray that is closer than t_max
+// The ray is transformed without renormalizing its direction, so t is the same in both spaces
+bool Shape::intersect_closest(const Ray& r, Intersection& hit, double t_max) const
+{
+    if(this->transform_type == TRANSFORM_TYPE::IDENTITY)
+        return this->local_intersect_closest(r,hit,t_max); 
+
+    Ray local_ray = r.ray_transform(this->inverse_transform,this->transform_type); 
+    return this->local_intersect_closest(local_ray,hit,t_max); 
+}
+
+// Shapes that hold only a few intersections just pick the nearest one from local_intersect_into
+bool Shape::local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const
+{
+    std::vector<Intersection>& scratch = query_scratch(); 
+    size_t start = scratch.size(); 
+    this->local_intersect_into(r,scratch); 
+
+    bool found = false; 
+    for(size_t i = start; i < scratch.size(); i++)
+    {
+        if(scratch[i].t > 0.0 && scratch[i].t < t_max)
+        {
+            hit = scratch[i]; 
+            t_max = scratch[i].t; 
+            found = true; 
+        }
+    }
+
+    scratch.erase(scratch.begin() + start,scratch.end()); 
+    return found; 
+}
+
+// This function checks whether the ray hits the shape in front of its origin and before t_max
+bool Shape::intersect_any(const Ray& r, double t_max) const
+{
+    if(this->transform_type == TRANSFORM_TYPE::IDENTITY)
+        return this->local_intersect_any(r,t_max); 
+
+    Ray local_ray = r.ray_transform(this->inverse_transform,this->transform_type); 
+    return this->local_intersect_any(local_ray,t_max); 
+}
+
+bool Shape::local_intersect_any(const Ray& r, double t_max) const
+{
+    std::vector<Intersection>& scratch = query_scratch(); 
+    size_t start = scratch.size(); 
+    this->local_intersect_into(r,scratch); 
+
+    bool found = false; 
+    for(size_t i = start; i < scratch.size() && !found; i++)
+    {
+        found = scratch[i].t > 0.0 && scratch[i].t < t_max; 
+    }
+
+    scratch.erase(scratch.begin() + start,scratch.end()); 
+    return found; 
 }
 
 // This function transforms the world point into the local space of the shape
 // and then calls the local_normal_at method to find the normal vector.
 // It returns the normal vector in world coordinates.
+// Shapes with a shape_type have their own local_normal_at called directly instead of through the vtable
 Vector Shape::normal_at(const Point& world_point,const Intersection& hit) const
 {
     Point local_point = world_to_object(this,world_point); 
-    Vector local_normal = local_normal_at(local_point,hit); 
+    Vector local_normal; 
+    switch(this->shape_type)
+    {
+    case SHAPE_TYPE::SPHERE:
+        local_normal = static_cast<const Sphere*>(this)->Sphere::local_normal_at(local_point,hit); 
+        break; 
+
+    case SHAPE_TYPE::CUBE:
+        local_normal = static_cast<const Cube*>(this)->Cube::local_normal_at(local_point,hit); 
+        break; 
+
+    case SHAPE_TYPE::CYLINDER:
+        local_normal = static_cast<const Cylinder*>(this)->Cylinder::local_normal_at(local_point,hit); 
+        break; 
+
+    case SHAPE_TYPE::TRIANGLE:
+        local_normal = static_cast<const Triangle*>(this)->normal; 
+        break; 
+
+    case SHAPE_TYPE::SMOOTH_TRIANGLE:
+        local_normal = static_cast<const SmoothTriangle*>(this)->SmoothTriangle::local_normal_at(local_point,hit); 
+        break; 
+
+    default:
+        local_normal = local_normal_at(local_point,hit); 
+    }
     return normal_to_world(this,local_normal);
 }
 
@@ -57,120 +218,104 @@ int scan_container(const std::vector<const Shape*>& container,const Shape* desir
 }
 
 // This function transforms the AABB using the provided transformation matrix.
-// It calculates the new minimum and maximum points of the AABB after transformation.
-AABB AABB::transform(const Matrix& mat)
-{
-    std::vector<Point> vertices = {
-        Point(this->minimum.x,this->minimum.y,this->minimum.z),
-        Point(this->maximum.x,this->minimum.y,this->minimum.z),
-        Point(this->minimum.x,this->maximum.y,this->minimum.z),
-        Point(this->minimum.x,this->minimum.y,this->maximum.z),
-        Point(this->maximum.x,this->maximum.y,this->minimum.z),
-        Point(this->minimum.x,this->maximum.y,this->maximum.z),
-        Point(this->maximum.x,this->minimum.y,this->maximum.z),
-        Point(this->maximum.x,this->maximum.y,this->maximum.z)
-    }; 
-
-    for(Point& v: vertices)
-    {
-        v = mat * v; 
-    }
+// Each output axis starts at the translation and adds the smaller and larger of the matrix entry times the input
+// minimum and maximum, which gives the box around all 8 transformed corners without building them. Zero entries are
+// skipped so that infinite bounds (planes) stay infinite instead of turning into NaN, and empty boxes stay empty
+AABB AABB::transform(const Matrix4& mat) const
+{
+    if(this->minimum.x > this->maximum.x || this->minimum.y > this->maximum.y || this->minimum.z > this->maximum.z)
+        return *this; 
 
-    Point minPoint = vertices[0]; 
-    Point maxPoint = vertices[1]; 
+    double lo[3] = {this->minimum.x,this->minimum.y,this->minimum.z}; 
+    double hi[3] = {this->maximum.x,this->maximum.y,this->maximum.z}; 
+    double out_lo[3]; 
+    double out_hi[3]; 
 
-    for(Point& v: vertices)
+    for(int i = 0; i < 3; i++)
     {
-        minPoint.x = std::min(v.x,minPoint.x); 
-        minPoint.y = std::min(v.y,minPoint.y); 
-        minPoint.z = std::min(v.z,minPoint.z); 
-
-        maxPoint.x = std::max(v.x,maxPoint.x); 
-        maxPoint.y = std::max(v.y,maxPoint.y); 
-        maxPoint.z = std::max(v.z,maxPoint.z); 
+        out_lo[i] = mat.getElement(i,3); 
+        out_hi[i] = mat.getElement(i,3); 
+        for(int j = 0; j < 3; j++)
+        {
+            double m = mat.getElement(i,j); 
+            if(m == 0)
+                continue; 
+
+            double a = m * lo[j]; 
+            double b = m * hi[j]; 
+            out_lo[i] += std::min(a,b); 
+            out_hi[i] += std::max(a,b); 
+        }
     }
 
-    return AABB(minPoint,maxPoint); 
+    return AABB(Point(out_lo[0],out_lo[1],out_lo[2]),Point(out_hi[0],out_hi[1],out_hi[2])); 
 }
 
-// This function checks if a ray intersects with the AABB.
-// It calculates the intersection along each axis, if the direction is zero it returns -infinity and +infinity.
-std::array<double,2> AABB::check_axis(double origin, double direction,AXIS ax) const
+// Bounds of the shape in the space of its parent
+AABB Shape::parent_bounds() const
 {
-    double tmin,tmax,tmin_numerator,tmax_numerator; 
-
-    switch (ax)
-    {
-    case AXIS::X_AXIS:
-        tmin_numerator = (minimum.x- origin); 
-        tmax_numerator = (maximum.x - origin); 
-
-        tmin = tmin_numerator / direction; 
-        tmax = tmax_numerator / direction; 
-        break;
-    
-    case AXIS::Y_AXIS:
-        tmin_numerator = (minimum.y - origin); 
-        tmax_numerator = (maximum.y - origin); 
-
-        tmin = tmin_numerator / direction; 
-        tmax = tmax_numerator / direction; 
-        break;
-
-    case AXIS::Z_AXIS:
-        tmin_numerator = (minimum.z- origin); 
-        tmax_numerator = (maximum.z - origin); 
-
-        tmin = tmin_numerator / direction; 
-        tmax = tmax_numerator / direction; 
-        break;
-
-    }
+    if(this->transform_type == TRANSFORM_TYPE::IDENTITY)
+        return this->bounds(); 
 
-    if(tmin > tmax)
-    {
-        std::swap(tmin,tmax); 
-    }
-    std::array<double,2> arr = {tmin,tmax}; 
-    return arr;
+    return this->bounds().transform(this->transform); 
 }
 
 // This function checks if a ray intersects with the AABB.
-// It calculates the intersection along each axis and checks if the intervals overlap.
+// Each axis clips the interval of the ray with the precomputed reciprocal direction, the box is hit if anything is left.
 bool AABB::check_intersect(const Ray& r) const
 {
-    auto [xtmin,xtmax] = check_axis(r.origin.x,r.direction.x,AXIS::X_AXIS); 
-    auto [ytmin,ytmax] = check_axis(r.origin.y,r.direction.y,AXIS::Y_AXIS); 
-    auto [ztmin,ztmax] = check_axis(r.origin.z,r.direction.z,AXIS::Z_AXIS); 
+    double tmin = -std::numeric_limits<double>::infinity(); 
+    double tmax = std::numeric_limits<double>::infinity(); 
+    clip_slab(this->minimum.x,this->maximum.x,r.origin.x,r.inv_direction.x,r.sign[0],tmin,tmax); 
+    clip_slab(this->minimum.y,this->maximum.y,r.origin.y,r.inv_direction.y,r.sign[1],tmin,tmax); 
+    clip_slab(this->minimum.z,this->maximum.z,r.origin.z,r.inv_direction.z,r.sign[2],tmin,tmax); 
 
-    double tmin = std::max(std::max(xtmin,ytmin),ztmin); 
-    double tmax = std::min(std::min(xtmax,ytmax),ztmax); 
+    return tmin <= tmax; 
+}
 
-    if(tmin > tmax)
-        return false;
+// This function computes the surface area of the AABB
+// An empty box (minimum above maximum) has no area
+double AABB::surface_area() const
+{
+    Vector extent = this->maximum - this->minimum; 
+    if(extent.x < 0 || extent.y < 0 || extent.z < 0)
+        return 0; 
 
-    return true; 
+    return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x); 
 }
 
-Point world_to_object(const Shape* shape, Point point)
+Point AABB::centroid() const
 {
-    if(shape->parent != nullptr)
-        point = world_to_object(shape->parent,point); 
+    return Point(0.5 * (this->minimum.x + this->maximum.x),0.5 * (this->minimum.y + this->maximum.y),0.5 * (this->minimum.z + this->maximum.z)); 
+}
 
-    return shape->transform.inverse() * point; 
+Point world_to_object(const Shape* shape, Point point)
+{
+    return transform_point(shape->world_inverse_transform,shape->world_transform_type,point); 
 }
 
+// Translations and positive uniform scales do not change the direction of a normal,
+// anything else only needs the upper 3x3 block since the w component is dropped
 Vector normal_to_world(const Shape* shape,Vector normal)
 {
-    Matrix inv_t = shape->transform.inverse();
-    inv_t.transpose();
-    normal = inv_t * normal; 
+    switch(shape->world_transform_type)
+    {
+    case TRANSFORM_TYPE::IDENTITY:
+    case TRANSFORM_TYPE::TRANSLATION:
+        break; 
+
+    case TRANSFORM_TYPE::UNIFORM_SCALE:
+        if(shape->world_normal_transform.data[0] < 0)
+            normal = -normal; 
+        break; 
+
+    default:
+        normal = transform_vector(shape->world_normal_transform,TRANSFORM_TYPE::AFFINE,normal); 
+        break; 
+    }
     normal.w = 0; 
     normal = normal.normalize(); 
 
-    if(shape->parent != nullptr)
-        normal = normal_to_world(shape->parent,normal);
-
     return normal;
 }
 
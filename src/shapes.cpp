@@ -7,16 +7,28 @@
 #include <algorithm> 
 #include <iostream> 
 
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
+
 
 AABB Sphere::bounds() const
 {
     return AABB(Point(-1,-1,-1),Point(1,1,1)); 
 }
 
-std::vector<Intersection> Sphere::local_intersect(const Ray& r) const
+void Sphere::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
 {
-    std::vector<Intersection> intersection_list; 
+    double ts[2]; 
+    int count = this->local_hits(r,ts); 
+    for(int i = 0; i < count; i++)
+    {
+        xs.push_back(Intersection(ts[i],this)); 
+    }
+}
 
+int Sphere::local_hits(const Ray& r, double ts[2]) const
+{
     Vector sphere_to_ray = r.origin - Point(0.,0.,0.); 
 
     double a = r.direction * r.direction; 
@@ -26,13 +38,11 @@ std::vector<Intersection> Sphere::local_intersect(const Ray& r) const
     double discriminant = b*b - 4 * a * c; 
 
     if(discriminant < 0)
-        return intersection_list; 
-
-    intersection_list.push_back(Intersection((-b - sqrt(discriminant))/(2*a),this)); 
-    intersection_list.push_back(Intersection((-b + sqrt(discriminant))/(2*a),this));
-    
-    return intersection_list; 
+        return 0; 
 
+    ts[0] = (-b - sqrt(discriminant))/(2*a); 
+    ts[1] = (-b + sqrt(discriminant))/(2*a); 
+    return 2; 
 }
 
 Vector Sphere::local_normal_at(const Point& object_point,const Intersection& hit) const 
@@ -53,15 +63,13 @@ Vector Plane::local_normal_at(const Point& object_point,const Intersection& hit)
     return Vector(0,1,0); 
 }
 
-std::vector<Intersection> Plane::local_intersect(const Ray& r) const
+void Plane::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
 {
-    std::vector<Intersection> intersection_list; 
     if(abs(r.direction.y) < EPSILON)
-        return intersection_list; 
+        return; 
 
     double t = (-r.origin.y/r.direction.y); 
-    intersection_list.push_back(Intersection(t,this)); 
-    return intersection_list; 
+    xs.push_back(Intersection(t,this)); 
 }
 
 AABB Cube::bounds() const
@@ -80,51 +88,48 @@ Vector Cube::local_normal_at(const Point& object_point,const Intersection& hit)
     return Vector(0,0,object_point.z); 
 }
 
-std::array<double,2> Cube::check_axis(double origin, double direction) const
+void Cube::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
 {
-    double tmin_numerator = (-1 - origin); 
-    double tmax_numerator = (1 - origin); 
-
-    double tmin = tmin_numerator / direction; 
-    double tmax = tmax_numerator / direction; 
-
-    if(tmin > tmax)
+    double ts[2]; 
+    int count = this->local_hits(r,ts); 
+    for(int i = 0; i < count; i++)
     {
-        std::swap(tmin,tmax); 
+        xs.push_back(Intersection(ts[i],this)); 
     }
-    std::array<double,2> arr = {tmin,tmax}; 
-    return arr; 
 }
 
-std::vector<Intersection> Cube::local_intersect(const Ray& r) const
+int Cube::local_hits(const Ray& r, double ts[2]) const
 {
-    std::vector<Intersection> intersection_list; 
-    auto [xtmin,xtmax] = check_axis(r.origin.x,r.direction.x); 
-    auto [ytmin,ytmax] = check_axis(r.origin.y,r.direction.y); 
-    auto [ztmin,ztmax] = check_axis(r.origin.z,r.direction.z); 
-
-    double tmin = std::max(std::max(xtmin,ytmin),ztmin); 
-    double tmax = std::min(std::min(xtmax,ytmax),ztmax); 
+    //The cube is the box from -1 to 1 on every axis
+    double tmin = -std::numeric_limits<double>::infinity(); 
+    double tmax = std::numeric_limits<double>::infinity(); 
+    clip_slab(-1,1,r.origin.x,r.inv_direction.x,r.sign[0],tmin,tmax); 
+    clip_slab(-1,1,r.origin.y,r.inv_direction.y,r.sign[1],tmin,tmax); 
+    clip_slab(-1,1,r.origin.z,r.inv_direction.z,r.sign[2],tmin,tmax); 
 
     if(tmin > tmax)
-        return intersection_list; 
+        return 0; 
 
-    intersection_list.push_back(Intersection(tmin,this)); 
-    intersection_list.push_back(Intersection(tmax,this)); 
+    ts[0] = tmin; 
+    ts[1] = tmax; 
+    return 2; 
+}
 
-    return intersection_list; 
-    
+void Cylinder::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
+{
+    double ts[4]; 
+    int count = this->local_hits(r,ts); 
+    for(int i = 0; i < count; i++)
+    {
+        xs.push_back(Intersection(ts[i],this)); 
+    }
 }
 
-std::vector<Intersection> Cylinder::local_intersect(const Ray& r) const
+int Cylinder::local_hits(const Ray& r, double ts[4]) const
 {
-    std::vector<Intersection> intersection_list; 
     double a = r.direction.x*r.direction.x + r.direction.z * r.direction.z;
     if(a < EPSILON)
-    {
-        this->intersect_caps(r,intersection_list); 
-        return intersection_list; 
-    }
+        return this->cap_hits(r,ts); 
 
     double b = 2 * r.origin.x * r.direction.x + 2*r.origin.z * r.direction.z; 
     double c = r.origin.x * r.origin.x + r.origin.z * r.origin.z - 1; 
@@ -132,7 +137,7 @@ std::vector<Intersection> Cylinder::local_intersect(const Ray& r) const
     double disc = b*b - 4 * a * c; 
 
     if(disc < 0.0)
-        return intersection_list; 
+        return 0; 
 
     double t0 = (-b - sqrt(disc))/(2.0 * a); 
     double t1 = (-b + sqrt(disc))/(2.0 * a); 
@@ -140,19 +145,18 @@ std::vector<Intersection> Cylinder::local_intersect(const Ray& r) const
     if(t0 > t1)
         std::swap(t0,t1); 
 
+    int count = 0; 
     double y0 = r.origin.y + t0 * r.direction.y; 
 
     if(this->minimum < y0 && y0 < this->maximum)
-        intersection_list.push_back(Intersection(t0,this)); 
+        ts[count++] = t0; 
 
     double y1 = r.origin.y + t1 * r.direction.y; 
                   
     if(this->minimum < y1 && y1 < this->maximum)
-        intersection_list.push_back(Intersection(t1,this)); 
-
-    this->intersect_caps(r,intersection_list); 
+        ts[count++] = t1; 
 
-    return intersection_list; 
+    return count + this->cap_hits(r,ts + count); 
 }
 
 Vector Cylinder::local_normal_at(const Point& object_point,const Intersection& hit) const 
@@ -176,18 +180,31 @@ bool Cylinder::check_cap(const Ray& r, double t) const
 }
 
 void Cylinder::intersect_caps(const Ray& r, std::vector<Intersection>& xs) const
+{
+    double ts[2]; 
+    int count = this->cap_hits(r,ts); 
+    for(int i = 0; i < count; i++)
+    {
+        xs.push_back(Intersection(ts[i],this)); 
+    }
+}
+
+int Cylinder::cap_hits(const Ray& r, double ts[2]) const
 {
     //Return if the cylinder is not closed or can't be intersected by the ray
     if(this->type != CYL_TYPE::CLOSED || std::abs(r.direction.y) < EPSILON)
-        return; 
+        return 0; 
 
+    int count = 0; 
     double t = (this->minimum - r.origin.y) / r.direction.y; 
     if(check_cap(r,t))
-        xs.push_back(Intersection(t,this)); 
+        ts[count++] = t; 
 
     t = (this->maximum - r.origin.y) / r.direction.y; 
     if(check_cap(r,t))
-        xs.push_back(Intersection(t,this)); 
+        ts[count++] = t; 
+
+    return count; 
 }
 
 AABB Cylinder::bounds() const
@@ -201,37 +218,46 @@ Group::Group():Shape()
     this->refresh_bvh();  
 }
 
-std::vector<Intersection> Group::local_intersect(const Ray& r) const
+// The children's intersections are appended in order of t, anything already in xs is left where it is
+void Group::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
 {
-    std::vector<Intersection> xs = bvh_intersect(this->bvh,r); 
-    // std::vector<Intersection> xs; 
-    // for(Shape* s: this->children)
-    // {
-    //     std::vector<Intersection> temp = s->intersect(r); 
-    //     xs.insert(xs.end(),temp.begin(),temp.end()); 
-    // }
-
-    std::sort(xs.begin(),xs.end(),comp_intersection); 
+    size_t start = xs.size(); 
+    bvh_intersect(this->bvh,r,xs); 
 
-    return xs; 
+    std::sort(xs.begin() + start,xs.end(),comp_intersection); 
 } 
 
+// Only the nearest child is needed, so the BVH stops looking past the best hit found so far
+bool Group::local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const
+{
+    return bvh_intersect_closest(this->bvh,r,hit,t_max); 
+}
+
+bool Group::local_intersect_any(const Ray& r, double t_max) const
+{
+    return bvh_occluded(this->bvh,r,t_max); 
+}
+
 //methods
 Vector Group::local_normal_at(const Point& object_point,const Intersection& hit) const 
 {
     return Vector(0,0,0); 
 }
 
+// The bounds of nested groups are only gathered once, BVH builds ask every child for them
 AABB Group::bounds() const
 {
+    if(this->bounds_valid)
+        return this->cached_bounds; 
+
     AABB bbox; 
     for(Shape* child:this->children)
     {
-       AABB child_box = child->bounds();
-       child_box = child_box.transform(child->transform);
-       bbox = box_union(bbox,child_box); 
+       bbox = box_union(bbox,child->parent_bounds()); 
     }
 
+    this->cached_bounds = bbox; 
+    this->bounds_valid = true; 
     return bbox; 
 }
 
@@ -239,6 +265,16 @@ void Group::add_child(Shape* s)
 {
     s->parent = this; 
     this->children.push_back(s); 
+    s->update_world_transform(); 
+    this->invalidate_bounds(); 
+}
+
+void Group::invalidate_bounds()
+{
+    for(Group* g = this; g != nullptr; g = static_cast<Group*>(g->parent))
+    {
+        g->bounds_valid = false; 
+    }
 }
 
 Group::~Group()
@@ -250,6 +286,8 @@ Group::~Group()
             delete s; 
         }
     }
+
+    delete_bvh(this->bvh); 
 }
 
 void Group::percolate_material()
@@ -268,7 +306,7 @@ void Group::percolate_material()
 void Group::refresh_bvh()
 {
     delete_bvh(this->bvh); 
-    this->bvh = build_bvh(this->children,2); 
+    this->bvh = build_bvh(this->children,BVHBuildSettings()); 
 
     for(Shape* s: this->children)
     {
@@ -280,40 +318,173 @@ void Group::refresh_bvh()
     }
 }
 
-std::vector<Intersection> Triangle::local_intersect(const Ray& r) const 
+// Refits instead of rebuilding, which keeps the cost of moving a few children per frame linear
+// Subgroups go first since their bounds are what this group's leaves are refitted to
+void Group::refit_bvh(double rebuild_ratio)
 {
-    std::vector<Intersection> xs = std::vector<Intersection>(); 
-    Vector dir_cross_e2 = r.direction ^ this->e2; 
-    double det = this->e1 * dir_cross_e2; 
+    for(Shape* s: this->children)
+    {
+        if(s->isGroup)
+        {
+            Group* g = static_cast<Group*>(s); 
+            g->refit_bvh(rebuild_ratio); 
+        }
+    }
 
-    //Check if the ray is parallel to the triangle
-    if(abs(det)<EPSILON)
-        return xs; 
+    double ratio = ::refit_bvh(this->bvh); 
+    if(rebuild_ratio > 0 && ratio > rebuild_ratio)
+    {
+        BVHBuildSettings settings = this->bvh->settings; 
+        delete_bvh(this->bvh); 
+        this->bvh = build_bvh(this->children,settings); 
+    }
+}
+
+// Bakes the accumulated transforms of the group and all its children into the leaves
+// The group is left with an identity transform and its BVH is rebuilt around the moved children
+void Group::bake_transform(const Matrix4& m)
+{
+    Matrix4 combined = m * this->transform; 
+    for(Shape* s: this->children)
+    {
+        s->bake_transform(combined); 
+    }
 
-    //Checks if the ray misses the p1-p3 edge
-    double f = 1.0/det; 
-    Vector p1_to_origin = r.origin - this->p1; 
-    double u = f * (p1_to_origin * dir_cross_e2); 
+    this->setTransform(Matrix4()); 
+
+    delete_bvh(this->bvh); 
+    this->bvh = build_bvh(this->children,BVHBuildSettings()); 
+}
 
-    if(u < 0 || u > 1)
-        return xs;
-      
-    Vector origin_cross_e1 = p1_to_origin ^ this->e1; 
-    double v = f * (r.direction * origin_cross_e1); 
+// The ray is already in the instance's space, which is the space the prototype was built in
+void Instance::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
+{
+    size_t start = xs.size(); 
+    this->prototype->intersect_into(r,xs); 
 
-    if(v < 0 || ((u + v) > 1))
-        return xs; 
+    for(size_t i = start; i < xs.size(); i++)
+    {
+        xs[i].primitive = xs[i].s; 
+        xs[i].s = this; 
+    }
+}
 
-    double t = f * (this->e2 * origin_cross_e1); 
-    xs.push_back(Intersection(t,this,u,v)); 
+bool Instance::local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const
+{
+    if(!this->prototype->intersect_closest(r,hit,t_max))
+        return false; 
 
-    return xs; 
-    
+    hit.primitive = hit.s; 
+    hit.s = this; 
+    return true; 
+}
+
+bool Instance::local_intersect_any(const Ray& r, double t_max) const
+{
+    return this->prototype->intersect_any(r,t_max); 
+}
+
+// The primitive's cached world transforms end at the prototype, which is exactly the instance's object space
+Vector Instance::local_normal_at(const Point& object_point,const Intersection& hit) const
+{
+    return hit.primitive->normal_at(object_point,hit); 
+}
+
+AABB Instance::bounds() const
+{
+    return this->prototype_bounds; 
+}
+
+TriangleRay::TriangleRay(const Ray& r)
+{
+    const double d[3] = {r.direction.x,r.direction.y,r.direction.z}; 
+    this->origin[0] = r.origin.x; 
+    this->origin[1] = r.origin.y; 
+    this->origin[2] = r.origin.z; 
+
+    this->kz = 0; 
+    if(abs(d[1]) > abs(d[this->kz]))
+        this->kz = 1; 
+    if(abs(d[2]) > abs(d[this->kz]))
+        this->kz = 2; 
+    this->kx = (this->kz + 1) % 3; 
+    this->ky = (this->kx + 1) % 3; 
+
+    //Swapping x and y keeps the winding of the triangles when the direction points down the z axis
+    if(d[this->kz] < 0)
+        std::swap(this->kx,this->ky); 
+
+    this->sx = d[this->kx] / d[this->kz]; 
+    this->sy = d[this->ky] / d[this->kz]; 
+    this->sz = 1.0 / d[this->kz]; 
+}
+
+// The vertices are moved into the ray's space, where the ray runs down the z axis from the origin, and the
+// signs of the 2D edge functions U, V and W decide the hit. Nothing is thrown away for being small,
+// so rays grazing a triangle still hit it and no ray slips between two triangles that share an edge.
+bool intersect_triangle(const TriangleRay& r, const Point& p1, const Point& p2, const Point& p3, double& t, double& u, double& v)
+{
+    const double a[3] = {p1.x - r.origin[0],p1.y - r.origin[1],p1.z - r.origin[2]}; 
+    const double b[3] = {p2.x - r.origin[0],p2.y - r.origin[1],p2.z - r.origin[2]}; 
+    const double c[3] = {p3.x - r.origin[0],p3.y - r.origin[1],p3.z - r.origin[2]}; 
+
+    double ax = a[r.kx] - r.sx * a[r.kz]; 
+    double ay = a[r.ky] - r.sy * a[r.kz]; 
+    double bx = b[r.kx] - r.sx * b[r.kz]; 
+    double by = b[r.ky] - r.sy * b[r.kz]; 
+    double cx = c[r.kx] - r.sx * c[r.kz]; 
+    double cy = c[r.ky] - r.sy * c[r.kz]; 
+
+    double edge_u = cx * by - cy * bx; 
+    double edge_v = ax * cy - ay * cx; 
+    double edge_w = bx * ay - by * ax; 
+
+    //The ray passes outside one of the edges
+    if((edge_u < 0 || edge_v < 0 || edge_w < 0) && (edge_u > 0 || edge_v > 0 || edge_w > 0))
+        return false; 
+
+    //The ray lies in the plane of the triangle
+    double det = edge_u + edge_v + edge_w; 
+    if(det == 0)
+        return false; 
+
+    double t_scaled = edge_u * (r.sz * a[r.kz]) + edge_v * (r.sz * b[r.kz]) + edge_w * (r.sz * c[r.kz]); 
+    double inv_det = 1.0 / det; 
+    t = t_scaled * inv_det; 
+    u = edge_v * inv_det; 
+    v = edge_w * inv_det; 
+    return true; 
+}
+
+void Triangle::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
+{
+    double t, u, v; 
+    if(intersect_triangle(TriangleRay(r),this->p1,this->p2,this->p3,t,u,v))
+        xs.push_back(Intersection(t,this,u,v)); 
 }
 Vector Triangle::local_normal_at(const Point& object_point,const Intersection& hit) const 
 {
     return this->normal; 
 }
+// Moves the vertices into the space of m * transform so rays reach the triangle without being transformed
+void Triangle::bake_transform(const Matrix4& m)
+{
+    Matrix4 combined = m * this->transform; 
+    this->p1 = combined * this->p1; 
+    this->p2 = combined * this->p2; 
+    this->p3 = combined * this->p3; 
+
+    this->e1 = this->p2 - this->p1; 
+    this->e2 = this->p3 - this->p1; 
+    this->normal = (this->e2 ^ this->e1).normalize(); 
+
+    //A mirroring transform flips the winding, keep the normal on the side it was baked from
+    if(combined.determinant() < 0)
+        this->normal = -this->normal; 
+
+    this->setTransform(Matrix4()); 
+}
+
 AABB Triangle::bounds() const
 {
     double x_min = std::min(std::min(p1.x,p2.x),p3.x); 
@@ -328,40 +499,42 @@ AABB Triangle::bounds() const
     return AABB(Point(x_min,y_min,z_min),Point(x_max,y_max,z_max)); 
 }
 
-std::vector<Intersection> SmoothTriangle::local_intersect(const Ray& r) const
+void SmoothTriangle::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
 {
-    std::vector<Intersection> xs = std::vector<Intersection>(); 
-    Vector dir_cross_e2 = r.direction ^ this->e2; 
-    double det = this->e1 * dir_cross_e2; 
-
-    //Check if the ray is parallel to the triangle
-    if(abs(det)<EPSILON)
-        return xs; 
+    double t, u, v; 
+    if(intersect_triangle(TriangleRay(r),this->p1,this->p2,this->p3,t,u,v))
+        xs.push_back(Intersection(t,this,u,v)); 
+}
 
-    //Checks if the ray misses the p1-p3 edge
-    double f = 1.0/det; 
-    Vector p1_to_origin = r.origin - this->p1; 
-    double u = f * (p1_to_origin * dir_cross_e2); 
+Vector SmoothTriangle::local_normal_at(const Point& object_point,const Intersection& hit) const 
+{
+    return (this->n2 * hit.u + this->n3 * hit.v + this->n1 * (1-hit.u - hit.v)); 
+} 
+// Moves the vertices into the space of m * transform and the vertex normals with its inverse transpose
+// The normals are left unnormalized so interpolating them gives the same direction as before baking
+void SmoothTriangle::bake_transform(const Matrix4& m)
+{
+    Matrix4 combined = m * this->transform; 
+    Matrix4 normal_matrix = combined.inverse(); 
+    normal_matrix.transpose(); 
 
-    if(u < 0 || u > 1)
-        return xs;
-      
-    Vector origin_cross_e1 = p1_to_origin ^ this->e1; 
-    double v = f * (r.direction * origin_cross_e1); 
+    this->p1 = combined * this->p1; 
+    this->p2 = combined * this->p2; 
+    this->p3 = combined * this->p3; 
 
-    if(v < 0 || ((u + v) > 1))
-        return xs; 
+    this->e1 = this->p2 - this->p1; 
+    this->e2 = this->p3 - this->p1; 
 
-    double t = f * (this->e2 * origin_cross_e1); 
-    xs.push_back(Intersection(t,this,u,v)); 
+    this->n1 = normal_matrix * this->n1; 
+    this->n2 = normal_matrix * this->n2; 
+    this->n3 = normal_matrix * this->n3; 
+    this->n1.w = 0; 
+    this->n2.w = 0; 
+    this->n3.w = 0; 
 
-    return xs;  
+    this->setTransform(Matrix4()); 
 }
 
-Vector SmoothTriangle::local_normal_at(const Point& object_point,const Intersection& hit) const 
-{
-    return (this->n2 * hit.u + this->n3 * hit.v + this->n1 * (1-hit.u - hit.v)); 
-} 
 AABB SmoothTriangle::bounds() const
 {
     double x_min = std::min(std::min(p1.x,p2.x),p3.x); 
@@ -376,6 +549,457 @@ AABB SmoothTriangle::bounds() const
     return AABB(Point(x_min,y_min,z_min),Point(x_max,y_max,z_max));  
 }
 
+TriangleMesh::~TriangleMesh()
+{
+    delete_bvh(this->bvh); 
+}
+
+int TriangleMesh::add_vertex(const Point& p)
+{
+    this->vertices.push_back(p); 
+    return (int)this->vertices.size() - 1; 
+}
+
+int TriangleMesh::add_normal(const Vector& n)
+{
+    this->normals.push_back(n); 
+    return (int)this->normals.size() - 1; 
+}
+
+void TriangleMesh::add_triangle(int a, int b, int c)
+{
+    this->indices.insert(this->indices.end(),{a,b,c}); 
+    if(!this->normal_indices.empty())
+        this->normal_indices.insert(this->normal_indices.end(),{-1,-1,-1}); 
+
+    for(int i: {a,b,c})
+    {
+        this->mesh_bounds = box_union(this->mesh_bounds,AABB(this->vertices[i],this->vertices[i])); 
+    }
+}
+
+// The first smooth triangle gives the flat ones before it -1 normal indices
+void TriangleMesh::add_triangle(int a, int b, int c, int na, int nb, int nc)
+{
+    this->normal_indices.resize(this->indices.size(),-1); 
+    this->add_triangle(a,b,c); 
+
+    this->normal_indices.resize(this->indices.size() - 3); 
+    this->normal_indices.insert(this->normal_indices.end(),{na,nb,nc}); 
+}
+
+int TriangleMesh::triangle_count() const
+{
+    return (int)this->indices.size() / 3; 
+}
+
+void TriangleMesh::refresh_bvh()
+{
+    int count = this->triangle_count(); 
+    std::vector<AABB> bounds(count); 
+    for(int tri = 0; tri < count; tri++)
+    {
+        const Point& p1 = this->vertices[this->indices[3 * tri]]; 
+        const Point& p2 = this->vertices[this->indices[3 * tri + 1]]; 
+        const Point& p3 = this->vertices[this->indices[3 * tri + 2]]; 
+        bounds[tri] = AABB(Point(std::min(std::min(p1.x,p2.x),p3.x),std::min(std::min(p1.y,p2.y),p3.y),std::min(std::min(p1.z,p2.z),p3.z)),
+                           Point(std::max(std::max(p1.x,p2.x),p3.x),std::max(std::max(p1.y,p2.y),p3.y),std::max(std::max(p1.z,p2.z),p3.z))); 
+    }
+
+    BVHBuildSettings settings; 
+    std::vector<TriangleBlock>().swap(this->blocks); 
+    if(!this->pack_blocks)
+    {
+        delete_bvh(this->bvh); 
+        this->bvh = build_bvh(bounds,settings); 
+        compact_bvh(this->bvh,true); 
+        return; 
+    }
+
+    //Leaves are padded out to whole blocks, so they may hold more triangles than a leaf of shapes
+    settings.maxPrimsPerLeaf = 8; 
+    settings.intersection_cost = 0.5; 
+    settings.leaf_alignment = 4; 
+
+    delete_bvh(this->bvh); 
+    this->bvh = build_bvh(bounds,settings); 
+
+    //Pack the triangles in leaf order
+    int block_count = (int)this->bvh->indices.size() / 4; 
+    this->blocks.assign(block_count,TriangleBlock()); 
+    #pragma omp parallel for if(block_count > settings.parallel_threshold)
+    for(int b = 0; b < block_count; b++)
+    {
+        TriangleBlock& block = this->blocks[b]; 
+        for(int lane = 0; lane < 4; lane++)
+        {
+            int tri = this->bvh->indices[4 * b + lane]; 
+            block.tri[lane] = tri; 
+            Point p1(0,0,0), p2(0,0,0), p3(0,0,0); 
+            if(tri >= 0)
+            {
+                p1 = this->vertices[this->indices[3 * tri]]; 
+                p2 = this->vertices[this->indices[3 * tri + 1]]; 
+                p3 = this->vertices[this->indices[3 * tri + 2]]; 
+            }
+            const double p1_axes[3] = {p1.x,p1.y,p1.z}; 
+            const double p2_axes[3] = {p2.x,p2.y,p2.z}; 
+            const double p3_axes[3] = {p3.x,p3.y,p3.z}; 
+            for(int axis = 0; axis < 3; axis++)
+            {
+                block.p1[axis][lane] = p1_axes[axis]; 
+                block.p2[axis][lane] = p2_axes[axis]; 
+                block.p3[axis][lane] = p3_axes[axis]; 
+            }
+        }
+    }
+
+    //The blocks record their triangles, the leaves never look at the indices again
+    compact_bvh(this->bvh,false); 
+}
+
+bool TriangleMesh::intersect_triangle(int tri, const TriangleRay& r, double& t, double& u, double& v) const
+{
+    const Point& p1 = this->vertices[this->indices[3 * tri]]; 
+    const Point& p2 = this->vertices[this->indices[3 * tri + 1]]; 
+    const Point& p3 = this->vertices[this->indices[3 * tri + 2]]; 
+    return ::intersect_triangle(r,p1,p2,p3,t,u,v); 
+}
+
+void TriangleMesh::intersect_triangle(int tri, const TriangleRay& r, std::vector<Intersection>& xs) const
+{
+    double t, u, v; 
+    if(!this->intersect_triangle(tri,r,t,u,v))
+        return; 
+
+    Intersection hit(t,this,u,v); 
+    hit.index = tri; 
+    xs.push_back(hit); 
+}
+
+// The watertight intersect_triangle on four triangles at once, two lanes per SSE register
+// Every lane goes through the same operations in the same order as intersect_triangle, so the hits are exactly the same.
+int TriangleMesh::intersect_block(int block, const TriangleRay& r, double t[4], double u[4], double v[4]) const
+{
+    const TriangleBlock& b = this->blocks[block]; 
+    int mask = 0; 
+
+#ifdef USE_SSE
+    const __m128d ox = _mm_set1_pd(r.origin[r.kx]); 
+    const __m128d oy = _mm_set1_pd(r.origin[r.ky]); 
+    const __m128d oz = _mm_set1_pd(r.origin[r.kz]); 
+    const __m128d sx = _mm_set1_pd(r.sx); 
+    const __m128d sy = _mm_set1_pd(r.sy); 
+    const __m128d sz = _mm_set1_pd(r.sz); 
+    const __m128d zero = _mm_setzero_pd(); 
+    const __m128d one = _mm_set1_pd(1.0); 
+
+    for(int half = 0; half < 4; half += 2)
+    {
+        //Vertices relative to the origin and sheared into the ray's space
+        __m128d az = _mm_sub_pd(_mm_load_pd(&b.p1[r.kz][half]),oz); 
+        __m128d bz = _mm_sub_pd(_mm_load_pd(&b.p2[r.kz][half]),oz); 
+        __m128d cz = _mm_sub_pd(_mm_load_pd(&b.p3[r.kz][half]),oz); 
+        __m128d ax = _mm_sub_pd(_mm_sub_pd(_mm_load_pd(&b.p1[r.kx][half]),ox),_mm_mul_pd(sx,az)); 
+        __m128d ay = _mm_sub_pd(_mm_sub_pd(_mm_load_pd(&b.p1[r.ky][half]),oy),_mm_mul_pd(sy,az)); 
+        __m128d bx = _mm_sub_pd(_mm_sub_pd(_mm_load_pd(&b.p2[r.kx][half]),ox),_mm_mul_pd(sx,bz)); 
+        __m128d by = _mm_sub_pd(_mm_sub_pd(_mm_load_pd(&b.p2[r.ky][half]),oy),_mm_mul_pd(sy,bz)); 
+        __m128d cx = _mm_sub_pd(_mm_sub_pd(_mm_load_pd(&b.p3[r.kx][half]),ox),_mm_mul_pd(sx,cz)); 
+        __m128d cy = _mm_sub_pd(_mm_sub_pd(_mm_load_pd(&b.p3[r.ky][half]),oy),_mm_mul_pd(sy,cz)); 
+
+        __m128d edge_u = _mm_sub_pd(_mm_mul_pd(cx,by),_mm_mul_pd(cy,bx)); 
+        __m128d edge_v = _mm_sub_pd(_mm_mul_pd(ax,cy),_mm_mul_pd(ay,cx)); 
+        __m128d edge_w = _mm_sub_pd(_mm_mul_pd(bx,ay),_mm_mul_pd(by,ax)); 
+
+        __m128d negative = _mm_or_pd(_mm_or_pd(_mm_cmplt_pd(edge_u,zero),_mm_cmplt_pd(edge_v,zero)),_mm_cmplt_pd(edge_w,zero)); 
+        __m128d positive = _mm_or_pd(_mm_or_pd(_mm_cmpgt_pd(edge_u,zero),_mm_cmpgt_pd(edge_v,zero)),_mm_cmpgt_pd(edge_w,zero)); 
+        __m128d det = _mm_add_pd(_mm_add_pd(edge_u,edge_v),edge_w); 
+        __m128d keep = _mm_andnot_pd(_mm_and_pd(negative,positive),_mm_cmpneq_pd(det,zero)); 
+        if(_mm_movemask_pd(keep) == 0)
+            continue; 
+
+        __m128d t_scaled = _mm_add_pd(_mm_add_pd(_mm_mul_pd(edge_u,_mm_mul_pd(sz,az)),_mm_mul_pd(edge_v,_mm_mul_pd(sz,bz))),_mm_mul_pd(edge_w,_mm_mul_pd(sz,cz))); 
+        __m128d inv_det = _mm_div_pd(one,det); 
+        _mm_storeu_pd(t + half,_mm_mul_pd(t_scaled,inv_det)); 
+        _mm_storeu_pd(u + half,_mm_mul_pd(edge_v,inv_det)); 
+        _mm_storeu_pd(v + half,_mm_mul_pd(edge_w,inv_det)); 
+        mask |= _mm_movemask_pd(keep) << half; 
+    }
+#else
+    for(int lane = 0; lane < 4; lane++)
+    {
+        Point p1(b.p1[0][lane],b.p1[1][lane],b.p1[2][lane]); 
+        Point p2(b.p2[0][lane],b.p2[1][lane],b.p2[2][lane]); 
+        Point p3(b.p3[0][lane],b.p3[1][lane],b.p3[2][lane]); 
+        if(::intersect_triangle(r,p1,p2,p3,t[lane],u[lane],v[lane]))
+            mask |= 1 << lane; 
+    }
+#endif
+
+    return mask; 
+}
+
+void TriangleMesh::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
+{
+    bvh_intersect(this->bvh,*this,r,xs); 
+}
+
+bool TriangleMesh::local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const
+{
+    return bvh_intersect_closest(this->bvh,*this,r,hit,t_max); 
+}
+
+bool TriangleMesh::local_intersect_any(const Ray& r, double t_max) const
+{
+    return bvh_occluded(this->bvh,*this,r,t_max); 
+}
+
+// Smooth triangles interpolate their vertex normals like SmoothTriangle, flat ones use their face normal like Triangle
+Vector TriangleMesh::local_normal_at(const Point& object_point,const Intersection& hit) const
+{
+    int tri = hit.index; 
+    if(!this->normal_indices.empty() && this->normal_indices[3 * tri] >= 0)
+    {
+        const Vector& n1 = this->normals[this->normal_indices[3 * tri]]; 
+        const Vector& n2 = this->normals[this->normal_indices[3 * tri + 1]]; 
+        const Vector& n3 = this->normals[this->normal_indices[3 * tri + 2]]; 
+        return (n2 * hit.u + n3 * hit.v + n1 * (1 - hit.u - hit.v)); 
+    }
+
+    const Point& p1 = this->vertices[this->indices[3 * tri]]; 
+    Vector e1 = this->vertices[this->indices[3 * tri + 1]] - p1; 
+    Vector e2 = this->vertices[this->indices[3 * tri + 2]] - p1; 
+    Vector normal = (e2 ^ e1).normalize(); 
+
+    return this->flip_normals ? -normal : normal; 
+}
+
+AABB TriangleMesh::bounds() const
+{
+    return this->mesh_bounds; 
+}
+
+// Moves the shared vertices and normals like Triangle and SmoothTriangle do, then rebuilds the BVH around them
+void TriangleMesh::bake_transform(const Matrix4& m)
+{
+    Matrix4 combined = m * this->transform; 
+    Matrix4 normal_matrix = combined.inverse(); 
+    normal_matrix.transpose(); 
+
+    this->mesh_bounds = AABB(); 
+    for(Point& p: this->vertices)
+    {
+        p = combined * p; 
+        this->mesh_bounds = box_union(this->mesh_bounds,AABB(p,p)); 
+    }
+
+    for(Vector& n: this->normals)
+    {
+        n = normal_matrix * n; 
+        n.w = 0; 
+    }
+
+    if(combined.determinant() < 0)
+        this->flip_normals = !this->flip_normals; 
+
+    this->setTransform(Matrix4()); 
+    this->refresh_bvh(); 
+}
+
+ParticleSet::~ParticleSet()
+{
+    delete_bvh(this->bvh); 
+}
+
+void ParticleSet::reserve(int count)
+{
+    this->centers.reserve(3 * (size_t)count); 
+    this->radii.reserve(count); 
+    this->material_indices.reserve(count); 
+}
+
+int ParticleSet::add_material(const Material& m)
+{
+    this->materials.push_back(m); 
+    return (int)this->materials.size() - 1; 
+}
+
+int ParticleSet::add_particle(const Point& center, double radius, int material)
+{
+    this->centers.insert(this->centers.end(),{center.x,center.y,center.z}); 
+    this->radii.push_back((float)radius); 
+    this->material_indices.push_back(material); 
+
+    int particle = this->particle_count() - 1; 
+    this->set_bounds = box_union(this->set_bounds,this->particle_bounds(particle)); 
+    return particle; 
+}
+
+int ParticleSet::particle_count() const
+{
+    return (int)this->radii.size(); 
+}
+
+AABB ParticleSet::particle_bounds(int particle) const
+{
+    const double* c = &this->centers[3 * particle]; 
+    double radius = this->radii[particle]; 
+    return AABB(Point(c[0] - radius,c[1] - radius,c[2] - radius),Point(c[0] + radius,c[1] + radius,c[2] + radius)); 
+}
+
+// The LBVH builder takes a million particles in under a second, where the SAH builder needs several
+// Spheres of similar sizes give trees of much the same quality either way
+void ParticleSet::refresh_bvh()
+{
+    int count = this->particle_count(); 
+    BVHBuildSettings settings; 
+    settings.builder = BVH_BUILDER::LBVH; 
+
+    std::vector<AABB> bounds(count); 
+    #pragma omp parallel for if(count > settings.parallel_threshold)
+    for(int i = 0; i < count; i++)
+    {
+        bounds[i] = this->particle_bounds(i); 
+    }
+
+    delete_bvh(this->bvh); 
+    this->bvh = build_bvh(bounds,settings); 
+
+    //Put the particles in leaf order
+    std::vector<double> centers(this->centers.size()); 
+    std::vector<float> radii(count); 
+    std::vector<int> material_indices(count); 
+    #pragma omp parallel for if(count > settings.parallel_threshold)
+    for(int i = 0; i < count; i++)
+    {
+        int particle = this->bvh->indices[i]; 
+        for(int axis = 0; axis < 3; axis++)
+        {
+            centers[3 * i + axis] = this->centers[3 * particle + axis]; 
+        }
+        radii[i] = this->radii[particle]; 
+        material_indices[i] = this->material_indices[particle]; 
+    }
+    this->centers.swap(centers); 
+    this->radii.swap(radii); 
+    this->material_indices.swap(material_indices); 
+
+    //Leaf primitive i is now particle i, so the indices are not needed any more
+    compact_bvh(this->bvh,false); 
+}
+
+// Analytic test against the particle's sphere in the space of the set, the ray is never transformed per particle
+// The discriminant comes from the distance between the center and the ray's closest approach, rather than from the
+// difference of two squares, so it stays accurate for small particles far from the ray's origin
+int ParticleSet::intersect_particle(int particle, const Ray& r, double ts[2]) const
+{
+    const double* c = &this->centers[3 * particle]; 
+    double radius = this->radii[particle]; 
+
+    double ox = r.origin.x - c[0]; 
+    double oy = r.origin.y - c[1]; 
+    double oz = r.origin.z - c[2]; 
+    double a = r.direction * r.direction; 
+    double b = ox * r.direction.x + oy * r.direction.y + oz * r.direction.z; 
+
+    //Offset of the center from the point of closest approach
+    double fx = ox - b / a * r.direction.x; 
+    double fy = oy - b / a * r.direction.y; 
+    double fz = oz - b / a * r.direction.z; 
+    double discriminant = a * (radius * radius - (fx * fx + fy * fy + fz * fz)); 
+
+    if(discriminant < 0)
+        return 0; 
+
+    double root = sqrt(discriminant); 
+    ts[0] = (-b - root) / a; 
+    ts[1] = (-b + root) / a; 
+    return 2; 
+}
+
+void ParticleSet::local_intersect_into(const Ray& r, std::vector<Intersection>& xs) const
+{
+    bvh_intersect(this->bvh,*this,r,xs); 
+}
+
+bool ParticleSet::local_intersect_closest(const Ray& r, Intersection& hit, double t_max) const
+{
+    return bvh_intersect_closest(this->bvh,*this,r,hit,t_max); 
+}
+
+bool ParticleSet::local_intersect_any(const Ray& r, double t_max) const
+{
+    return bvh_occluded(this->bvh,*this,r,t_max); 
+}
+
+Vector ParticleSet::local_normal_at(const Point& object_point,const Intersection& hit) const
+{
+    const double* c = &this->centers[3 * hit.index]; 
+    return (object_point - Point(c[0],c[1],c[2])) * (1.0 / this->radii[hit.index]); 
+}
+
+AABB ParticleSet::bounds() const
+{
+    return this->set_bounds; 
+}
+
+const Material& ParticleSet::material_at(const Intersection& hit) const
+{
+    int material = this->material_indices[hit.index]; 
+    return material < 0 ? this->mat : this->materials[material]; 
+}
+
+// Scale of a transform whose linear part is a rotation (or mirror) times a uniform scale, so that M * M^T = scale^2 * I
+// Returns 0 for any other transform, which would stretch spheres into ellipsoids
+static double similarity_scale(const Matrix4& m)
+{
+    if(!m.is_affine())
+        return 0; 
+
+    const std::array<double,16>& d = m.data; 
+    double scale2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2]; 
+    double tolerance = 1e-9 * scale2; 
+    for(int i = 0; i < 3; i++)
+    {
+        for(int j = i; j < 3; j++)
+        {
+            double dot = d[4 * i] * d[4 * j] + d[4 * i + 1] * d[4 * j + 1] + d[4 * i + 2] * d[4 * j + 2]; 
+            if(abs(dot - (i == j ? scale2 : 0.0)) > tolerance)
+                return 0; 
+        }
+    }
+    return sqrt(scale2); 
+}
+
+// Rotations, mirrors, uniform scales and translations keep the particles spheres, so they are moved into the centers
+// and radii and the BVH rebuilt around them. A non-uniform scale or a shear would stretch them into ellipsoids, so the
+// set keeps those as its transform instead
+void ParticleSet::bake_transform(const Matrix4& m)
+{
+    Matrix4 combined = m * this->transform; 
+    double scale = similarity_scale(combined); 
+    if(scale == 0)
+    {
+        Shape::bake_transform(m); 
+        return; 
+    }
+
+    int count = this->particle_count(); 
+    this->set_bounds = AABB(); 
+    for(int i = 0; i < count; i++)
+    {
+        Point center = combined * Point(this->centers[3 * i],this->centers[3 * i + 1],this->centers[3 * i + 2]); 
+        this->centers[3 * i] = center.x; 
+        this->centers[3 * i + 1] = center.y; 
+        this->centers[3 * i + 2] = center.z; 
+        this->radii[i] = (float)(this->radii[i] * scale); 
+        this->set_bounds = box_union(this->set_bounds,this->particle_bounds(i)); 
+    }
+
+    this->setTransform(Matrix4()); 
+    this->refresh_bvh(); 
+}
+
 Sphere* glass_sphere()
 {
     Sphere* s = new Sphere(); 
@@ -390,7 +1014,7 @@ Sphere* glass_sphere()
 Sphere* hexagon_corner()
 {
     Sphere* corner = new Sphere(); 
-    corner->transform = translation(0,0,-1) * scaling(0.25,0.25,0.25); 
+    corner->setTransform(translation(0,0,-1) * scaling(0.25,0.25,0.25)); 
 
     return corner; 
 }
@@ -398,7 +1022,7 @@ Sphere* hexagon_corner()
 Cylinder* hexagon_edge()
 {
     Cylinder* edge = new Cylinder(0,1);
-    edge->transform = translation(0,0,-1) * rotation_y(-M_PI/6.0) * rotation_z(-M_PI/2.0) * scaling(0.25,1,0.25); 
+    edge->setTransform(translation(0,0,-1) * rotation_y(-M_PI/6.0) * rotation_z(-M_PI/2.0) * scaling(0.25,1,0.25)); 
     
     return edge; 
 }
@@ -418,7 +1042,7 @@ Group* hexagon()
     for(int n = 0; n < 6; n++)
     {
         Group* side = hexagon_side(); 
-        side->transform = rotation_y(n * M_PI/3.0); 
+        side->setTransform(rotation_y(n * M_PI/3.0)); 
         hex->add_child(side); 
     }
 
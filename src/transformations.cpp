@@ -3,10 +3,9 @@
 
 // This function creates a translation matrix that translates points by (x, y, z).
 // It returns a 4x4 matrix that can be used to transform points in 3D space.
-Matrix translation(double x, double y, double z)
+Matrix4 translation(double x, double y, double z)
 {
-    Matrix A(4,4); 
-    A.setIdentity(); 
+    Matrix4 A; 
     A.setElement(0,3,x);  
     A.setElement(1,3,y);
     A.setElement(2,3,z);
@@ -17,10 +16,9 @@ Matrix translation(double x, double y, double z)
 
 // This function creates a scaling matrix that scales points by (x, y, z).
 // It returns a 4x4 matrix that can be used to scale points in 3D space.
-Matrix scaling(double x, double y, double z)
+Matrix4 scaling(double x, double y, double z)
 {
-    Matrix A(4,4); 
-    A.setIdentity(); 
+    Matrix4 A; 
     A.setElement(0,0,x); 
     A.setElement(1,1,y); 
     A.setElement(2,2,z); 
@@ -30,10 +28,9 @@ Matrix scaling(double x, double y, double z)
 
 // This function creates a rotation matrix around the X-axis by a given angle in radians.
 // It returns a 4x4 matrix that can be used to rotate points in 3D space around the X-axis.
-Matrix rotation_x(double rad)
+Matrix4 rotation_x(double rad)
 {
-    Matrix A(4,4); 
-    A.setIdentity(); 
+    Matrix4 A; 
     A.setElement(1,1,cos(rad)); 
     A.setElement(2,2,cos(rad)); 
     A.setElement(2,1,sin(rad)); 
@@ -44,10 +41,9 @@ Matrix rotation_x(double rad)
 
 // This function creates a rotation matrix around the Y-axis by a given angle in radians.
 // It returns a 4x4 matrix that can be used to rotate points in 3D space around the Y-axis.
-Matrix rotation_y(double rad)
+Matrix4 rotation_y(double rad)
 {
-    Matrix A(4,4); 
-    A.setIdentity(); 
+    Matrix4 A; 
     A.setElement(0,0,cos(rad)); 
     A.setElement(2,2,cos(rad)); 
     A.setElement(0,2,sin(rad)); 
@@ -58,10 +54,9 @@ Matrix rotation_y(double rad)
 
 // This function creates a rotation matrix around the Y-axis by a given angle in radians.
 // It returns a 4x4 matrix that can be used to rotate points in 3D space around the Z-axis.
-Matrix rotation_z(double rad)
+Matrix4 rotation_z(double rad)
 {
-    Matrix A(4,4); 
-    A.setIdentity(); 
+    Matrix4 A; 
     A.setElement(0,0,cos(rad)); 
     A.setElement(1,1,cos(rad)); 
     A.setElement(0,1,-sin(rad)); 
@@ -71,10 +66,9 @@ Matrix rotation_z(double rad)
 }
 
 // This function creates a skew matrix that skews points in 3D space.
-Matrix skew(double x_y,double x_z,double y_x,double y_z,double z_x,double z_y)
+Matrix4 skew(double x_y,double x_z,double y_x,double y_z,double z_x,double z_y)
 {
-    Matrix A(4,4); 
-    A.setIdentity();
+    Matrix4 A; 
     
     A.setElement(0,1,x_y); 
     A.setElement(0,2,x_z); 
@@ -88,7 +82,7 @@ Matrix skew(double x_y,double x_z,double y_x,double y_z,double z_x,double z_y)
 
 // This function creates a view transformation matrix that transforms points from world space to camera space.
 // It takes the camera's position, target point, and up vector as parameters.
-Matrix view_transform(const Point& from, const Point& to, const Vector& up)
+Matrix4 view_transform(const Point& from, const Point& to, const Vector& up)
 {
     Vector forward = to - from; 
     forward = forward.normalize(); 
@@ -96,14 +90,14 @@ Matrix view_transform(const Point& from, const Point& to, const Vector& up)
     Vector left = forward ^ upn; 
     Vector true_up = left ^ forward; 
 
-    std::vector<double> data = {
+    std::array<double,16> data = {
         left.x,left.y,left.z,0,
         true_up.x, true_up.y, true_up.z,0,
         -forward.x, -forward.y, -forward.z, 0, 
         0, 0, 0, 1
     }; 
 
-    Matrix orientation(4,4,data); 
+    Matrix4 orientation(data); 
 
     return orientation * translation(-from.x,-from.y,-from.z); 
 }
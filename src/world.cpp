@@ -4,6 +4,7 @@
 #include "tools.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 
 
@@ -18,8 +19,6 @@ World::World()
 
     //std::vector<Shape*> flat_list;
     //flatten(world_objects,flat_list); 
-
-    this->bvh = build_bvh(world_objects,2); 
 }
 World::~World()
 {
@@ -28,22 +27,32 @@ World::~World()
         delete s; 
     }
 
+    delete_bvh(this->bvh); 
 }
 
-std::vector<Intersection> World::intersect(const Ray& ray)
+std::vector<Intersection> World::intersect(const Ray& ray, double t_max)
 {
-    std::vector<Intersection> intersection_list = bvh_intersect(this->bvh,ray); 
-    // std::vector<Intersection> intersection_list = {}; 
-    // for(Shape* s: this->world_objects)
-    // {
-    //     std::vector<Intersection> temp_list = s->intersect(ray); 
-    //     intersection_list.insert(intersection_list.end(),temp_list.begin(),temp_list.end()); 
-    // }
-    std::sort(intersection_list.begin(),intersection_list.end(),comp_intersection); 
+    std::vector<Intersection> intersection_list; 
+    this->intersect(ray,intersection_list,t_max); 
 
     return intersection_list; 
 }
 
+void World::intersect(const Ray& ray, std::vector<Intersection>& xs, double t_max)
+{
+    this->update_bvh(); 
+    size_t start = xs.size(); 
+    bvh_intersect(this->bvh,ray,xs,t_max); 
+    std::sort(xs.begin() + start,xs.end(),comp_intersection); 
+}
+
+//Finds the nearest intersection in front of the ray without collecting and sorting the others
+bool World::intersect_closest(const Ray& ray, Intersection& hit)
+{
+    this->update_bvh(); 
+    return bvh_intersect_closest(this->bvh,ray,hit); 
+}
+
 //Shades the hit point based on the material properties and lighting
 //This function calculates the color at the intersection point, taking into account the material properties, lighting, and whether the point is in shadow.
 Color World::shade_hit(const Computations& comps,int remaining)
@@ -52,17 +61,17 @@ Color World::shade_hit(const Computations& comps,int remaining)
 
     //bool in_shadow = false; 
 
-    Color surface =  lighting(comps.s->mat,comps.s,this->world_light,comps.over_point,comps.eyev,comps.normalv,in_shadow);
+    Color surface =  lighting(*comps.mat,comps.s,this->world_light,comps.over_point,comps.eyev,comps.normalv,in_shadow);
 
     Color reflected = Color(0,0,0); 
-    if(comps.s->mat.reflective > 0.0)
+    if(comps.mat->reflective > 0.0)
         reflected = this->reflected_color(comps,remaining); 
 
     Color refracted = Color(0,0,0); 
-    if(comps.s->mat.transparency > 0.0)
+    if(comps.mat->transparency > 0.0)
         refracted = this->refracted_color(comps,remaining); 
 
-    if(comps.s->mat.reflective > 0.0 && comps.s->mat.transparency > 0.0)
+    if(comps.mat->reflective > 0.0 && comps.mat->transparency > 0.0)
     {
         double reflectance = this->schlick(comps); 
         return surface + reflected * reflectance + refracted * (1.0 - reflectance); 
@@ -74,32 +83,60 @@ Color World::shade_hit(const Computations& comps,int remaining)
 //This function checks for intersections with the world objects and computes the color at the intersection point.
 Color World::color_at(const Ray& ray,int remaining)
 {
-    std::vector<Intersection> _ints = this->intersect(ray); 
-    const Intersection* hit = find_hit(_ints); 
-
-    if(hit == nullptr)
+    Intersection hit(0.0,nullptr); 
+    if(!this->intersect_closest(ray,hit))
         return Color(0.0,0.0,0.0); 
 
-    Computations comps(*hit,ray,_ints);
+    Computations comps = this->prepare_computations(hit,ray);
     
     return shade_hit(comps,remaining); 
 }
 
+//Prepares the shading of a hit found by intersect_closest
+Computations World::prepare_computations(const Intersection& hit, const Ray& ray)
+{
+    //Each thread reuses one list for every ray it traces, it is free again once comps is built
+    static thread_local std::vector<Intersection> _ints; 
+    _ints.clear(); 
+
+    //Opaque surfaces never refract, so their refractive indices are never read
+    //The refractive indices of transparent ones depend on every surface the ray crossed before the hit, including those behind its origin.
+    //The list is not cut off at hit.t, a box entered within round off of hit.t could be skipped and the hit with it
+    if(hit.s->material_at(hit).transparency == 0.0)
+    {
+        _ints.push_back(hit); 
+    }
+    else 
+    {
+        this->intersect(ray,_ints); 
+
+        //Should the full traversal still have found the hit a rounding apart, it stands in for its closest entry on the same shape
+        if(std::find(_ints.begin(),_ints.end(),hit) == _ints.end())
+        {
+            Intersection* same = nullptr; 
+            for(Intersection& x: _ints)
+            {
+                if(x.s == hit.s && x.index == hit.index && (same == nullptr || std::abs(x.t - hit.t) < std::abs(same->t - hit.t)))
+                    same = &x; 
+            }
+            if(same != nullptr)
+                *same = hit; 
+        }
+    }
+
+    return Computations(hit,ray,_ints); 
+}
+
 //Checks if a point is in shadow with respect to the light source
-//This function casts a shadow ray from the point to the light source and checks for intersections with the world objects.
+//This function casts a shadow ray from the point to the light source and stops at the first object found in between.
 bool World::is_shadowed(const Point& point)
 {
     Vector shadow_vec = this->world_light.position - point; 
     double distance = shadow_vec.magnitude(); 
     Ray shadow_ray(point,shadow_vec.normalize()); 
 
-    std::vector<Intersection> inters = this->intersect(shadow_ray); 
-    const Intersection* hit = find_hit(inters); 
-
-    if(hit != nullptr && hit->t < distance)
-        return true; 
-
-    return false; 
+    this->update_bvh(); 
+    return bvh_occluded(this->bvh,shadow_ray,distance); 
 }
 
 //Calculates the color of the reflected ray at the intersection point
@@ -112,7 +149,7 @@ Color World::reflected_color(const Computations& comps,int remaining)
     Ray reflect_ray(comps.over_point,comps.reflectv); 
     Color color = this->color_at(reflect_ray,remaining-1); 
 
-    return color * comps.s->mat.reflective; 
+    return color * comps.mat->reflective; 
 }
 
 void World::empty_objects()
@@ -122,6 +159,11 @@ void World::empty_objects()
         delete s; 
     }
     this->world_objects.clear(); 
+
+    //The old BVH still points at the deleted shapes
+    delete_bvh(this->bvh); 
+    this->bvh = nullptr; 
+    this->bvh_dirty = true; 
 }
 
 //This function spawns a refracted ray at the intersection point and traces it through the world to get the color.
@@ -151,7 +193,7 @@ Color World::refracted_color(const Computations& comps,int remaining)
     Vector direction =  (n_ratio * cos_i - cos_t) * comps.normalv - n_ratio * comps.eyev; 
     Ray refract_ray(comps.under_point,direction); 
 
-    Color color = this->color_at(refract_ray,remaining-1) * comps.s->mat.transparency; 
+    Color color = this->color_at(refract_ray,remaining-1) * comps.mat->transparency; 
 
     return color; 
 }
@@ -182,15 +224,66 @@ double World::schlick(const Computations& comps)
 }
 
 //Adds a shape to the world
-//This function adds a new shape to the world and rebuilds the BVH for efficient intersection
+//A built BVH takes the shape in place, as long as the inserted shapes stay a small part of it. Past that, or while the
+//scene is still being set up, the BVH is left to be rebuilt once on the next trace, so adding N shapes stays linear
 void World::add_object(Shape* s)
 {
     this->world_objects.push_back(s); 
-    delete_bvh(this->bvh); 
+    if(this->bvh_dirty)
+        return; 
+
+    //Inserted leaves are never as well placed as built ones, rebuild once they make up a quarter of the tree
+    if(4 * (this->incremental_inserts + 1) > (int)this->world_objects.size() || !bvh_insert(this->bvh,s))
+    {
+        this->bvh_dirty = true; 
+        return; 
+    }
+
+    this->incremental_inserts++; 
+}
+
+//Adds a batch of shapes to the world
+//The BVH is rebuilt once, before the next trace, instead of once per shape
+void World::add_objects(const std::vector<Shape*>& shapes)
+{
+    this->world_objects.insert(this->world_objects.end(),shapes.begin(),shapes.end()); 
+    this->bvh_dirty = true; 
+}
+
+//Refits the BVHs of the world and its groups after shapes have moved, for animation
+//The top level BVH is rebuilt instead once its SAH cost grows past rebuild_ratio times its built cost
+void World::refit_bvh(double rebuild_ratio)
+{
+    for(Shape* s: this->world_objects)
+    {
+        if(s->isGroup)
+        {
+            Group* g = static_cast<Group*>(s); 
+            g->refit_bvh(rebuild_ratio); 
+        }
+    }
+
+    if(!this->bvh_dirty)
+    {
+        double ratio = ::refit_bvh(this->bvh); 
+        this->bvh_dirty = rebuild_ratio > 0 && ratio > rebuild_ratio; 
+    }
+    this->update_bvh(); 
+}
+
+//Rebuilds the BVH if shapes were added since it was built
+//Tracing calls this on its own, render calls it before its threads start so they never race to rebuild
+void World::update_bvh()
+{
+    if(!this->bvh_dirty)
+        return; 
 
     //std::vector<Shape*> flat_list; 
     //flatten(world_objects,flat_list); 
 
-    this->bvh = build_bvh(world_objects,2); 
+    delete_bvh(this->bvh); 
+    this->bvh = build_bvh(this->world_objects,BVHBuildSettings()); 
+    this->bvh_dirty = false; 
+    this->incremental_inserts = 0; 
 }
 
@@ -0,0 +1,81 @@
+#include "allocation_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+// The counter of the innermost live AllocationCounter on this thread, nullptr while none is
+static thread_local AllocationCounter* active_counter = nullptr; 
+
+AllocationCounter::AllocationCounter()
+{
+    this->previous = active_counter; 
+    active_counter = this; 
+}
+
+AllocationCounter::~AllocationCounter()
+{
+    active_counter = this->previous; 
+}
+
+// Every plain and array form of new and delete is replaced so they all pair malloc with free
+// The aligned forms keep the library's own implementations, which pair with each other
+static void* counted_malloc(std::size_t size) noexcept
+{
+    if(active_counter != nullptr)
+        active_counter->count++; 
+
+    return std::malloc(size == 0 ? 1 : size); 
+}
+
+void* operator new(std::size_t size)
+{
+    void* p = counted_malloc(size); 
+    if(p == nullptr)
+        throw std::bad_alloc(); 
+    return p; 
+}
+
+void* operator new[](std::size_t size)
+{
+    return ::operator new(size); 
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_malloc(size); 
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_malloc(size); 
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p); 
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p); 
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p); 
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p); 
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p); 
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p); 
+}
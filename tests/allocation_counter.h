@@ -0,0 +1,17 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+// Counts the heap allocations made by operator new on the constructing thread for as long as it is alive
+// The replacement operators in allocation_counter.cpp only count while one exists, they never change how memory is handed out
+struct AllocationCounter
+{
+    AllocationCounter(); 
+    ~AllocationCounter(); 
+    AllocationCounter(const AllocationCounter&) = delete; 
+    AllocationCounter& operator=(const AllocationCounter&) = delete; 
+
+    long count = 0; 
+    AllocationCounter* previous = nullptr; // The counter this one shadows until it is destroyed
+}; 
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef TEST_HELPERS_H
+#define TEST_HELPERS_H
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "intersection.h"
+#include "ray.h"
+
+#include <vector>
+#include <limits>
+
+// Checks the three ray queries of an acceleration structure against a brute force reference over its parts
+// For each of ray_count rays from make_ray(k):
+// reference(r,xs) appends every hit of every part, intersect(r) returns every hit the structure finds,
+// closest(r,hit) finds its nearest hit in front of the ray and any(r,t_max) whether something lies in (0,t_max).
+// same(r,hit,nearest) compares the structure's nearest hit with the reference's, including its distance
+template<typename MakeRay, typename Reference, typename Intersect, typename Closest, typename Any, typename Same>
+void require_queries_match(int ray_count, MakeRay make_ray, Reference reference, Intersect intersect, Closest closest, Any any, Same same)
+{
+    std::vector<Intersection> expected; 
+    for(int k = 0; k < ray_count; k++)
+    {
+        Ray r = make_ray(k); 
+        expected.clear(); 
+        reference(r,expected); 
+
+        const Intersection* nearest = nullptr; 
+        for(const Intersection& x: expected)
+        {
+            if(x.t > 0 && (nearest == nullptr || x.t < nearest->t))
+                nearest = &x; 
+        }
+
+        REQUIRE(intersect(r).size() == expected.size()); 
+        Intersection hit(0,nullptr); 
+        REQUIRE(closest(r,hit) == (nearest != nullptr)); 
+        if(nearest == nullptr)
+            continue; 
+
+        same(r,hit,*nearest); 
+        REQUIRE(any(r,nearest->t + 0.01)); 
+        REQUIRE(!any(r,nearest->t - 0.01)); 
+    }
+}
+
+#endif
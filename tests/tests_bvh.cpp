@@ -2,9 +2,13 @@
 #include "shape.h"
 #include "shapes.h"
 #include "transformations.h"
+#include "test_helpers.h"
 
 #include <catch2/catch_test_macros.hpp>
 #include <vector>
+#include <algorithm>
+#define _USE_MATH_DEFINES
+#include <math.h>
 
 TEST_CASE("Creating and deleting bvh","[bvh]")
 {
@@ -13,14 +17,15 @@ TEST_CASE("Creating and deleting bvh","[bvh]")
     for(int i = 0; i < 10; i++)
     {
         Sphere* s = new Sphere(); 
-        s->transform = translation(0,i,0); 
+        s->setTransform(translation(0,i,0)); 
         list.push_back(s); 
     }
 
-    BVHNode* bvh = build_bvh(list,2); 
+    BVH* bvh = build_bvh(list,2); 
 
     REQUIRE(bvh != nullptr); 
     REQUIRE(count_bvh(bvh) == 10); 
+    REQUIRE(bvh->primitives.size() == 10); 
 
     delete_bvh(bvh); 
 
@@ -43,3 +48,791 @@ TEST_CASE("Bounding box for a triangle","[triangle][shapes][bvh]")
     REQUIRE(box.maximum == Point(6,7,2));
 }
 
+TEST_CASE("Transforming a bounding box","[bvh]")
+{
+    AABB box(Point(-1,-1,-1),Point(1,1,1)); 
+
+    AABB moved = box.transform(translation(1,2,3) * scaling(2,1,1)); 
+    REQUIRE(moved.minimum == Point(-1,1,2)); 
+    REQUIRE(moved.maximum == Point(3,3,4)); 
+
+    //The box around the rotated corners
+    AABB rotated = box.transform(rotation_z(M_PI/4)); 
+    REQUIRE(rotated.minimum == Point(-sqrt(2),-sqrt(2),-1)); 
+    REQUIRE(rotated.maximum == Point(sqrt(2),sqrt(2),1)); 
+
+    //Infinite planes stay infinite and empty boxes stay empty
+    double inf = std::numeric_limits<double>::infinity(); 
+    Plane p(-inf,inf,-inf,inf); 
+    AABB plane_box = p.bounds().transform(translation(0,1,0)); 
+    REQUIRE(plane_box.minimum.x == -inf); 
+    REQUIRE(plane_box.maximum.z == inf); 
+    REQUIRE(equal_double(plane_box.maximum.y,1 + EPSILON)); 
+
+    AABB empty = AABB().transform(translation(1,2,3)); 
+    REQUIRE(empty.minimum.x > empty.maximum.x); 
+}
+
+TEST_CASE("Group bounds are cached until a descendant changes","[bvh][group]")
+{
+    Group* outer = new Group(); 
+    Group* inner = new Group(); 
+    Sphere* s = new Sphere(); 
+    inner->add_child(s); 
+    outer->add_child(inner); 
+
+    REQUIRE(outer->bounds().maximum == Point(1,1,1)); 
+    REQUIRE(outer->bounds_valid); 
+    REQUIRE(inner->bounds_valid); 
+
+    //Moving the sphere invalidates every group above it
+    s->setTransform(translation(5,0,0)); 
+    REQUIRE(!inner->bounds_valid); 
+    REQUIRE(!outer->bounds_valid); 
+    REQUIRE(outer->bounds().maximum == Point(6,1,1)); 
+
+    inner->add_child(new Sphere()); 
+    REQUIRE(!outer->bounds_valid); 
+    REQUIRE(outer->bounds().minimum == Point(-1,-1,-1)); 
+
+    delete outer; 
+}
+
+
+TEST_CASE("Baking group transforms into a mesh","[bvh][group]")
+{
+    Group* g = new Group(); 
+    Triangle* t = new Triangle(Point(0,1,0),Point(-1,0,0),Point(1,0,0)); 
+    SmoothTriangle* st = new SmoothTriangle(Point(0,1,0),Point(-1,0,0),Point(1,0,0),Vector(0,1,0),Vector(-1,0,0),Vector(1,0,0)); 
+    st->setTransform(translation(0,0,2)); 
+    g->add_child(t); 
+    g->add_child(st); 
+    g->setTransform(rotation_y(M_PI/3.0) * scaling(2,1,3)); 
+    g->refresh_bvh(); 
+
+    //Aim one ray at the inside of each triangle
+    Point target_t = g->transform * Point(0.1,0.5,0); 
+    Point target_st = g->transform * st->transform * Point(-0.2,0.3,0); 
+    Ray r_t(target_t + Vector(0,0,-10),Vector(0,0,1)); 
+    Ray r_st(target_st + Vector(0,0,-10),Vector(0,0,1)); 
+
+    std::vector<Intersection> xs_t = g->intersect(r_t); 
+    std::vector<Intersection> xs_st = g->intersect(r_st); 
+    Intersection before_t = *find_hit(xs_t); 
+    Intersection before_st = *find_hit(xs_st); 
+    REQUIRE(before_t.s == t); 
+    REQUIRE(before_st.s == st); 
+
+    Vector normal_t = t->normal_at(r_t.position(before_t.t),before_t); 
+    Vector normal_st = st->normal_at(r_st.position(before_st.t),before_st); 
+
+    g->bake_transform(Matrix4()); 
+
+    REQUIRE(g->transform == Matrix4()); 
+    REQUIRE(t->transform == Matrix4()); 
+    REQUIRE(st->transform == Matrix4()); 
+
+    xs_t = g->intersect(r_t); 
+    xs_st = g->intersect(r_st); 
+    Intersection after_t = *find_hit(xs_t); 
+    Intersection after_st = *find_hit(xs_st); 
+
+    REQUIRE(after_t.s == t); 
+    REQUIRE(after_st.s == st); 
+    REQUIRE(equal_double(after_t.t,before_t.t)); 
+    REQUIRE(equal_double(after_st.t,before_st.t)); 
+    REQUIRE(t->normal_at(r_t.position(after_t.t),after_t) == normal_t); 
+    REQUIRE(st->normal_at(r_st.position(after_st.t),after_st) == normal_st); 
+
+    delete g; 
+}
+
+TEST_CASE("Flattening a hierarchy returns its baked leaves","[bvh][group]")
+{
+    Group* outer = new Group(); 
+    Group* inner = new Group(); 
+    Sphere* s1 = new Sphere(); 
+    Sphere* s2 = new Sphere(); 
+    inner->add_child(s1); 
+    inner->setTransform(translation(5,0,0)); 
+    outer->add_child(inner); 
+    outer->add_child(s2); 
+    outer->setTransform(scaling(2,2,2)); 
+
+    std::vector<Shape*> roots = {outer}; 
+    std::vector<Shape*> leaves; 
+    flatten(roots,leaves); 
+
+    REQUIRE(leaves.size() == 2); 
+    REQUIRE(leaves[0] == s1); 
+    REQUIRE(leaves[1] == s2); 
+    REQUIRE(s1->transform == scaling(2,2,2) * translation(5,0,0)); 
+    REQUIRE(s2->transform == scaling(2,2,2)); 
+    REQUIRE(inner->transform == Matrix4()); 
+
+    std::vector<Intersection> xs = s1->intersect(Ray(Point(10,0,-5),Vector(0,0,1))); 
+    REQUIRE(xs.size() == 2); 
+    REQUIRE(equal_double(xs[0].t,3)); 
+
+    delete outer; 
+}
+
+// Returns the size of the largest leaf in the tree
+static int largest_leaf(const BVH* bvh)
+{
+    int largest = 0; 
+    for(const BVHNode& node: bvh->nodes)
+    {
+        largest = std::max(largest,(int)node.count); 
+    }
+
+    return largest; 
+}
+
+// Returns count triangles laid out 20 to a row in half unit cells, at varying heights
+static std::vector<Shape*> triangle_grid(int count)
+{
+    std::vector<Shape*> list; 
+    for(int i = 0; i < count; i++)
+    {
+        double x = (i % 20) * 0.5; 
+        double y = (i / 20) * 0.5; 
+        list.push_back(new Triangle(Point(x,y,(i % 7) * 0.1),Point(x + 0.4,y,(i % 5) * 0.1),Point(x + 0.2,y + 0.4,0.3))); 
+    }
+
+    return list; 
+}
+
+// The i-th of 100 rays fired up through the triangle grid
+static Ray grid_ray(int i)
+{
+    return Ray(Point((i % 10) * 1.0 + 0.13,(i / 10) * 1.0 + 0.07,-5),Vector(0.01 * (i % 3),0.02,1)); 
+}
+
+// Requires both trees to find the same intersections along every grid ray once both lists are sorted by order
+template<typename Order>
+static void require_same_intersections(const BVH* a, const BVH* b, Order order)
+{
+    for(int i = 0; i < 100; i++)
+    {
+        std::vector<Intersection> xs_a = bvh_intersect(a,grid_ray(i)); 
+        std::vector<Intersection> xs_b = bvh_intersect(b,grid_ray(i)); 
+        std::sort(xs_a.begin(),xs_a.end(),order); 
+        std::sort(xs_b.begin(),xs_b.end(),order); 
+
+        REQUIRE(xs_a.size() == xs_b.size()); 
+        for(int j = 0; j < xs_a.size(); j++)
+        {
+            REQUIRE(xs_a[j] == xs_b[j]); 
+        }
+    }
+}
+
+TEST_CASE("SAH builder","[bvh]")
+{
+    std::vector<Shape*> list; 
+
+    //A dense cluster of small spheres next to a few large ones
+    for(int i = 0; i < 40; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation((i % 5) * 0.3,(i / 5) * 0.3,0) * scaling(0.1,0.1,0.1)); 
+        list.push_back(s); 
+    }
+    for(int i = 0; i < 3; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation(20 + i * 10,0,0) * scaling(4,4,4)); 
+        list.push_back(s); 
+    }
+
+    BVHBuildSettings settings; 
+    settings.builder = BVH_BUILDER::SAH; 
+    settings.maxPrimsPerLeaf = 4; 
+    BVH* sah = build_bvh(list,settings); 
+
+    settings.builder = BVH_BUILDER::MEDIAN; 
+    BVH* median = build_bvh(list,settings); 
+
+    REQUIRE(count_bvh(sah) == 43); 
+    REQUIRE(largest_leaf(sah) <= 4); 
+    REQUIRE(largest_leaf(median) <= 4); 
+
+    //Both trees must find exactly the same intersections
+    int hits = 0; 
+    for(int i = 0; i < 20; i++)
+    {
+        Ray r(Point(-5,i * 0.13 - 0.5,-10),Vector(1 + i * 0.5,0.1,10).normalize()); 
+        std::vector<Intersection> xs_sah = bvh_intersect(sah,r); 
+        std::vector<Intersection> xs_median = bvh_intersect(median,r); 
+        std::sort(xs_sah.begin(),xs_sah.end(),comp_intersection); 
+        std::sort(xs_median.begin(),xs_median.end(),comp_intersection); 
+
+        REQUIRE(xs_sah.size() == xs_median.size()); 
+        hits += (int)xs_sah.size(); 
+        for(int j = 0; j < xs_sah.size(); j++)
+        {
+            REQUIRE(xs_sah[j] == xs_median[j]); 
+        }
+    }
+    REQUIRE(hits > 0); 
+
+    delete_bvh(sah); 
+    delete_bvh(median); 
+
+    for(Shape* s: list)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Median builder splits untransformed triangles by their real centroids","[bvh]")
+{
+    //A row of triangles with identity transforms, each one unit apart along x
+    std::vector<Shape*> list; 
+    for(int i = 0; i < 8; i++)
+    {
+        list.push_back(new Triangle(Point(i,0,0),Point(i + 0.5,1,0),Point(i + 0.25,0,1))); 
+    }
+
+    REQUIRE(equal_double(shape_centroid(list[3]).x,3.25)); 
+
+    //Shuffle the order so the split has to come from the centroids
+    std::swap(list[0],list[7]); 
+    std::swap(list[2],list[5]); 
+
+    BVH* bvh = build_bvh(list,2); 
+
+    //The first child of the root follows it, offset points at the second
+    const BVHNode& root = bvh->nodes[0]; 
+    REQUIRE(!root.isLeaf()); 
+    REQUIRE(bvh->nodes[1].bounds().maximum.x <= 4 + 1e-6); 
+    REQUIRE(bvh->nodes[root.offset].bounds().minimum.x >= 4 - 1e-6); 
+
+    delete_bvh(bvh); 
+
+    for(Shape* s: list)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Flattened BVH layout","[bvh]")
+{
+    std::vector<Shape*> list; 
+    for(int i = 0; i < 25; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation(i * 0.1,(i % 3) * 1.7,(i % 7) * 0.3) * scaling(0.05,0.05,0.05)); 
+        list.push_back(s); 
+    }
+
+    BVH* bvh = build_bvh(list,BVHBuildSettings()); 
+
+    REQUIRE(sizeof(BVHNode) == 32); 
+    REQUIRE(bvh->primitives.size() == 25); 
+
+    //Depth-first order: every child comes after its parent, and each leaf owns its own range of primitives
+    std::vector<int> owner(bvh->primitives.size(),-1); 
+    for(int i = 0; i < bvh->nodes.size(); i++)
+    {
+        const BVHNode& node = bvh->nodes[i]; 
+        if(!node.isLeaf())
+        {
+            REQUIRE(node.offset > i + 1); 
+            REQUIRE(node.offset < bvh->nodes.size()); 
+            continue; 
+        }
+
+        for(int j = node.offset; j < node.offset + node.count; j++)
+        {
+            REQUIRE(owner[j] == -1); 
+            owner[j] = i; 
+
+            //The float bounds still contain the primitive
+            AABB box = bvh->primitives[j]->bounds().transform(bvh->primitives[j]->transform); 
+            AABB node_box = node.bounds(); 
+            REQUIRE(node_box.minimum.x <= box.minimum.x); 
+            REQUIRE(node_box.minimum.y <= box.minimum.y); 
+            REQUIRE(node_box.minimum.z <= box.minimum.z); 
+            REQUIRE(node_box.maximum.x >= box.maximum.x); 
+            REQUIRE(node_box.maximum.y >= box.maximum.y); 
+            REQUIRE(node_box.maximum.z >= box.maximum.z); 
+        }
+    }
+    REQUIRE(std::count(owner.begin(),owner.end(),-1) == 0); 
+
+    //An empty list gives a BVH without nodes that nothing can hit
+    std::vector<Shape*> empty; 
+    BVH* empty_bvh = build_bvh(empty,BVHBuildSettings()); 
+    REQUIRE(empty_bvh->nodes.empty()); 
+    REQUIRE(bvh_intersect(empty_bvh,Ray(Point(0,0,-5),Vector(0,0,1))).empty()); 
+
+    delete_bvh(bvh); 
+    delete_bvh(empty_bvh); 
+
+    for(Shape* s: list)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Closest hit traversal agrees with collecting every intersection","[bvh]")
+{
+    //A group of spheres and triangles, some of them behind the origin of the rays
+    Group* g = new Group(); 
+    for(int i = 0; i < 30; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation((i % 6) - 2.5,(i / 6) - 2.0,(i % 4) * 3.0 - 4.0) * scaling(0.4,0.4,0.4)); 
+        g->add_child(s); 
+    }
+    for(int i = 0; i < 10; i++)
+    {
+        g->add_child(new Triangle(Point(i - 5,-3,i),Point(i - 4,-3,i),Point(i - 4.5,3,i + 1))); 
+    }
+    g->setTransform(rotation_y(0.3)); 
+    g->refresh_bvh(); 
+
+    int hits = 0; 
+    for(int i = 0; i < 50; i++)
+    {
+        Ray r(Point(0,0,-1),Vector((i % 10) * 0.1 - 0.45,(i / 10) * 0.2 - 0.4,1)); 
+
+        std::vector<Intersection> xs = g->intersect(r); 
+        const Intersection* expected = find_hit(xs); 
+
+        Intersection hit(0,nullptr); 
+        bool found = g->intersect_closest(r,hit); 
+
+        REQUIRE(found == (expected != nullptr)); 
+        if(found)
+        {
+            hits++; 
+            REQUIRE(hit == *expected); 
+
+            //Nothing is found when the search stops in front of the nearest hit
+            Intersection none(0,nullptr); 
+            REQUIRE(!g->intersect_closest(r,none,hit.t)); 
+            REQUIRE(none.s == nullptr); 
+        }
+    }
+    REQUIRE(hits > 10); 
+
+    delete g; 
+}
+
+TEST_CASE("Occlusion queries stop at the given distance","[bvh]")
+{
+    Group* g = new Group(); 
+    Sphere* near = new Sphere(); 
+    Sphere* far = new Sphere(); 
+    near->setTransform(translation(0,0,5)); 
+    far->setTransform(translation(0,0,20)); 
+    g->add_child(near); 
+    g->add_child(far); 
+    g->refresh_bvh(); 
+
+    Ray r(Point(0,0,0),Vector(0,0,1)); 
+
+    //The near sphere starts at t = 4
+    REQUIRE(!bvh_occluded(g->bvh,r,3.9)); 
+    REQUIRE(bvh_occluded(g->bvh,r,4.1)); 
+    REQUIRE(g->intersect_any(r,100)); 
+
+    //Nothing behind the origin of the ray counts
+    Ray away(Point(0,0,0),Vector(0,0,-1)); 
+    REQUIRE(!bvh_occluded(g->bvh,away,100)); 
+    REQUIRE(!g->intersect_any(away,100)); 
+
+    delete g; 
+}
+
+TEST_CASE("Collapsing the binary tree into a 4-wide BVH","[bvh]")
+{
+    std::vector<Shape*> list; 
+    for(int i = 0; i < 60; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation((i % 5) * 1.1,((i / 5) % 4) * 1.3,(i / 20) * 2.0) * scaling(0.45,0.45,0.45)); 
+        list.push_back(s); 
+    }
+
+    BVHBuildSettings settings; 
+    settings.maxPrimsPerLeaf = 2; 
+    BVH* bvh = build_bvh(list,settings); 
+
+    REQUIRE(sizeof(BVH4Node) == 128); 
+    REQUIRE(!bvh->wide_nodes.empty()); 
+    REQUIRE(bvh->wide_nodes.size() < bvh->nodes.size()); 
+
+    //Every primitive is reachable through exactly one leaf lane of the wide tree
+    std::vector<int> seen(bvh->primitives.size(),0); 
+    for(const BVH4Node& node: bvh->wide_nodes)
+    {
+        REQUIRE(node.child_count >= 1); 
+        REQUIRE(node.child_count <= 4); 
+        for(int lane = 0; lane < node.child_count; lane++)
+        {
+            if(node.count[lane] == 0)
+            {
+                REQUIRE(node.child[lane] > 0); 
+                REQUIRE(node.child[lane] < bvh->wide_nodes.size()); 
+                continue; 
+            }
+            for(int i = node.child[lane]; i < node.child[lane] + node.count[lane]; i++)
+            {
+                seen[i]++; 
+            }
+        }
+    }
+    REQUIRE(std::count(seen.begin(),seen.end(),1) == 60); 
+
+    //All three queries agree with testing every sphere
+    for(int i = 0; i < 40; i++)
+    {
+        Ray r(Point(-3 + i * 0.05,-2,-6),Vector(0.5 + (i % 7) * 0.1,0.4 + (i % 3) * 0.15,1)); 
+
+        std::vector<Intersection> expected; 
+        for(Shape* s: list)
+        {
+            s->intersect_into(r,expected); 
+        }
+        std::vector<Intersection> xs = bvh_intersect(bvh,r); 
+        REQUIRE(xs.size() == expected.size()); 
+
+        const Intersection* nearest = find_hit(expected); 
+        Intersection hit(0,nullptr); 
+        REQUIRE(bvh_intersect_closest(bvh,r,hit) == (nearest != nullptr)); 
+        if(nearest != nullptr)
+        {
+            REQUIRE(hit == *nearest); 
+            REQUIRE(bvh_occluded(bvh,r,nearest->t + 0.001)); 
+            REQUIRE(!bvh_occluded(bvh,r,nearest->t - 0.001)); 
+        }
+    }
+
+    delete_bvh(bvh); 
+
+    for(Shape* s: list)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Parallel builds find the same intersections as serial ones","[bvh]")
+{
+    std::vector<Shape*> list = triangle_grid(400); 
+
+    for(BVH_BUILDER builder: {BVH_BUILDER::SAH,BVH_BUILDER::MEDIAN})
+    {
+        BVHBuildSettings serial; 
+        serial.builder = builder; 
+        serial.parallel_threshold = 1000000; 
+
+        //Split the top levels of even this small list
+        BVHBuildSettings parallel = serial; 
+        parallel.parallel_threshold = 16; 
+
+        BVH* a = build_bvh(list,serial); 
+        BVH* b = build_bvh(list,parallel); 
+
+        REQUIRE(count_bvh(b) == 400); 
+        REQUIRE(largest_leaf(b) <= parallel.maxPrimsPerLeaf); 
+
+        //The spliced tree is still in depth-first order
+        for(int i = 0; i < b->nodes.size(); i++)
+        {
+            if(!b->nodes[i].isLeaf())
+                REQUIRE(b->nodes[i].offset > i + 1); 
+        }
+
+        require_same_intersections(a,b,comp_intersection); 
+
+        delete_bvh(a); 
+        delete_bvh(b); 
+    }
+
+    for(Shape* s: list)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("LBVH builder finds the same intersections as the SAH builder","[bvh]")
+{
+    std::vector<Shape*> list = triangle_grid(400); 
+
+    //Copies of one triangle share a Morton code and have to be split without one
+    for(int i = 0; i < 40; i++)
+    {
+        list.push_back(new Triangle(Point(3,3,-1),Point(3.4,3,-1),Point(3.2,3.4,-1))); 
+    }
+
+    BVHBuildSettings sah; 
+    BVH* reference = build_bvh(list,sah); 
+
+    for(bool refine: {false,true})
+    {
+        BVHBuildSettings settings; 
+        settings.builder = BVH_BUILDER::LBVH; 
+        settings.lbvh_refine = refine; 
+        settings.parallel_threshold = 16; 
+        BVH* bvh = build_bvh(list,settings); 
+
+        REQUIRE(count_bvh(bvh) == 440); 
+        REQUIRE(largest_leaf(bvh) <= settings.maxPrimsPerLeaf); 
+
+        //Depth-first order, and every interior node bounds both of its children
+        for(int i = 0; i < bvh->nodes.size(); i++)
+        {
+            const BVHNode& node = bvh->nodes[i]; 
+            if(node.isLeaf())
+                continue; 
+
+            REQUIRE(node.offset > i + 1); 
+            for(int child: {i + 1,node.offset})
+            {
+                for(int axis = 0; axis < 3; axis++)
+                {
+                    REQUIRE(node.bbox_min[axis] <= bvh->nodes[child].bbox_min[axis]); 
+                    REQUIRE(node.bbox_max[axis] >= bvh->nodes[child].bbox_max[axis]); 
+                }
+            }
+        }
+
+        //The copies are hit at the same t, so order them by shape too
+        auto by_t_and_shape = [](const Intersection& a, const Intersection& b)
+        {
+            return a.t < b.t || (a.t == b.t && a.s < b.s); 
+        }; 
+        require_same_intersections(reference,bvh,by_t_and_shape); 
+
+        delete_bvh(bvh); 
+    }
+
+    delete_bvh(reference); 
+    for(Shape* s: list)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Inserting shapes into a built BVH","[bvh]")
+{
+    std::vector<Shape*> list = triangle_grid(200); 
+
+    //Build over the first half, then insert the second one by one, starting from an empty BVH works too
+    for(int built: {100,0})
+    {
+        std::vector<Shape*> first(list.begin(),list.begin() + built); 
+        BVH* bvh = build_bvh(first,BVHBuildSettings()); 
+        for(int i = built; i < 200; i++)
+        {
+            REQUIRE(bvh_insert(bvh,list[i])); 
+        }
+        BVH* reference = build_bvh(list,BVHBuildSettings()); 
+
+        REQUIRE(count_bvh(bvh) == 200); 
+        for(int i = 0; i < bvh->nodes.size(); i++)
+        {
+            const BVHNode& node = bvh->nodes[i]; 
+            if(node.isLeaf())
+                continue; 
+
+            REQUIRE(node.offset > i + 1); 
+            for(int child: {i + 1,node.offset})
+            {
+                for(int axis = 0; axis < 3; axis++)
+                {
+                    REQUIRE(node.bbox_min[axis] <= bvh->nodes[child].bbox_min[axis]); 
+                    REQUIRE(node.bbox_max[axis] >= bvh->nodes[child].bbox_max[axis]); 
+                }
+            }
+        }
+
+        require_same_intersections(reference,bvh,comp_intersection); 
+        for(int i = 0; i < 100; i++)
+        {
+            Intersection hit(0,nullptr); 
+            REQUIRE(bvh_intersect_closest(bvh,grid_ray(i),hit) == !bvh_intersect(reference,grid_ray(i)).empty()); 
+        }
+
+        delete_bvh(bvh); 
+        delete_bvh(reference); 
+    }
+
+    for(Shape* s: list)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Refitting a BVH after its shapes move","[bvh][group]")
+{
+    Group* g = new Group(); 
+    std::vector<Sphere*> spheres; 
+    for(int i = 0; i < 64; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation((i % 8) * 3,(i / 8) * 3,0)); 
+        g->add_child(s); 
+        spheres.push_back(s); 
+    }
+    g->refresh_bvh(); 
+    std::vector<BVHNode> before = g->bvh->nodes; 
+
+    //A few spheres move a little, the topology stays and the nodes follow them
+    for(int i = 0; i < 64; i += 9)
+    {
+        spheres[i]->setTransform(translation((i % 8) * 3 + 0.5,(i / 8) * 3,2)); 
+    }
+    double ratio = refit_bvh(g->bvh); 
+    REQUIRE(ratio > 1.0); 
+    REQUIRE(ratio < 1.5); 
+    REQUIRE(g->bvh->nodes.size() == before.size()); 
+    for(int i = 0; i < before.size(); i++)
+    {
+        REQUIRE(g->bvh->nodes[i].offset == before[i].offset); 
+        REQUIRE(g->bvh->nodes[i].count == before[i].count); 
+    }
+
+    BVH* reference = build_bvh(g->children,BVHBuildSettings()); 
+    for(int i = 0; i < 64; i++)
+    {
+        Ray r(Point((i % 8) * 3 + 0.6,(i / 8) * 3 + 0.1,-5),Vector(0,0,1)); 
+        std::vector<Intersection> xs_a = bvh_intersect(reference,r); 
+        std::vector<Intersection> xs_b = bvh_intersect(g->bvh,r); 
+        std::sort(xs_a.begin(),xs_a.end(),comp_intersection); 
+        std::sort(xs_b.begin(),xs_b.end(),comp_intersection); 
+
+        REQUIRE(xs_a.size() == xs_b.size()); 
+        for(int j = 0; j < xs_a.size(); j++)
+        {
+            REQUIRE(xs_a[j] == xs_b[j]); 
+        }
+    }
+    delete_bvh(reference); 
+
+    //Scattering them makes the old topology much worse than a new build, which the quality check replaces
+    for(int i = 0; i < 64; i++)
+    {
+        spheres[i]->setTransform(translation((i * 37 % 64) * 3,0,(i * 11 % 64) * 3)); 
+    }
+    BVH* old = g->bvh; 
+    g->refit_bvh(0); 
+    REQUIRE(g->bvh == old); 
+    REQUIRE(refit_bvh(g->bvh) > 2.0); 
+
+    //A fresh build is its own reference
+    g->refit_bvh(2.0); 
+    REQUIRE(refit_bvh(g->bvh) == 1.0); 
+
+    delete g; 
+}
+
+TEST_CASE("BVH leaves test primitives by their type","[bvh]")
+{
+    std::vector<Shape*> shapes; 
+    for(int i = 0; i < 6; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation(i * 2.5,0,0) * scaling(0.8,0.8,0.8)); 
+        shapes.push_back(s); 
+
+        Cube* c = new Cube(); 
+        c->setTransform(translation(i * 2.5,2.5,0) * rotation_y(0.3 * i) * scaling(0.6,0.6,0.6)); 
+        shapes.push_back(c); 
+
+        Cylinder* cyl = new Cylinder(-0.5,0.5,CYL_TYPE::CLOSED); 
+        cyl->setTransform(translation(i * 2.5,-2.5,0) * rotation_x(0.4 * i)); 
+        shapes.push_back(cyl); 
+
+        shapes.push_back(new Triangle(Point(i * 2.5 - 1,4,-1),Point(i * 2.5 + 1,4,-1),Point(i * 2.5,5.5,0))); 
+        shapes.push_back(new SmoothTriangle(Point(i * 2.5 - 1,-4,-1),Point(i * 2.5 + 1,-4,-1),Point(i * 2.5,-5.5,0),Vector(0,0,-1),Vector(0,0.3,-1),Vector(0.3,0,-1))); 
+    }
+
+    //A transformed triangle and a plane have no kernel
+    Triangle* moved = new Triangle(Point(-1,0,0),Point(1,0,0),Point(0,1,0)); 
+    moved->setTransform(translation(5,7,0)); 
+    shapes.push_back(moved); 
+    Plane* plane = new Plane(); 
+    plane->setTransform(translation(0,0,3) * rotation_x(M_PI / 2)); 
+    shapes.push_back(plane); 
+
+    BVH* bvh = build_bvh(shapes,BVHBuildSettings()); 
+    REQUIRE(bvh->tags.size() == bvh->primitives.size()); 
+    REQUIRE(bvh->triangles.size() == 12); 
+    for(int i = 0; i < bvh->primitives.size(); i++)
+    {
+        const Shape* s = bvh->primitives[i]; 
+        SHAPE_TYPE expected = s->shape_type == SHAPE_TYPE::SMOOTH_TRIANGLE ? SHAPE_TYPE::TRIANGLE : s->shape_type; 
+        if(s == moved)
+            expected = SHAPE_TYPE::OTHER; 
+        REQUIRE(bvh->tags[i].type == expected); 
+    }
+
+    //The kernels find what the shapes' own virtual methods find
+    require_queries_match(300,
+        [](int k)
+        {
+            Point origin(-3 + 0.07 * k,8 * sin(1.7 * k),-6); 
+            return Ray(origin,(Point(6.1 + 7 * sin(0.9 * k),7.1 * cos(1.3 * k),0.5 * sin(2.3 * k)) - origin).normalize()); 
+        },
+        [&](const Ray& r, std::vector<Intersection>& xs)
+        {
+            for(Shape* s: shapes)
+            {
+                s->intersect_into(r,xs); 
+            }
+        },
+        [&](const Ray& r) {return bvh_intersect(bvh,r);},
+        [&](const Ray& r, Intersection& hit) {return bvh_intersect_closest(bvh,r,hit);},
+        [&](const Ray& r, double t_max) {return bvh_occluded(bvh,r,t_max);},
+        [](const Ray& r, const Intersection& hit, const Intersection& nearest)
+        {
+            REQUIRE(hit.t == nearest.t); 
+            REQUIRE(hit.s == nearest.s); 
+            REQUIRE(hit.u == nearest.u); 
+            REQUIRE(hit.v == nearest.v); 
+        }); 
+
+    //Refitting picks up triangles that were moved by baking a transform into them
+    Triangle* first = static_cast<Triangle*>(shapes[3]); 
+    first->bake_transform(translation(0,0,2)); 
+    refit_bvh(bvh); 
+    Ray r(Point(0,4.5,-5),Vector(0,0,1)); 
+    Intersection hit(0,nullptr); 
+    REQUIRE(bvh_intersect_closest(bvh,r,hit)); 
+    REQUIRE(hit.s == first); 
+    REQUIRE(equal_double(hit.t,4 + 2 + 0.5 / 1.5)); 
+
+    delete_bvh(bvh); 
+    for(Shape* s: shapes)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Refitting a BVH picks up an edited triangle","[bvh]")
+{
+    Triangle* t = new Triangle(Point(0,1,0),Point(-1,0,0),Point(1,0,0)); 
+    std::vector<Shape*> shapes = {t}; 
+    BVH* bvh = build_bvh(shapes,BVHBuildSettings()); 
+    REQUIRE(bvh->tags[0].type == SHAPE_TYPE::TRIANGLE); 
+
+    Ray r(Point(0,0.5,-2),Vector(0,0,1)); 
+    Intersection hit(0,nullptr); 
+    REQUIRE(bvh_intersect_closest(bvh,r,hit)); 
+    REQUIRE(equal_double(hit.t,2)); 
+
+    //Moved along the ray, the copy the leaves test only follows once the BVH is refitted
+    t->setTransform(translation(0,0,3)); 
+    refit_bvh(bvh); 
+    REQUIRE(bvh->tags[0].type == SHAPE_TYPE::OTHER); 
+    REQUIRE(bvh_intersect_closest(bvh,r,hit)); 
+    REQUIRE(equal_double(hit.t,5)); 
+
+    delete_bvh(bvh); 
+    delete t; 
+}
@@ -102,7 +102,7 @@ TEST_CASE("Patterns and transformations","[pattern]")
     SECTION("Stripes with an object transformation","[pattern]")
     {
         Sphere s; 
-        s.transform = scaling(2,2,2); 
+        s.setTransform(scaling(2,2,2)); 
         StripePattern pattern(Color(1,1,1),Color(0,0,0)); 
         Color c = pattern.color_at_object(&s,Point(1.5,0,0)); 
 
@@ -112,7 +112,7 @@ TEST_CASE("Patterns and transformations","[pattern]")
     {
         Sphere s; 
         StripePattern pattern(Color(1,1,1),Color(0,0,0)); 
-        pattern.transform = scaling(2,2,2); 
+        pattern.setTransform(scaling(2,2,2)); 
         Color c = pattern.color_at_object(&s,Point(1.5,0,0)); 
 
         REQUIRE(c == Color(1,1,1)); 
@@ -120,9 +120,9 @@ TEST_CASE("Patterns and transformations","[pattern]")
     SECTION("Stripes with both an object and a pattern transformation")
     {
         Sphere s; 
-        s.transform = scaling(2,2,2); 
+        s.setTransform(scaling(2,2,2)); 
         StripePattern pattern(Color(1,1,1),Color(0,0,0)); 
-        pattern.transform = translation(0.5,0,0); 
+        pattern.setTransform(translation(0.5,0,0)); 
         Color c = pattern.color_at_object(&s,Point(2.5,0,0)); 
 
         REQUIRE(c == Color(1,1,1)); 
@@ -275,7 +275,7 @@ TEST_CASE("shade_hit() is given an intersection in shadow","[lighting][world]")
     World w;
     w.world_light = pointLight(Color(1,1,1),Point(0,0,-10)); 
     
-    w.world_objects[1]->transform = translation(0,0,10); 
+    w.world_objects[1]->setTransform(translation(0,0,10)); 
 
     Ray r(Point(0,0,5),Vector(0,0,1)); 
     Intersection I(4,w.world_objects[1]); 
@@ -291,7 +291,7 @@ TEST_CASE("The hit should offset the point","[lighting]")
 {
     Ray r(Point(0,0,-5),Vector(0,0,1)); 
     Sphere s; 
-    s.transform = translation(0,0,1); 
+    s.setTransform(translation(0,0,1)); 
     Intersection I(5,&s); 
 
     Computations comps(I,r); 
@@ -300,6 +300,32 @@ TEST_CASE("The hit should offset the point","[lighting]")
     REQUIRE(comps.point.z > comps.over_point.z);
 }
 
+TEST_CASE("The hit offset follows the scale of the scene","[lighting]")
+{
+    SECTION("A scene modeled in millimeters is offset by less than its details")
+    {
+        Ray r(Point(0,0,-0.005),Vector(0,0,1)); 
+        Sphere s; 
+        s.setTransform(scaling(0.001,0.001,0.001)); 
+        Intersection I(0.004,&s); 
+
+        Computations comps(I,r); 
+        REQUIRE(comps.over_point.z < comps.point.z); 
+        REQUIRE(comps.point.z - comps.over_point.z < 0.0001); 
+    }
+    SECTION("A hit far from the origin is offset by more than its round off")
+    {
+        Ray r(Point(1e7,0,-5),Vector(0,0,1)); 
+        Sphere s; 
+        s.setTransform(translation(1e7,0,1)); 
+        Intersection I(5,&s); 
+
+        Computations comps(I,r); 
+        REQUIRE(comps.over_point.z < -BUMP_EPSILON); 
+        REQUIRE(comps.under_point.z > BUMP_EPSILON); 
+    }
+}
+
 TEST_CASE("Reflective surfaces","[lighting]")
 {
     World w; 
@@ -318,7 +344,7 @@ TEST_CASE("Reflective surfaces","[lighting]")
     {
         Plane* shape = new Plane(); 
         shape->mat.reflective = 0.5; 
-        shape->transform = translation(0,-1,0); 
+        shape->setTransform(translation(0,-1,0)); 
         w.add_object(shape); 
 
         Ray r(Point(0,0,-3),Vector(0,-sqrt(2)/2.f,sqrt(2)/2.f)); 
@@ -338,7 +364,7 @@ TEST_CASE("shade_hit() with a reflective material","[lighting]")
     World w; 
     Plane* shape = new Plane();
     shape->mat.reflective = 0.5; 
-    shape->transform = translation(0,-1,0); 
+    shape->setTransform(translation(0,-1,0)); 
     w.add_object(shape); 
 
     Ray r(Point(0,0,-3),Vector(0,-sqrt(2)/2.f,sqrt(2)/2.f)); 
@@ -398,7 +424,7 @@ TEST_CASE("The reflected color at the maximum recursive depth","[lighting]")
     World w; 
     Plane* shape = new Plane();
     shape->mat.reflective = 0.5; 
-    shape->transform = translation(0,-1,0); 
+    shape->setTransform(translation(0,-1,0)); 
     w.add_object(shape); 
 
     Ray r(Point(0,0,-3),Vector(0,-sqrt(2)/2.f,sqrt(2)/2.f)); 
@@ -423,15 +449,15 @@ TEST_CASE("Finding n1 and n2 at various intersections","[materials][refraction]"
     std::vector<double> n2s = {1.5,2.0,2.5,2.5,1.5,1.0}; 
 
     Sphere* A = glass_sphere(); 
-    A->transform = scaling(2,2,2); 
+    A->setTransform(scaling(2,2,2)); 
     A->mat.refractive_index = 1.5; 
 
     Sphere* B = glass_sphere(); 
-    B->transform = translation(0,0,-0.25); 
+    B->setTransform(translation(0,0,-0.25)); 
     B->mat.refractive_index = 2; 
 
     Sphere* C = glass_sphere(); 
-    C->transform = translation(0,0,0.25); 
+    C->setTransform(translation(0,0,0.25)); 
     C->mat.refractive_index = 2.5;
     
     Ray r(Point(0,0,-4),Vector(0,0,1)); 
@@ -447,11 +473,38 @@ TEST_CASE("Finding n1 and n2 at various intersections","[materials][refraction]"
     }
 }
 
+TEST_CASE("Hits on a translated glass cube always know their refractive indices","[refraction]")
+{
+    World w; 
+    w.empty_objects(); 
+
+    Cube* cube = new Cube(); 
+    cube->setTransform(translation(2,3,5)); 
+    cube->mat.transparency = 1.0; 
+    cube->mat.refractive_index = 1.5; 
+    w.add_object(cube); 
+
+    //The face lies exactly on the BVH's box, so rays along an axis enter the box within round off of the hit
+    for(int i = 0; i < 40; i++)
+    {
+        for(int j = 0; j < 40; j++)
+        {
+            Ray r(Point(1.1 + 0.047 * i,2.1 + 0.047 * j,-2.3 - 0.0137 * (40 * i + j)),Vector(0,0,1)); 
+            Intersection hit(0,nullptr); 
+            REQUIRE(w.intersect_closest(r,hit)); 
+
+            Computations comps = w.prepare_computations(hit,r); 
+            REQUIRE(comps.n1 == 1.0); 
+            REQUIRE(comps.n2 == 1.5); 
+        }
+    }
+}
+
 TEST_CASE("The under point is offset below the surface","[refraction]")
 {
     Ray r(Point(0,0,-5),Vector(0,0,1)); 
     Sphere* shape = glass_sphere();
-    shape->transform = translation(0,0,1); 
+    shape->setTransform(translation(0,0,1)); 
     Intersection I(5,shape); 
     std::vector<Intersection> xs = intersections({I}); 
 
@@ -532,14 +585,14 @@ TEST_CASE("shade_hit() with a transparent material","[material][refraction]")
     w.empty_objects(); 
 
     Plane* floor = new Plane(); 
-    floor->transform = translation(0,-1,0); 
+    floor->setTransform(translation(0,-1,0)); 
     floor->mat.transparency = 0.5; 
     floor->mat.refractive_index = 1.5; 
 
     Sphere* ball = new Sphere(); 
     ball->mat.mat_color = Color(1,0,0); 
     ball->mat.ambient = 0.5; 
-    ball->transform = translation(0,-3.5,-0.5); 
+    ball->setTransform(translation(0,-3.5,-0.5)); 
 
     w.add_object(floor); 
     w.add_object(ball); 
@@ -558,7 +611,7 @@ TEST_CASE("shade_hit() with a reflective, transparent material","[refraction]")
     w.empty_objects(); 
     Ray r(Point(0,0,-3),Vector(0,-sqrt(2)/2.0,sqrt(2)/2.0)); 
     Plane* floor = new Plane(); 
-    floor->transform = translation(0,-1,0); 
+    floor->setTransform(translation(0,-1,0)); 
     floor->mat.reflective = 0.5; 
     floor->mat.transparency = 0.5; 
     floor->mat.refractive_index = 1.5; 
@@ -567,7 +620,7 @@ TEST_CASE("shade_hit() with a reflective, transparent material","[refraction]")
     Sphere* ball = new Sphere(); 
     ball->mat.mat_color = Color(1,0,0); 
     ball->mat.ambient = 0.5; 
-    ball->transform = translation(0,-3.5,-0.5); 
+    ball->setTransform(translation(0,-3.5,-0.5)); 
     w.add_object(ball); 
     std::vector<Intersection> xs = intersections({Intersection(sqrt(2),floor)}); 
     Computations comps(xs[0],r,xs); 
@@ -580,3 +633,24 @@ TEST_CASE("shade_hit() with a reflective, transparent material","[refraction]")
     REQUIRE(color == Color(0.722881, 0.483398,0.483398)); 
 }
 
+TEST_CASE("Shading a hit on a particle uses the particle's material","[particles][material]")
+{
+    World w; 
+    w.empty_objects(); 
+
+    ParticleSet* set = new ParticleSet(); 
+    set->mat.mat_color = Color(0,0,1); 
+    int red = set->add_material(set->mat); 
+    set->materials[red].mat_color = Color(1,0,0); 
+    set->add_particle(Point(-2,0,0),1,red); 
+    set->add_particle(Point(2,0,0),1); 
+    set->refresh_bvh(); 
+    w.add_object(set); 
+
+    Color left = w.color_at(Ray(Point(-2,0,-5),Vector(0,0,1)),5); 
+    Color right = w.color_at(Ray(Point(2,0,-5),Vector(0,0,1)),5); 
+
+    REQUIRE(left.x > left.z + 0.1); 
+    REQUIRE(right.z > right.x + 0.1); 
+}
+
@@ -305,4 +305,133 @@ TEST_CASE("MatrixInverseProductIsIdentity","[matrix]")
     identity.setIdentity(); 
 
     REQUIRE(I == identity); 
-}
\ No newline at end of file
+}
+
+TEST_CASE("Matrix4 is a fixed-size constexpr type","[matrix]")
+{
+    static_assert(sizeof(Matrix4) == 16 * sizeof(double), "Matrix4 must store its elements in place"); 
+
+    constexpr Matrix4 A({
+        1,2,3,4,
+        5,6,7,8,
+        9,8,7,6,
+        5,4,3,2}); 
+    constexpr Matrix4 I; 
+    constexpr Matrix4 B = A * I; 
+    static_assert(B.getElement(2,1) == 8, "constexpr product should be evaluated at compile time"); 
+
+    REQUIRE(B == A); 
+    REQUIRE(I.getElement(3,3) == 1); 
+    REQUIRE(I.getElement(0,3) == 0); 
+}
+
+TEST_CASE("Matrix4 agrees with Matrix","[matrix]")
+{
+    std::vector<double> dataA = {-5,2,6,-8,1,-5,1,8,7,7,-6,-7,1,-3,7,4};
+    Matrix A(4,4,dataA); 
+    Matrix4 A4({-5,2,6,-8,1,-5,1,8,7,7,-6,-7,1,-3,7,4}); 
+
+    REQUIRE(A4.determinant() == A.determinant()); 
+    REQUIRE(A4.cofactor(2,3) == A.cofactor(2,3)); 
+
+    Matrix inv = A.inverse(); 
+    Matrix4 inv4 = A4.inverse(); 
+    for(int i = 0; i < 4; i++)
+    {
+        for(int j = 0; j < 4; j++)
+        {
+            REQUIRE(equal_double(inv4.getElement(i,j),inv.getElement(i,j))); 
+        }
+    }
+
+    Matrix4 T = A4; 
+    T.transpose(); 
+    REQUIRE(T.getElement(0,1) == A4.getElement(1,0)); 
+    REQUIRE(T.getElement(3,2) == A4.getElement(2,3)); 
+}
+
+TEST_CASE("Matrix4 closed form inverse","[matrix]")
+{
+    SECTION("General matrices")
+    {
+        Matrix4 A({
+            8,-5,9,2,
+            7,5,6,1,
+            -6,0,9,6,
+            -3,0,-9,-4}); 
+
+        REQUIRE(A.determinant() == -585); 
+
+        Matrix4 B; 
+        REQUIRE(A.invert(B)); 
+
+        Matrix4 desired({
+            -0.15385,-0.15385,-0.28205,-0.53846,
+            -0.07692,0.12308,0.02564,0.03077,
+            0.35897,0.35897,0.43590,0.92308,
+            -0.69231,-0.69231,-0.76923,-1.92308}); 
+
+        REQUIRE(B == desired); 
+        REQUIRE(A * B == Matrix4()); 
+    }
+
+    SECTION("Affine matrices take the fast path")
+    {
+        Matrix4 A({
+            2,0,1,4,
+            1,3,0,-2,
+            0,1,5,7,
+            0,0,0,1}); 
+
+        REQUIRE(A.is_affine()); 
+
+        Matrix4 B; 
+        REQUIRE(A.invert(B)); 
+        REQUIRE(A * B == Matrix4()); 
+        REQUIRE(B * A == Matrix4()); 
+        REQUIRE(B.is_affine()); 
+    }
+
+    SECTION("Singular matrices are reported without throwing")
+    {
+        Matrix4 A({
+            -4,2,-2,-3,
+            9,6,2,6,
+            0,-5,1,-5,
+            0,0,0,0}); 
+
+        REQUIRE(A.determinant() == 0); 
+
+        Matrix4 B({
+            1,2,3,4,
+            5,6,7,8,
+            9,10,11,12,
+            13,14,15,16}); 
+
+        Matrix4 result; 
+        Matrix4 untouched = result; 
+        REQUIRE(!A.invert(result)); 
+        REQUIRE(!B.invert(result)); 
+        REQUIRE(result == untouched); 
+
+        //The first two rows are parallel up to round off
+        Matrix4 flat({
+            1,1,0,0,
+            1,1 + 1e-14,0,0,
+            0,0,1,0,
+            0,0,0,1}); 
+
+        REQUIRE(!flat.invert(result)); 
+        REQUIRE(flat.invert(result,0.0)); 
+    }
+
+    SECTION("Tiny scales are not singular")
+    {
+        Matrix4 A = scaling(1e-4,1e-4,1e-4); 
+        Matrix4 B; 
+        REQUIRE(A.invert(B)); 
+        REQUIRE(B == scaling(1e4,1e4,1e4)); 
+        REQUIRE_NOTHROW(scaling(1e-6,1e-6,1e-6).inverse()); 
+        REQUIRE_NOTHROW((translation(5,0,0) * scaling(1e-5,2e-5,1e-5) * rotation_x(0.3)).inverse()); 
+    }
+}
@@ -2,6 +2,19 @@
 #include "parser.h"
 #include "shapes.h"
 
+#include <filesystem>
+#include <fstream>
+#include <cstdio>
+
+// Writes text to a file in the temporary directory and returns its path, so tests do not depend on model files
+static std::string write_obj(const std::string& name, const std::string& text)
+{
+    std::string file_name = (std::filesystem::temp_directory_path() / name).string(); 
+    std::ofstream file(file_name); 
+    file << text; 
+    return file_name; 
+}
+
 TEST_CASE("Vertex loading","[parser]")
 {
     Parser p("C:/Users/avery/OneDrive/Desktop/RayTracer/models/vertex_test.obj"); 
@@ -83,3 +96,57 @@ TEST_CASE("Faces with normals")
     REQUIRE(t1->n3 == p.normals[1]); 
 
 }
+
+TEST_CASE("Reading a file into a triangle mesh","[parser]")
+{
+    std::string file_name = write_obj("convex_poly_mesh.obj",
+        "v -1 1 0\n"
+        "v -1 0 0\n"
+        "v 1 0 0\n"
+        "v 1 1 0\n"
+        "v 0 2 0\n"
+        "f 1 2 3 4 5\n"); 
+    Parser p(file_name); 
+    TriangleMesh* mesh = p.read_mesh(); 
+
+    //The same fan as read_file, as indices into the mesh's own vertices
+    REQUIRE(mesh->triangle_count() == 3); 
+    REQUIRE(mesh->vertices.size() == 5); 
+    REQUIRE(mesh->vertices[4] == Point(0,2,0)); 
+    REQUIRE(mesh->indices == std::vector<int>({0,1,2, 0,2,3, 0,3,4})); 
+    REQUIRE(mesh->normal_indices.empty()); 
+    REQUIRE(p.vertices.empty()); 
+
+    delete mesh; 
+    std::remove(file_name.c_str()); 
+}
+
+TEST_CASE("Blank lines between records add nothing","[parser]")
+{
+    //A blank line used to repeat the record before it
+    std::string file_name = write_obj("blank_lines.obj",
+        "v -1 1 0\n"
+        "\n"
+        "v -1 0 0\n"
+        "\n"
+        "\n"
+        "v 1 0 0\n"
+        "\n"
+        "f 1 2 3\n"
+        "\n"); 
+
+    Parser p(file_name); 
+    p.read_file(); 
+    REQUIRE(p.vertices.size() == 3); 
+    REQUIRE(p.vertices[1] == Point(-1,0,0)); 
+    REQUIRE(p.vertices[2] == Point(1,0,0)); 
+    REQUIRE(p.default_group->children.size() == 1); 
+
+    Parser mesh_parser(file_name); 
+    TriangleMesh* mesh = mesh_parser.read_mesh(); 
+    REQUIRE(mesh->vertices.size() == 3); 
+    REQUIRE(mesh->indices == std::vector<int>({0,1,2})); 
+
+    delete mesh; 
+    std::remove(file_name.c_str()); 
+}
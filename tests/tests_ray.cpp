@@ -178,7 +178,7 @@ TEST_CASE("Ray transforms","[ray]")
     Ray r(Point(1.f,2.f,3.f),Vector(0.f,1.f,0.f)); 
     SECTION("Ray translation")
     {
-        Matrix m = translation(3,4,5); 
+        Matrix4 m = translation(3,4,5); 
         Ray r2 = r.ray_transform(m); 
 
         REQUIRE(r2.origin == Point(4,6,8)); 
@@ -187,7 +187,7 @@ TEST_CASE("Ray transforms","[ray]")
 
     SECTION("Ray translation")
     {
-        Matrix m = scaling(2,3,4); 
+        Matrix4 m = scaling(2,3,4); 
         Ray r2 = r.ray_transform(m); 
 
         REQUIRE(r2.origin == Point(2,6,12)); 
@@ -195,3 +195,47 @@ TEST_CASE("Ray transforms","[ray]")
     }
 }
 
+
+TEST_CASE("A ray precomputes its reciprocal direction","[ray]")
+{
+    Ray r(Point(1,2,3),Vector(2,-4,0)); 
+
+    REQUIRE(r.inv_direction.x == 0.5); 
+    REQUIRE(r.inv_direction.y == -0.25); 
+    REQUIRE(std::isinf(r.inv_direction.z)); 
+    REQUIRE(r.sign[0] == 0); 
+    REQUIRE(r.sign[1] == 1); 
+    REQUIRE(r.sign[2] == 0); 
+
+    //Transforming a ray recomputes them
+    Ray r2 = r.ray_transform(scaling(-1,2,1)); 
+    REQUIRE(r2.direction == Vector(-2,-8,0)); 
+    REQUIRE(r2.inv_direction.x == -0.5); 
+    REQUIRE(r2.inv_direction.y == -0.125); 
+    REQUIRE(r2.sign[0] == 1); 
+    REQUIRE(r2.sign[1] == 1); 
+}
+
+TEST_CASE("Slab tests with zero direction components","[ray]")
+{
+    AABB box(Point(-1,-1,-1),Point(1,1,1)); 
+
+    //Parallel to two axes, inside and outside the slabs of those axes
+    REQUIRE(box.check_intersect(Ray(Point(0.5,0.5,-5),Vector(0,0,1)))); 
+    REQUIRE(!box.check_intersect(Ray(Point(1.5,0.5,-5),Vector(0,0,1)))); 
+    REQUIRE(!box.check_intersect(Ray(Point(0.5,-1.5,-5),Vector(0,0,-1)))); 
+
+    //A negative zero must behave like a positive one
+    REQUIRE(box.check_intersect(Ray(Point(0.5,0.5,-5),Vector(-0.0,-0.0,1)))); 
+    REQUIRE(!box.check_intersect(Ray(Point(1.5,0.5,-5),Vector(-0.0,0,1)))); 
+
+    //A ray lying in a face of the box still touches it
+    REQUIRE(box.check_intersect(Ray(Point(1,0,-5),Vector(0,0,1)))); 
+
+    //The cube uses the same test
+    Cube c; 
+    std::vector<Intersection> xs = c.local_intersect(Ray(Point(0.5,0.5,-5),Vector(-0.0,0,1))); 
+    REQUIRE(xs.size() == 2); 
+    REQUIRE(xs[0].t == 4); 
+    REQUIRE(xs[1].t == 6); 
+}
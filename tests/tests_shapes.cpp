@@ -12,6 +12,7 @@
 #include "shapes.h"
 #include "materials.h"
 #include "intersection.h"
+#include "test_helpers.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -23,7 +24,7 @@
 TEST_CASE("Creating a sphere","[sphere][shape]")
 {
     Sphere s;
-    Matrix I(4,4); 
+    Matrix4 I; 
     I.setIdentity(); 
     REQUIRE(s.getTransform() == I); 
 
@@ -34,7 +35,7 @@ TEST_CASE("Creating a sphere","[sphere][shape]")
 TEST_CASE("Sphere default transform","[sphere][shape]")
 {
     Sphere s;
-    Matrix m(4,4); 
+    Matrix4 m; 
     m.setIdentity(); 
     REQUIRE(s.getTransform() == m); 
 }
@@ -42,10 +43,25 @@ TEST_CASE("Sphere default transform","[sphere][shape]")
 TEST_CASE("Changing a sphere's transform","[sphere][shape]")
 {
     Sphere s;
-    Matrix t = translation(2,3,4); 
+    Matrix4 t = translation(2,3,4); 
     s.setTransform(t); 
 }
 
+TEST_CASE("Setting a transform caches its inverse","[sphere][shape]")
+{
+    Sphere s; 
+    Matrix4 t = scaling(1,0.5,1) * rotation_z(M_PI/5.f) * translation(2,3,4); 
+    s.setTransform(t); 
+
+    Matrix4 inv = t.inverse(); 
+    Matrix4 inv_t = inv; 
+    inv_t.transpose(); 
+
+    REQUIRE(s.transform == t); 
+    REQUIRE(s.inverse_transform == inv); 
+    REQUIRE(s.normal_transform == inv_t); 
+}
+
 TEST_CASE("Intersecting a scaled sphere with a ray","[sphere][shape]")
 {
     Ray r(Point(0,0,-5),Vector(0,0,1)); 
@@ -113,7 +129,7 @@ TEST_CASE("Normal on transformed sphere","[sphere][shape]")
     }
     SECTION("Normal on transformed sphere")
     {
-        Matrix m = scaling(1,0.5,1) * rotation_z(M_PI/5.f); 
+        Matrix4 m = scaling(1,0.5,1) * rotation_z(M_PI/5.f); 
         s.setTransform(m); 
         Vector n = s.normal_at(Point(0.f,sqrt(2)/2.f,-sqrt(2)/2.f),dummy); 
         REQUIRE(n == Vector(0.f,0.97014,-0.24254)); 
@@ -223,7 +239,7 @@ TEST_CASE("Ray plane intersections","[plane][shape]")
 TEST_CASE("A helper for producing a glass sphere","[shapes][sphere]")
 {
     Sphere* s = glass_sphere(); 
-    Matrix I(4,4); 
+    Matrix4 I; 
     I.setIdentity(); 
     REQUIRE(s->transform == I); 
     REQUIRE(equal_double(s->mat.transparency,1));  
@@ -447,7 +463,7 @@ TEST_CASE("The normal vector on a cylinders end caps","[shapes][cylinder]")
 TEST_CASE("Creating a new group","[shapes][group]")
 {
     Group g;
-    Matrix I(4,4); 
+    Matrix4 I; 
     I.setIdentity();  
     REQUIRE(g.transform == I); 
     REQUIRE(g.children.empty()); 
@@ -485,10 +501,10 @@ TEST_CASE("Intersecting a ray with a nonempty group","[shapes][group]")
     Sphere* s1 = new Sphere(); 
 
     Sphere* s2 = new Sphere(); 
-    s2->transform = translation(0,0,-3); 
+    s2->setTransform(translation(0,0,-3)); 
 
     Sphere* s3 = new Sphere(); 
-    s3->transform = translation(5,0,0); 
+    s3->setTransform(translation(5,0,0)); 
 
     g.add_child(s1); 
     g.add_child(s2); 
@@ -512,8 +528,8 @@ TEST_CASE("Intersecting a transformed group","[shapes][group]")
     Group g; 
     Sphere* s1 = new Sphere(); 
 
-    g.transform = scaling(2,2,2); 
-    s1->transform = translation(5,0,0); 
+    g.setTransform(scaling(2,2,2)); 
+    s1->setTransform(translation(5,0,0)); 
 
     g.add_child(s1); 
     g.refresh_bvh(); 
@@ -527,15 +543,15 @@ TEST_CASE("Intersecting a transformed group","[shapes][group]")
 TEST_CASE("Converting a point from world to object space","[shapes][group]")
 {
     Group* g1 = new Group(); 
-    g1->transform = rotation_y(M_PI/2.0); 
+    g1->setTransform(rotation_y(M_PI/2.0)); 
 
     Group* g2 = new Group(); 
-    g2->transform = scaling(2,2,2); 
+    g2->setTransform(scaling(2,2,2)); 
 
     g1->add_child(g2); 
     Sphere* s = new Sphere(); 
 
-    s->transform = translation(5,0,0); 
+    s->setTransform(translation(5,0,0)); 
     g2->add_child(s); 
 
     Point p = world_to_object(s,Point(-2,0,-10)); 
@@ -548,15 +564,15 @@ TEST_CASE("Converting a point from world to object space","[shapes][group]")
 TEST_CASE("Converting a normal from object to world space","[group][shapes]")
 {
     Group* g1 = new Group(); 
-    g1->transform = rotation_y(M_PI/2.0);
+    g1->setTransform(rotation_y(M_PI/2.0));
 
     Group* g2 = new Group(); 
-    g2->transform = scaling(1,2,3); 
+    g2->setTransform(scaling(1,2,3)); 
 
     g1->add_child(g2);
 
     Sphere* s = new Sphere(); 
-    s->transform = translation(5,0,0); 
+    s->setTransform(translation(5,0,0)); 
 
     g2->add_child(s);
 
@@ -568,15 +584,15 @@ TEST_CASE("Converting a normal from object to world space","[group][shapes]")
 TEST_CASE("Finding the normal on a child object","[group][shapes]")
 {
     Group* g1 = new Group(); 
-    g1->transform = rotation_y(M_PI/2.0);
+    g1->setTransform(rotation_y(M_PI/2.0));
 
     Group* g2 = new Group(); 
-    g2->transform = scaling(1,2,3); 
+    g2->setTransform(scaling(1,2,3)); 
 
     g1->add_child(g2);
 
     Sphere* s = new Sphere(); 
-    s->transform = translation(5,0,0); 
+    s->setTransform(translation(5,0,0)); 
 
     g2->add_child(s);
     Intersection dummy(0.0,nullptr); 
@@ -584,6 +600,407 @@ TEST_CASE("Finding the normal on a child object","[group][shapes]")
     REQUIRE(n == Vector(0.2857,0.4286,-0.8571)); 
 }
 
+TEST_CASE("Changing an ancestor transform refreshes the cached world transforms","[shapes][group]")
+{
+    Group* g1 = new Group(); 
+    Group* g2 = new Group(); 
+    Sphere* s = new Sphere(); 
+    s->setTransform(translation(5,0,0)); 
+
+    //Build the hierarchy first and only then set the group transforms
+    g2->add_child(s); 
+    g1->add_child(g2); 
+    g2->setTransform(scaling(1,2,3)); 
+    g1->setTransform(rotation_y(M_PI/2.0)); 
+
+    Matrix4 expected = s->transform.inverse() * g2->transform.inverse() * g1->transform.inverse(); 
+    REQUIRE(s->world_inverse_transform == expected); 
+
+    Point p = world_to_object(s,Point(-2,0,-10)); 
+    REQUIRE(p == Point(5,0,-2.0/3.0)); 
+
+    Vector n = normal_to_world(s,Vector(sqrt(3)/3.0,sqrt(3)/3.0,sqrt(3)/3.0));
+    REQUIRE(n == Vector(0.2857,0.4286,-0.8571)); 
+
+    delete g1; 
+}
+
+TEST_CASE("Instances share one prototype","[shapes][group]")
+{
+    std::shared_ptr<Group> prototype = std::make_shared<Group>(); 
+    prototype->setTransform(scaling(1,2,3)); 
+    Sphere* s = new Sphere(); 
+    s->setTransform(translation(5,0,0)); 
+    prototype->add_child(s); 
+    prototype->refresh_bvh(); 
+
+    Instance* a = new Instance(prototype); 
+    Instance* b = new Instance(prototype); 
+    a->setTransform(rotation_y(M_PI/2.0)); 
+    b->setTransform(translation(0,10,0)); 
+    REQUIRE(prototype.use_count() == 3); 
+
+    //Hits report the instance, and the sphere they came from inside the prototype
+    Ray r(Point(5,10,-20),Vector(0,0,1)); 
+    std::vector<Intersection> xs = b->intersect(r); 
+    REQUIRE(xs.size() == 2); 
+    REQUIRE(equal_double(xs[0].t,17)); 
+    REQUIRE(xs[0].s == b); 
+    REQUIRE(xs[0].primitive == s); 
+    REQUIRE(a->intersect(r).empty()); 
+
+    Intersection hit(0,nullptr); 
+    REQUIRE(b->intersect_closest(r,hit)); 
+    REQUIRE(hit.s == b); 
+    REQUIRE(hit.primitive == s); 
+    REQUIRE(b->intersect_any(r,20)); 
+    REQUIRE(!b->intersect_any(r,16)); 
+
+    //Same normal as the sphere nested in rotation_y(pi/2) and scaling(1,2,3) groups
+    Intersection on_a(0,a); 
+    on_a.primitive = s; 
+    Vector n = a->normal_at(Point(1.73321,1.1547,-5.5774),on_a); 
+    REQUIRE(n == Vector(0.2857,0.4286,-0.8571)); 
+
+    AABB box = a->parent_bounds(); 
+    REQUIRE(box.minimum == Point(-3,-2,-6)); 
+    REQUIRE(box.maximum == Point(3,2,-4)); 
+
+    //Deleting the instances leaves the prototype alone
+    delete a; 
+    delete b; 
+    REQUIRE(prototype.use_count() == 1); 
+    REQUIRE(prototype->children[0] == s); 
+}
+
+TEST_CASE("A BVH over thousands of instances of one prototype","[shapes][group]")
+{
+    std::shared_ptr<Group> prototype = std::make_shared<Group>(); 
+    prototype->add_child(new Sphere()); 
+    prototype->refresh_bvh(); 
+
+    //Enough instances for the build to work out their bounds on several threads
+    Group scene; 
+    for(int i = 0; i < 6000; i++)
+    {
+        Instance* instance = new Instance(prototype); 
+        instance->setTransform(translation(3 * (i % 100),3 * (i / 100),0)); 
+        scene.add_child(instance); 
+    }
+    scene.refresh_bvh(); 
+
+    REQUIRE(scene.bounds().minimum == Point(-1,-1,-1)); 
+    REQUIRE(scene.bounds().maximum == Point(298,178,1)); 
+
+    Intersection hit(0,nullptr); 
+    REQUIRE(scene.intersect_closest(Ray(Point(3 * 42,3 * 17,-5),Vector(0,0,1)),hit)); 
+    REQUIRE(hit.s == scene.children[17 * 100 + 42]); 
+    REQUIRE(equal_double(hit.t,4)); 
+}
+
+TEST_CASE("A triangle mesh finds the same hits as separate triangles","[triangle][shapes]")
+{
+    //A bumpy height field, as a mesh and as a group of triangles
+    TriangleMesh* mesh = new TriangleMesh(); 
+    Group* g = new Group(); 
+    for(int i = 0; i <= 10; i++)
+    {
+        for(int j = 0; j <= 10; j++)
+        {
+            mesh->add_vertex(Point(i,0.3 * sin(i + 2 * j),j)); 
+        }
+    }
+    for(int i = 0; i < 10; i++)
+    {
+        for(int j = 0; j < 10; j++)
+        {
+            int a = i * 11 + j; 
+            mesh->add_triangle(a,a + 11,a + 12); 
+            mesh->add_triangle(a,a + 12,a + 1); 
+            g->add_child(new Triangle(mesh->vertices[a],mesh->vertices[a + 11],mesh->vertices[a + 12])); 
+            g->add_child(new Triangle(mesh->vertices[a],mesh->vertices[a + 12],mesh->vertices[a + 1])); 
+        }
+    }
+    mesh->refresh_bvh(); 
+    g->refresh_bvh(); 
+
+    REQUIRE(mesh->triangle_count() == 200); 
+    REQUIRE(mesh->bounds().minimum.x == 0); 
+    REQUIRE(mesh->bounds().maximum.z == 10); 
+
+    for(int k = 0; k < 50; k++)
+    {
+        Ray r(Point(0.37 + 0.19 * k,5,0.21 + 0.17 * k),Vector(0.05,-1,0.02 * (k % 5))); 
+        std::vector<Intersection> xs_mesh = mesh->intersect(r); 
+        std::vector<Intersection> xs_group = g->intersect(r); 
+        REQUIRE(xs_mesh.size() == xs_group.size()); 
+        REQUIRE(!xs_mesh.empty()); 
+
+        std::sort(xs_mesh.begin(),xs_mesh.end(),comp_intersection); 
+        const Triangle* tri = static_cast<const Triangle*>(xs_group[0].s); 
+        REQUIRE(equal_double(xs_mesh[0].t,xs_group[0].t)); 
+        REQUIRE(xs_mesh[0].s == mesh); 
+        REQUIRE(mesh->local_normal_at(Point(0,0,0),xs_mesh[0]) == tri->normal); 
+
+        Intersection hit(0,nullptr); 
+        REQUIRE(mesh->intersect_closest(r,hit)); 
+        REQUIRE(hit.index == xs_mesh[0].index); 
+        REQUIRE(mesh->intersect_any(r,hit.t + 0.01)); 
+        REQUIRE(!mesh->intersect_any(r,hit.t - 0.01)); 
+    }
+
+    delete mesh; 
+    delete g; 
+}
+
+TEST_CASE("A triangle mesh interpolates the normals of smooth triangles","[triangle][shapes]")
+{
+    TriangleMesh mesh; 
+    mesh.add_vertex(Point(0,1,0)); 
+    mesh.add_vertex(Point(-1,0,0)); 
+    mesh.add_vertex(Point(1,0,0)); 
+    mesh.add_normal(Vector(0,1,0)); 
+    mesh.add_normal(Vector(-1,0,0)); 
+    mesh.add_normal(Vector(1,0,0)); 
+    mesh.add_triangle(0,1,2); 
+    mesh.add_triangle(0,1,2,0,1,2); 
+    mesh.refresh_bvh(); 
+
+    //The flat triangle added first got -1 normal indices
+    REQUIRE(mesh.normal_indices == std::vector<int>({-1,-1,-1, 0,1,2})); 
+
+    //Same as "A smooth triangle uses u/v to interpolate the normal"
+    Intersection smooth(1,&mesh,0.45,0.25); 
+    smooth.index = 1; 
+    REQUIRE(mesh.local_normal_at(Point(0,0,0),smooth) == Vector(-0.2,0.3,0)); 
+
+    Intersection flat(1,&mesh,0.45,0.25); 
+    flat.index = 0; 
+    REQUIRE(mesh.local_normal_at(Point(0,0,0),flat) == Vector(0,0,-1)); 
+
+    //Baking a mirror moves the vertices and keeps the flat normal on the same side
+    mesh.bake_transform(scaling(-1,1,1)); 
+    REQUIRE(mesh.vertices[1] == Point(1,0,0)); 
+    REQUIRE(mesh.local_normal_at(Point(0,0,0),flat) == Vector(0,0,-1)); 
+    REQUIRE(mesh.bounds().maximum == Point(1,1,0)); 
+}
+
+TEST_CASE("A triangle mesh's packed blocks give the same hits as its triangles one at a time","[triangle][shapes]")
+{
+    //A wavy sphere, so leaves hold triangles facing every way
+    TriangleMesh mesh; 
+    TriangleMesh unpacked; 
+    unpacked.pack_blocks = false; 
+    int n = 24; 
+    for(TriangleMesh* m: {&mesh,&unpacked})
+    {
+        for(int i = 0; i <= n; i++)
+        {
+            for(int j = 0; j <= n; j++)
+            {
+                double theta = M_PI * i / n; 
+                double phi = 2 * M_PI * j / n; 
+                double radius = 2 + 0.2 * sin(5 * theta) * cos(3 * phi); 
+                m->add_vertex(Point(radius * sin(theta) * cos(phi),radius * cos(theta),radius * sin(theta) * sin(phi))); 
+            }
+        }
+        for(int i = 0; i < n; i++)
+        {
+            for(int j = 0; j < n; j++)
+            {
+                int a = i * (n + 1) + j; 
+                m->add_triangle(a,a + n + 1,a + 1); 
+                m->add_triangle(a + 1,a + n + 1,a + n + 2); 
+            }
+        }
+        m->refresh_bvh(); 
+    }
+    REQUIRE(unpacked.blocks.empty()); 
+
+    //Every leaf starts a block and every triangle is packed exactly once
+    std::vector<int> packed(mesh.triangle_count(),0); 
+    for(const BVH4Node& node: mesh.bvh->wide_nodes)
+    {
+        for(int lane = 0; lane < node.child_count; lane++)
+        {
+            if(node.count[lane] > 0)
+                REQUIRE(node.child[lane] % 4 == 0); 
+        }
+    }
+    for(const TriangleBlock& block: mesh.blocks)
+    {
+        for(int lane = 0; lane < 4; lane++)
+        {
+            if(block.tri[lane] >= 0)
+                packed[block.tri[lane]]++; 
+        }
+    }
+    REQUIRE(std::count(packed.begin(),packed.end(),1) == mesh.triangle_count()); 
+
+    auto make_ray = [](int k)
+    {
+        Point origin(3 * sin(0.7 * k),3 * cos(1.3 * k),-4 + 0.03 * k); 
+        return Ray(origin,(Point(sin(k),cos(2.1 * k),0.5 * sin(3.7 * k)) - origin).normalize()); 
+    }; 
+
+    //Every triangle tested on its own
+    auto reference = [&](const Ray& r, std::vector<Intersection>& xs)
+    {
+        for(int tri = 0; tri < mesh.triangle_count(); tri++)
+        {
+            mesh.intersect_triangle(tri,TriangleRay(r),xs); 
+        }
+    }; 
+
+    for(const TriangleMesh* m: {&mesh,&unpacked})
+    {
+        require_queries_match(200,make_ray,reference,
+            [&](const Ray& r) {return m->local_intersect(r);},
+            [&](const Ray& r, Intersection& hit) {return m->local_intersect_closest(r,hit,std::numeric_limits<double>::infinity());},
+            [&](const Ray& r, double t_max) {return m->local_intersect_any(r,t_max);},
+            [&](const Ray& r, const Intersection& hit, const Intersection& nearest)
+            {
+                REQUIRE(hit.index == nearest.index); 
+                REQUIRE(hit.t == nearest.t); 
+            }); 
+    }
+}
+
+TEST_CASE("Rays from inside a closed triangle mesh always hit it","[triangle][shapes]")
+{
+    //A finely tessellated sphere whose neighboring triangles share their vertices, with one vertex at each pole
+    TriangleMesh mesh; 
+    int rings = 40; 
+    int segments = 80; 
+    double radius = 0.05; 
+    int top = mesh.add_vertex(Point(0,radius,0)); 
+    for(int i = 1; i < rings; i++)
+    {
+        for(int j = 0; j < segments; j++)
+        {
+            double theta = M_PI * i / rings; 
+            double phi = 2 * M_PI * j / segments; 
+            mesh.add_vertex(Point(radius * sin(theta) * cos(phi),radius * cos(theta),radius * sin(theta) * sin(phi))); 
+        }
+    }
+    int bottom = mesh.add_vertex(Point(0,-radius,0)); 
+
+    auto ring_vertex = [&](int i, int j) {return 1 + (i - 1) * segments + j % segments;}; 
+    for(int j = 0; j < segments; j++)
+    {
+        mesh.add_triangle(top,ring_vertex(1,j),ring_vertex(1,j + 1)); 
+        mesh.add_triangle(bottom,ring_vertex(rings - 1,j + 1),ring_vertex(rings - 1,j)); 
+        for(int i = 1; i < rings - 1; i++)
+        {
+            mesh.add_triangle(ring_vertex(i,j),ring_vertex(i + 1,j),ring_vertex(i,j + 1)); 
+            mesh.add_triangle(ring_vertex(i,j + 1),ring_vertex(i + 1,j),ring_vertex(i + 1,j + 1)); 
+        }
+    }
+    mesh.refresh_bvh(); 
+
+    //Many of these pass right through the shared edges and vertices
+    int misses = 0; 
+    for(int i = 0; i <= 2 * rings; i++)
+    {
+        for(int j = 0; j < 2 * segments; j++)
+        {
+            double theta = M_PI * i / (2 * rings); 
+            double phi = 2 * M_PI * j / (2 * segments); 
+            Ray r(Point(0,0,0),Vector(sin(theta) * cos(phi),cos(theta),sin(theta) * sin(phi))); 
+
+            Intersection hit(0,nullptr); 
+            if(!mesh.local_intersect_closest(r,hit,std::numeric_limits<double>::infinity()))
+                misses++; 
+        }
+    }
+    REQUIRE(misses == 0); 
+}
+
+TEST_CASE("A particle set gives the same hits as a sphere per particle","[particles][shapes]")
+{
+    ParticleSet set; 
+    int red = set.add_material(Material()); 
+    set.materials[red].mat_color = Color(1,0,0); 
+
+    std::vector<Sphere*> spheres; 
+    for(int i = 0; i < 300; i++)
+    {
+        Point center(4 * sin(1.7 * i),4 * cos(2.3 * i),4 * sin(0.9 * i + 1)); 
+        double radius = 0.125 + 0.25 * (i % 5); 
+        set.add_particle(center,radius,i % 2 == 0 ? red : -1); 
+
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation(center.x,center.y,center.z) * scaling(radius,radius,radius)); 
+        spheres.push_back(s); 
+    }
+    set.refresh_bvh(); 
+
+    //Flat arrays, a double per coordinate, a float radius and an int material
+    REQUIRE(set.centers.size() * sizeof(double) + set.radii.size() * sizeof(float) + set.material_indices.size() * sizeof(int) == 32 * 300); 
+
+    require_queries_match(200,
+        [](int k)
+        {
+            Point origin(7 * sin(0.7 * k),7 * cos(1.3 * k),-8 + 0.05 * k); 
+            return Ray(origin,(Point(2 * sin(k),2 * cos(2.1 * k),sin(3.7 * k)) - origin).normalize()); 
+        },
+        [&](const Ray& r, std::vector<Intersection>& xs)
+        {
+            for(Sphere* s: spheres)
+            {
+                s->intersect_into(r,xs); 
+            }
+        },
+        [&](const Ray& r) {return set.local_intersect(r);},
+        [&](const Ray& r, Intersection& hit) {return set.local_intersect_closest(r,hit,std::numeric_limits<double>::infinity());},
+        [&](const Ray& r, double t_max) {return set.local_intersect_any(r,t_max);},
+        [&](const Ray& r, const Intersection& hit, const Intersection& nearest)
+        {
+            //The particles were put in leaf order, so compare them by their centers
+            int best = (int)(std::find(spheres.begin(),spheres.end(),nearest.s) - spheres.begin()); 
+            REQUIRE(equal_double(hit.t,nearest.t)); 
+            Point center = nearest.s->transform * Point(0,0,0); 
+            REQUIRE(Point(set.centers[3 * hit.index],set.centers[3 * hit.index + 1],set.centers[3 * hit.index + 2]) == center); 
+            REQUIRE(set.normal_at(r.position(hit.t),hit) == nearest.s->normal_at(r.position(nearest.t),nearest)); 
+            REQUIRE(set.material_at(hit).mat_color == (best % 2 == 0 ? Color(1,0,0) : set.mat.mat_color)); 
+        }); 
+
+    for(Sphere* s: spheres)
+    {
+        delete s; 
+    }
+}
+
+TEST_CASE("Baking a similarity transform into a particle set moves its particles","[particles][shapes]")
+{
+    ParticleSet set; 
+    set.add_particle(Point(1,0,0),0.5); 
+    set.refresh_bvh(); 
+    set.bake_transform(translation(0,2,0) * scaling(2,2,2)); 
+
+    REQUIRE(set.transform_type == TRANSFORM_TYPE::IDENTITY); 
+    REQUIRE(set.radii[0] == 1.0f); 
+    REQUIRE(set.bounds().minimum == Point(1,1,-1)); 
+    REQUIRE(set.bounds().maximum == Point(3,3,1)); 
+
+    std::vector<Intersection> xs = set.intersect(Ray(Point(2,2,-5),Vector(0,0,1))); 
+    REQUIRE(xs.size() == 2); 
+    REQUIRE(equal_double(xs[0].t,4)); 
+    REQUIRE(equal_double(xs[1].t,6)); 
+
+    //Rotations keep the particles spheres too
+    set.bake_transform(rotation_z(M_PI / 2) * scaling(0.5,0.5,0.5)); 
+    REQUIRE(set.transform_type == TRANSFORM_TYPE::IDENTITY); 
+    REQUIRE(set.radii[0] == 0.5f); 
+    REQUIRE(set.bounds().minimum == Point(-1.5,0.5,-0.5)); 
+    REQUIRE(set.bounds().maximum == Point(-0.5,1.5,0.5)); 
+
+    //A non-uniform scale would stretch them into ellipsoids, so it stays a transform
+    set.bake_transform(scaling(1,2,1)); 
+    REQUIRE(set.transform_type != TRANSFORM_TYPE::IDENTITY); 
+    REQUIRE(set.radii[0] == 0.5f); 
+}
+
 TEST_CASE("Constructing a triangle","[triangle][shapes]")
 {
     Point p1(0,1,0); 
@@ -663,6 +1080,36 @@ TEST_CASE("A ray strikes a triangle","[triangle][shapes]")
     REQUIRE(xs[0].t == 2);  
 }
 
+TEST_CASE("A ray strikes a small triangle","[triangle][shapes]")
+{
+    Triangle t(Point(0,0.001,0),Point(-0.001,0,0),Point(0.001,0,0)); 
+    Ray r(Point(0,0.0005,-2),Vector(0,0,1)); 
+
+    std::vector<Intersection> xs = t.local_intersect(r); 
+
+    REQUIRE(xs.size() == 1); 
+    REQUIRE(xs[0].t == 2); 
+    REQUIRE(equal_double(xs[0].u,0.25)); 
+    REQUIRE(equal_double(xs[0].v,0.25)); 
+}
+
+TEST_CASE("A ray through an edge shared by two triangles hits at least one of them","[triangle][shapes]")
+{
+    Triangle t1(Point(0,0,0),Point(1,0,0),Point(0.3,1,0.2)); 
+    Triangle t2(Point(1,0,0),Point(1.2,1.1,0.1),Point(0.3,1,0.2)); 
+
+    for(int k = 0; k <= 100; k++)
+    {
+        //Points along the shared edge, reached from an oblique direction
+        double s = k / 100.0; 
+        Point on_edge(1 - 0.7 * s,s,0.2 * s); 
+        Vector direction = Vector(0.31,-0.17,1).normalize(); 
+        Ray r(on_edge + direction * -3.7,direction); 
+
+        REQUIRE(t1.local_intersect(r).size() + t2.local_intersect(r).size() >= 1); 
+    }
+}
+
 TEST_CASE("Constructing a smooth triangle","[triangle][shapes]")
 {
     Point p1(0,1,0); 
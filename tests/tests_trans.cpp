@@ -8,23 +8,25 @@
 #include "canvas.h"
 #include "matrix.h"
 #include "transformations.h"
+#include "ray.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <iostream>
 #include <fstream>
 #include <array>
+#include <vector>
 
 
 TEST_CASE("Translation","[transformations]")
 {
-    Matrix A = translation(5,-3,2); 
+    Matrix4 A = translation(5,-3,2); 
     Point p1(-3,4,5); 
     Point p2 = A * p1; 
 
     REQUIRE(p2 == Point(2,1,7)); 
 
-    Matrix inv_A = A.inverse(); 
+    Matrix4 inv_A = A.inverse(); 
     Point p3 = Point(-3,4,5); 
     Point p4 = inv_A * p3; 
 
@@ -39,7 +41,7 @@ TEST_CASE("Translation","[transformations]")
 TEST_CASE("Scaling","[transformations]")
 {
 
-    Matrix A = scaling(2,3,4); 
+    Matrix4 A = scaling(2,3,4); 
     SECTION("Points")
     {
 
@@ -60,7 +62,7 @@ TEST_CASE("Scaling","[transformations]")
 
 TEST_CASE("Reflection","[transformations]")
 {
-    Matrix A = scaling(-1,1,1); 
+    Matrix4 A = scaling(-1,1,1); 
     Point p1(2,3,4); 
     Point p2 = A * p1; 
 
@@ -71,13 +73,13 @@ TEST_CASE("Rotation","[transformations]")
 {
     SECTION("X Rotation")
     {
-        Matrix A = rotation_x(M_PI/4.f); 
+        Matrix4 A = rotation_x(M_PI/4.f); 
         Point p1(0,1,0); 
         Point p2 = A * p1; 
 
         REQUIRE(p2 == Point(0,sqrt(2)/2,sqrt(2)/2)); 
 
-        Matrix B = rotation_x(M_PI/2.f); 
+        Matrix4 B = rotation_x(M_PI/2.f); 
         p1 = Point(0,1,0); 
         p2 = B * p1; 
 
@@ -86,13 +88,13 @@ TEST_CASE("Rotation","[transformations]")
 
     SECTION("Y Rotation")
     {
-        Matrix A = rotation_y(M_PI/4.f); 
+        Matrix4 A = rotation_y(M_PI/4.f); 
         Point p1(0,0,1); 
         Point p2 = A * p1; 
 
         REQUIRE(p2 == Point(sqrt(2)/2,0,sqrt(2)/2)); 
 
-        Matrix B = rotation_y(M_PI/2.f); 
+        Matrix4 B = rotation_y(M_PI/2.f); 
         p1 = Point(0,0,1); 
         p2 = B * p1; 
 
@@ -101,13 +103,13 @@ TEST_CASE("Rotation","[transformations]")
 
     SECTION("Z Rotation")
     {
-        Matrix A = rotation_z(M_PI/4.f); 
+        Matrix4 A = rotation_z(M_PI/4.f); 
         Point p1(0,1,0); 
         Point p2 = A * p1; 
 
         REQUIRE(p2 == Point(-sqrt(2)/2,sqrt(2)/2,0)); 
 
-        Matrix B = rotation_z(M_PI/2.f); 
+        Matrix4 B = rotation_z(M_PI/2.f); 
         p1 = Point(0,1,0); 
         p2 = B * p1; 
 
@@ -120,7 +122,7 @@ TEST_CASE("Skew","[transformations]")
 {
     SECTION("Test x_y")
     {
-        Matrix A = skew(1,0,0,0,0,0); 
+        Matrix4 A = skew(1,0,0,0,0,0); 
         Point p1 = Point(2,3,4); 
         Point p2 = A * p1; 
 
@@ -129,7 +131,7 @@ TEST_CASE("Skew","[transformations]")
 
     SECTION("Test x_z")
     {
-        Matrix A = skew(0,1,0,0,0,0); 
+        Matrix4 A = skew(0,1,0,0,0,0); 
         Point p1 = Point(2,3,4); 
         Point p2 = A * p1; 
 
@@ -138,7 +140,7 @@ TEST_CASE("Skew","[transformations]")
 
     SECTION("Test y_x")
     {
-        Matrix A = skew(0,0,1,0,0,0); 
+        Matrix4 A = skew(0,0,1,0,0,0); 
         Point p1 = Point(2,3,4); 
         Point p2 = A * p1; 
 
@@ -147,7 +149,7 @@ TEST_CASE("Skew","[transformations]")
 
     SECTION("Test y_z")
     {
-        Matrix A = skew(0,0,0,1,0,0); 
+        Matrix4 A = skew(0,0,0,1,0,0); 
         Point p1 = Point(2,3,4); 
         Point p2 = A * p1; 
 
@@ -156,7 +158,7 @@ TEST_CASE("Skew","[transformations]")
 
     SECTION("Test z_x")
     {
-        Matrix A = skew(0,0,0,0,1,0); 
+        Matrix4 A = skew(0,0,0,0,1,0); 
         Point p1 = Point(2,3,4); 
         Point p2 = A * p1; 
 
@@ -165,7 +167,7 @@ TEST_CASE("Skew","[transformations]")
 
     SECTION("Test z_x")
     {
-        Matrix A = skew(0,0,0,0,0,1); 
+        Matrix4 A = skew(0,0,0,0,0,1); 
         Point p1 = Point(2,3,4); 
         Point p2 = A * p1; 
 
@@ -178,9 +180,9 @@ TEST_CASE("Chained Transformations")
     SECTION("Apply one by one")
     {
         Point p1(1,0,1); 
-        Matrix A = rotation_x(M_PI/2.f); 
-        Matrix B = scaling(5,5,5); 
-        Matrix C = translation(10,5,7); 
+        Matrix4 A = rotation_x(M_PI/2.f); 
+        Matrix4 B = scaling(5,5,5); 
+        Matrix4 C = translation(10,5,7); 
 
         //apply rotation first 
         Point p2 = A * p1; 
@@ -195,11 +197,11 @@ TEST_CASE("Chained Transformations")
     SECTION("Chained transformations")
     {
         Point p1(1,0,1); 
-        Matrix A = rotation_x(M_PI/2.f); 
-        Matrix B = scaling(5,5,5); 
-        Matrix C = translation(10,5,7); 
+        Matrix4 A = rotation_x(M_PI/2.f); 
+        Matrix4 B = scaling(5,5,5); 
+        Matrix4 C = translation(10,5,7); 
 
-        Matrix T = C * B * A; 
+        Matrix4 T = C * B * A; 
         Point p2 = T * p1; 
 
         REQUIRE(p2 == Point(15,0,7)); 
@@ -215,9 +217,9 @@ TEST_CASE("View transformations","[transformations]")
         Point to(0,0,-1); 
         Vector up(0,1,0); 
 
-        Matrix t = view_transform(from,to,up); 
+        Matrix4 t = view_transform(from,to,up); 
 
-        Matrix I(4,4); 
+        Matrix4 I; 
         I.setIdentity(); 
 
         REQUIRE(t == I); 
@@ -229,7 +231,7 @@ TEST_CASE("View transformations","[transformations]")
         Point to(0,0,0); 
         Vector up(0,1,0); 
 
-        Matrix t = view_transform(from,to,up); 
+        Matrix4 t = view_transform(from,to,up); 
 
         REQUIRE(t == translation(0,0,-8)); 
     }
@@ -240,18 +242,60 @@ TEST_CASE("View transformations","[transformations]")
         Point to(4,-2,8); 
         Vector up(1,1,0); 
 
-        Matrix t = view_transform(from,to,up); 
+        Matrix4 t = view_transform(from,to,up); 
 
-        std::vector<double> desired_data = {
+        std::array<double,16> desired_data = {
             -.50709,0.50709,0.67612,-2.36643,
             0.76772,0.60609,0.12122,-2.82843,
             -0.35857,0.59761,-0.71714,0.0,
             0,0,0,1}; 
 
-        Matrix desired(4,4,desired_data); 
+        Matrix4 desired(desired_data); 
 
         REQUIRE(t == desired); 
     }
 
 
-}
\ No newline at end of file
+}
+TEST_CASE("Classifying transforms","[transformations]")
+{
+    REQUIRE(Matrix4().classify() == TRANSFORM_TYPE::IDENTITY); 
+    REQUIRE(translation(1,-2,3).classify() == TRANSFORM_TYPE::TRANSLATION); 
+    REQUIRE(scaling(2,2,2).classify() == TRANSFORM_TYPE::UNIFORM_SCALE); 
+    REQUIRE((translation(1,2,3) * scaling(0.5,0.5,0.5)).classify() == TRANSFORM_TYPE::UNIFORM_SCALE); 
+    REQUIRE(scaling(1,2,3).classify() == TRANSFORM_TYPE::AFFINE); 
+    REQUIRE(rotation_x(M_PI/4.f).classify() == TRANSFORM_TYPE::AFFINE); 
+
+    Matrix4 projective; 
+    projective.setElement(3,2,-1); 
+    REQUIRE(projective.classify() == TRANSFORM_TYPE::GENERAL); 
+}
+
+TEST_CASE("Fast path tuple transforms match the full product","[transformations]")
+{
+    Point p(1.5,-2,3); 
+    Vector v(-0.5,4,2); 
+
+    Matrix4 projective = rotation_y(0.3); 
+    projective.setElement(3,0,0.25); 
+
+    std::vector<Matrix4> transforms = {
+        Matrix4(),
+        translation(1,-2,3),
+        translation(1,2,3) * scaling(-0.5,-0.5,-0.5),
+        translation(4,0,1) * rotation_z(M_PI/5.f) * scaling(1,2,3),
+        projective}; 
+
+    for(const Matrix4& m: transforms)
+    {
+        TRANSFORM_TYPE type = m.classify(); 
+        REQUIRE(transform_point(m,type,p) == m * p); 
+        REQUIRE(transform_vector(m,type,v) == m * v); 
+
+        Ray r(p,v); 
+        Ray fast = r.ray_transform(m,type); 
+        Ray full = r.ray_transform(m); 
+        REQUIRE(fast.origin == full.origin); 
+        REQUIRE(fast.direction == full.direction); 
+    }
+}
@@ -15,6 +15,7 @@
 #include "materials.h"
 #include "world.h"
 #include "intersection.h"
+#include "allocation_counter.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -35,6 +36,49 @@ TEST_CASE("Intersect a world with a ray","[world]")
     REQUIRE(equal_double(xs[3].t,6.0)); 
 }
 
+TEST_CASE("Adding objects to a world builds its BVH lazily","[world]")
+{
+    World w; 
+    w.empty_objects(); 
+
+    std::vector<Shape*> spheres; 
+    for(int i = 0; i < 40; i++)
+    {
+        Sphere* s = new Sphere(); 
+        s->setTransform(translation(3 * i,0,0)); 
+        spheres.push_back(s); 
+    }
+    w.add_objects(spheres); 
+    REQUIRE(w.bvh_dirty); 
+
+    //The first trace builds it
+    Ray r(Point(0,0,-5),Vector(0,0,1)); 
+    REQUIRE(w.intersect(r).size() == 2); 
+    REQUIRE(!w.bvh_dirty); 
+    REQUIRE(count_bvh(w.bvh) == 40); 
+
+    //A few more shapes go straight into the built BVH
+    Sphere* extra = new Sphere(); 
+    extra->setTransform(translation(0,0,10)); 
+    w.add_object(extra); 
+    REQUIRE(!w.bvh_dirty); 
+    REQUIRE(w.incremental_inserts == 1); 
+    REQUIRE(count_bvh(w.bvh) == 41); 
+
+    std::vector<Intersection> xs = w.intersect(r); 
+    REQUIRE(xs.size() == 4); 
+    REQUIRE(xs[2].s == extra); 
+
+    //Enough of them and the BVH is rebuilt instead
+    while(!w.bvh_dirty)
+    {
+        w.add_object(new Sphere()); 
+    }
+    REQUIRE(w.incremental_inserts * 4 <= (int)w.world_objects.size()); 
+    REQUIRE(w.intersect(r).size() > 4); 
+    REQUIRE(w.incremental_inserts == 0); 
+}
+
 TEST_CASE("Precomputing the state of an intersection","[computations]")
 {
     Ray r(Point(0,0,-5),Vector(0,0,1)); 
@@ -135,7 +179,7 @@ TEST_CASE("Constructing a camera","[camera]")
     REQUIRE(c.hsize == 160); 
     REQUIRE(c.vsize == 120); 
     REQUIRE(c.field_of_view == M_PI/2.f); 
-    Matrix I(4,4); 
+    Matrix4 I; 
     I.setIdentity(); 
     REQUIRE(c.transform == I); 
 }
@@ -178,4 +222,66 @@ TEST_CASE("Constructing rays through the canvas","[camera]")
         REQUIRE(r.direction == Vector(sqrt(2)/2.f,0.,-sqrt(2)/2.f)); 
     }
 }
- 
\ No newline at end of file
+ 
+TEST_CASE("Tracing rays does not allocate once the scratch buffers have grown","[world]")
+{
+    World w; 
+
+    //A transparent sphere and a mesh group so refraction and nested BVHs are exercised too
+    Sphere* glass = new Sphere(); 
+    glass->setTransform(translation(0,0,-2) * scaling(0.5,0.5,0.5)); 
+    glass->mat.transparency = 0.8; 
+    glass->mat.refractive_index = 1.5; 
+    glass->mat.reflective = 0.5; 
+    w.add_object(glass); 
+
+    Group* g = new Group(); 
+    for(int i = 0; i < 20; i++)
+    {
+        g->add_child(new Triangle(Point(i * 0.2 - 2,-1,1),Point(i * 0.2 - 1.8,-1,1),Point(i * 0.2 - 1.9,1,1.5))); 
+    }
+    g->refresh_bvh(); 
+    w.add_object(g); 
+
+    Camera c(20,20,M_PI/2); 
+    c.transform = view_transform(Point(0,0,-5),Point(0,0,0),Vector(0,1,0)); 
+
+    auto trace = [&]()
+    {
+        double sum = 0; 
+        for(int y = 0; y < c.vsize; y++)
+        {
+            for(int x = 0; x < c.hsize; x++)
+            {
+                Color col = w.color_at(c.ray_for_pixel(x,y)); 
+                sum += col.x + col.y + col.z; 
+            }
+        }
+        return sum; 
+    }; 
+
+    //The counter itself must see allocations
+    {
+        AllocationCounter probe_counter; 
+        void* single = ::operator new(16); 
+        void* array = ::operator new[](16); 
+        ::operator delete(single); 
+        ::operator delete[](array); 
+        REQUIRE(probe_counter.count == 2); 
+    }
+
+    //The first pass grows the scratch buffers to the size this scene needs
+    double first = trace(); 
+
+    long allocations; 
+    double second; 
+    {
+        AllocationCounter counter; 
+        second = trace(); 
+        allocations = counter.count; 
+    }
+
+    REQUIRE(allocations == 0); 
+    REQUIRE(first == second); 
+    REQUIRE(first > 0); 
+}